@@ -1,37 +1,76 @@
 // auto_region.cpp
 // 用法：
-//   g++ -O3 -std=gnu++11 -fopenmp auto_region.cpp -o auto_region
+//   g++ -O3 -std=gnu++11 -fopenmp auto_region.cpp -o auto_region -lz -pthread
 //   ./auto_region ref.fa in.sam out_dir
+//   ./auto_region --save-profile kit.prof ref.fa in.sam out_dir
+//   ./auto_region --profile kit.prof [--profile-rescale] ref.fa in.sam out_dir
+//   ./auto_region --sorted ref.fa in.sam out_dir
+//   ./auto_region --sidecar ref.fa in.sam out_dir
+//   ./auto_region --plan-sample ref.fa in.sam out_dir
+//
+// in.sam 可以是 plain / gzip / BGZF（见 sam_input.h，BGZF 多线程并行解压）。
 //
 // 功能：
 //   1. 从 ref.fa 中解析出 chr 名和长度（只保留 chr1-22, chrX, chrY）。
-//   2. 整个 in.sam 读入内存 sam_buf，一次遍历：
+//   2. 整个 in.sam 分块并行 pread 到内存 sam_buf（各线程 first-touch 自己的块，
+//      页面分散在各 NUMA 节点；线程默认按 socket 轮流绑核），并行遍历：
 //        - 收集 header 行；
 //        - 解析每个 alignment，记录 chr_id, pos, offset, len；
 //        - 按 chr/bin 累积“字节权重” bin_weight，用于估计每个区间的 SAM 字节数。
 //   3. 对每个 chr，用 bin_weight + 目标大小（默认 2 MB）切成若干 region[start,end]，不跨 chr。
+//      权重过大的热点 bin（着丝粒、扩增子堆积）再按 1bp 统计，规划时可以在 bin 内部切开，
+//      保证 region 连同 header 不超过 MAX_REGION_MB（单个位置本身超过上限时无法再切，会给出警告）。
+//      --save-profile 把 bin_weight 存成二进制 profile；--profile 则直接从 profile 加载
+//      bin_weight 并在读 SAM 之前规划好 region（可选按输入大小缩放），不再统计直方图。
+//      --plan-sample 只用 pread 读均匀分布的约 1% 字节块估计 bin_weight，
+//      同样在读 SAM 之前规划 region，并给出各 region 预测大小的估计误差。
 //   4. 构建 per-chr 的 record 索引列表 chr_rec_indices[chr]。
-//   5. 使用 OpenMP 按 chr 并行：每个线程只处理一个 chr，把属于它的记录写到相应 region 的 SAM 文件里：
+//   5. 把所有非空 region 按字节数从大到小排成任务队列，使用 OpenMP 按 region 并行，
+//      每个 region 的记录以大批量 writev 写到相应 region 的 SAM 文件里：
 //        out_dir/chrX_start_end.sam
 //      每个 region 文件会写完整 SAM header。
+//      --sorted 时每个 region 内的记录先按 POS 稳定排序（bin 计数排序 + bin 内排序），
+//      header 的 @HD 标记为 SO:coordinate，sw_sam_process 对这类文件跳过排序。
+//      --sidecar 时每个 region 额外写 out_dir/chrX_start_end.sidx（见 sam_sidecar.h），
+//      sw_sam_process 的从核可以直接使用其中预解析的字段。
+//   6. unmapped（RNAME 为 '*' 或 POS<=0）、不在 chr1-22/X/Y 上、或落不进任何 region 的记录
+//      按输入顺序写到 out_dir/unmapped.sam（不参与排序，header 与输入相同），
+//      sw_sam_process 最后原样输出它；--drop-unmapped 时直接丢弃（旧行为）。
 
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <cmath>
 #include <string>
 #include <vector>
 #include <unordered_map>
+#include <algorithm>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <errno.h>
+#include <sched.h>
 
 #ifdef _OPENMP
 #include <omp.h>
 #endif
 
+#include "sam_fields.h"
+#include "sam_sidecar.h"
+#include "sam_input.h"
+
 // ---------------- 可调参数 ----------------
 static const double TARGET_REGION_MB = 64.0;         // 目标每个 region 文件大小（MB）
 static const int    BIN_SIZE        = 1000;       // 深度离散 bin 大小（bp）
+static const double MAX_REGION_MB    = 100.0;        // region 文件上限（与 src/main.c 的 MAX_BUF_SIZE 一致）
+static const double HOT_BIN_FRACTION = 0.25;         // bin 权重超过 target 的这个比例就细化到 1bp
+static const double PLAN_SAMPLE_FRACTION = 0.01;     // --plan-sample 抽样的字节比例
+static const size_t PLAN_SAMPLE_BLOCK    = 64 * 1024;  // 每个抽样块大小
+static const size_t PLAN_SAMPLE_TAIL     = 64 * 1024;  // 块尾先多读的字节，最后一行更长时再续读
+static const uint64_t PLAN_SAMPLE_MIN_BLOCKS = 64;     // 至少抽这么多块，块间方差才有意义
+static const size_t LOAD_CHUNK = 64 * 1024 * 1024;   // 并行读入 / 解析 SAM 的分块大小
 
 // ---------------- 计时辅助 ----------------
 static double now_ms()
@@ -45,6 +84,9 @@ static double now_ms()
 struct Region {
     int64_t start;   // 1-based, inclusive
     int64_t end;     // inclusive
+    double  bytes;   // 规划时预测的字节数
+
+    Region() : start(0), end(0), bytes(0.0) {}
 };
 
 struct ChrInfo {
@@ -54,6 +96,11 @@ struct ChrInfo {
     int64_t     num_bins;
     std::vector<double> bin_weight;   // 每个 bin 累积的字节数
 
+    // 热点 bin（权重 > target * HOT_BIN_FRACTION）细化到 1bp：
+    // hot_bins 升序，fine_weight[k] 为 hot_bins[k] 内 BIN_SIZE 个位置各自的字节数
+    std::vector<int64_t>              hot_bins;
+    std::vector< std::vector<double> > fine_weight;
+
     std::vector<Region> regions;      // 最终切出来的 region 列表
 };
 
@@ -65,6 +112,23 @@ struct SamRecord {
     size_t  len;        // 该行长度（包括 '\n'）
 };
 
+// resize 时不做值初始化的分配器：大数组由各线程并行写入，
+// 页面按 first-touch 分散到各 NUMA 节点，而不是全部落在主线程所在的 socket 上。
+template <typename T>
+struct NoInitAllocator : std::allocator<T> {
+    template <typename U> struct rebind { typedef NoInitAllocator<U> other; };
+
+    NoInitAllocator() {}
+    template <typename U> NoInitAllocator(const NoInitAllocator<U>&) {}
+
+    template <typename U> void construct(U* p) { ::new ((void*)p) U; }
+    template <typename U, typename... Args> void construct(U* p, Args&&... args) {
+        ::new ((void*)p) U(std::forward<Args>(args)...);
+    }
+};
+
+typedef std::vector<SamRecord, NoInitAllocator<SamRecord> > RecordVec;
+
 // ---------------- 工具：判断是否为需要的 chr 名 ----------------
 // 只保留：chr1-22, chrX, chrY
 static bool is_wanted_chr_name(const std::string& name)
@@ -184,64 +248,98 @@ static bool parse_fasta(const std::string& fasta_path,
     return true;
 }
 
-// ---------------- SAM 行解析：RNAME + POS ----------------
-static bool parse_sam_rname_pos(const char* line,
-                                size_t len,       // 不含 '\n'
-                                const char*& rname_start,
-                                size_t& rname_len,
-                                int64_t& pos_out)
-{
-    if (len == 0) return false;
-    if (line[0] == '@') return false;
-
-    int  field = 0;
-    int  i     = 0;
-    int  start = 0;
-    int  end   = 0;
-
-    const char* rname_s = NULL;
-    int         rname_l = 0;
-    const char* pos_s   = NULL;
-    int         pos_l   = 0;
-
-    for (i = 0; i <= (int)len; ++i) {
-        char c = (i == (int)len) ? '\t' : line[i];
-
-        if (c == '\t') {
-            end = i;
-            if (field == 2) {
-                rname_s = line + start;
-                rname_l = end - start;
-            } else if (field == 3) {
-                pos_s = line + start;
-                pos_l = end - start;
+// 普通文本 SAM：按 LOAD_CHUNK 分块 schedule(static) 并行 pread，
+// first-touch 决定 sam_buf 页面所在的 NUMA 节点（解析时同一块由同一线程处理）
+static bool read_plain_sam(const std::string& sam_path,
+                           size_t file_size,
+                           char*& sam_buf,
+                           size_t& sam_size)
+{
+    sam_size = file_size;
+    sam_buf  = (char*)std::malloc(sam_size);
+    if (!sam_buf) {
+        std::fprintf(stderr, "malloc sam_buf failed, size=%zu\n", sam_size);
+        return false;
+    }
+
+    int fd = open(sam_path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::fprintf(stderr, "Failed to open SAM: %s (%s)\n",
+                     sam_path.c_str(), std::strerror(errno));
+        std::free(sam_buf);
+        sam_buf = nullptr;
+        return false;
+    }
+
+    int64_t n_chunks = (int64_t)((sam_size + LOAD_CHUNK - 1) / LOAD_CHUNK);
+    int     read_failed = 0;
+
+    #pragma omp parallel for schedule(static)
+    for (int64_t ck = 0; ck < n_chunks; ++ck) {
+        size_t begin = (size_t)ck * LOAD_CHUNK;
+        size_t end   = std::min(sam_size, begin + LOAD_CHUNK);
+        size_t got   = begin;
+        while (got < end) {
+            ssize_t n = pread(fd, sam_buf + got, end - got, (off_t)got);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                #pragma omp atomic write
+                read_failed = 1;
                 break;
             }
-            field++;
-            start = i + 1;
+            got += (size_t)n;
         }
     }
+    close(fd);
+    if (read_failed) {
+        std::fprintf(stderr, "pread SAM incomplete: %s\n", sam_path.c_str());
+        std::free(sam_buf);
+        sam_buf = nullptr;
+        return false;
+    }
 
-    if (!rname_s || !pos_s || pos_l <= 0) return false;
+    return true;
+}
 
-    int64_t value = 0;
-    int     neg   = 0;
-    int     idx   = 0;
-    if (pos_s[0] == '-') {
-        neg = 1;
-        idx++;
-        if (idx >= pos_l) return false;
-    }
-    for (; idx < pos_l; ++idx) {
-        char c = pos_s[idx];
-        if (c < '0' || c > '9') return false;
-        value = value * 10 + (c - '0');
+// gzip / BGZF：解压后大小未知，按倍增扩容顺序读入
+static bool read_compressed_sam(const std::string& sam_path,
+                                size_t file_size,
+                                char*& sam_buf,
+                                size_t& sam_size)
+{
+    FILE* fp = sam_input_open(sam_path);
+    if (!fp) {
+        std::fprintf(stderr, "Failed to open SAM: %s (%s)\n",
+                     sam_path.c_str(), std::strerror(errno));
+        return false;
     }
-    if (neg) value = -value;
 
-    rname_start = rname_s;
-    rname_len   = (size_t)rname_l;
-    pos_out     = value;
+    size_t cap = std::max<size_t>(file_size * 4, LOAD_CHUNK);
+    sam_buf  = (char*)std::malloc(cap);
+    sam_size = 0;
+    bool ok  = sam_buf != nullptr;
+    while (ok) {
+        if (sam_size == cap) {
+            char* nb = (char*)std::realloc(sam_buf, cap * 2);
+            if (!nb) {
+                ok = false;
+                break;
+            }
+            sam_buf = nb;
+            cap    *= 2;
+        }
+        size_t n = std::fread(sam_buf + sam_size, 1, cap - sam_size, fp);
+        if (n == 0) break;
+        sam_size += n;
+    }
+    if (std::ferror(fp)) ok = false;
+    if (std::fclose(fp) != 0) ok = false;
+    if (!ok || sam_size == 0) {
+        std::fprintf(stderr, "Failed to read compressed SAM: %s\n", sam_path.c_str());
+        std::free(sam_buf);
+        sam_buf = nullptr;
+        return false;
+    }
     return true;
 }
 
@@ -251,7 +349,8 @@ static bool parse_sam_rname_pos(const char* line,
 //   sam_buf/sam_size        : 整个 SAM 文件内容
 //   header_lines            : SAM header 行（含 '\n'）
 //   records                 : 所有 chr1-22/X/Y 的 alignment 记录
-//   同时更新 chrs[].bin_weight[bin] += line_len_bytes
+//   accumulate_bins 为 true 时同时更新 chrs[].bin_weight[bin] += line_len_bytes
+//   （从 profile 规划 region 时不需要再统计直方图）
 //
 static bool load_and_parse_sam(const std::string& sam_path,
                                char*& sam_buf,
@@ -259,7 +358,9 @@ static bool load_and_parse_sam(const std::string& sam_path,
                                const std::unordered_map<std::string,int>& chr_index,
                                std::vector<ChrInfo>& chrs,
                                std::vector<std::string>& header_lines,
-                               std::vector<SamRecord>& records)
+                               RecordVec& records,
+                               bool accumulate_bins,
+                               RecordVec* unplaced)
 {
     struct stat st;
     if (stat(sam_path.c_str(), &st) != 0) {
@@ -273,103 +374,448 @@ static bool load_and_parse_sam(const std::string& sam_path,
         return false;
     }
 
-    sam_size = (size_t)st.st_size;
-    sam_buf  = (char*)std::malloc(sam_size);
-    if (!sam_buf) {
-        std::fprintf(stderr, "malloc sam_buf failed, size=%zu\n", sam_size);
+    // 压缩输入：通过 sam_input 层（BGZF 并行解压）顺序读入
+    if (sam_input_format(sam_path) != SAM_INPUT_PLAIN) {
+        if (!read_compressed_sam(sam_path, (size_t)st.st_size, sam_buf, sam_size)) {
+            return false;
+        }
+    } else if (!read_plain_sam(sam_path, (size_t)st.st_size, sam_buf, sam_size)) {
         return false;
     }
 
-    FILE* fp = std::fopen(sam_path.c_str(), "rb");
-    if (!fp) {
-        std::fprintf(stderr, "Failed to open SAM: %s (%s)\n",
-                     sam_path.c_str(), std::strerror(errno));
-        std::free(sam_buf);
-        sam_buf = nullptr;
-        return false;
+    // 按 LOAD_CHUNK 分块并行解析（与读入使用相同的 static 划分）
+    int64_t n_chunks = (int64_t)((sam_size + LOAD_CHUNK - 1) / LOAD_CHUNK);
+
+    // 解析行：每块只处理“行首落在本块内”的行；per-chunk record 数组由解析它的线程分配，
+    // 与该块的 sam_buf 页面在同一个 NUMA 节点上
+    std::vector<RecordVec>                  chunk_recs(n_chunks);
+    std::vector<RecordVec>                  chunk_unplaced(n_chunks);   // chr_id = -1
+    std::vector< std::vector<std::string> > chunk_headers(n_chunks);
+    int64_t total_reads = 0;
+    int64_t used_reads  = 0;
+
+    #pragma omp parallel for schedule(static) reduction(+:total_reads,used_reads)
+    for (int64_t ck = 0; ck < n_chunks; ++ck) {
+        size_t i     = (size_t)ck * LOAD_CHUNK;
+        size_t c_end = std::min(sam_size, i + LOAD_CHUNK);
+        if (i > 0 && sam_buf[i - 1] != '\n') {
+            while (i < sam_size && sam_buf[i] != '\n') ++i;
+            if (i < sam_size) ++i;
+        }
+
+        RecordVec& recs = chunk_recs[ck];
+        while (i < c_end) {
+            size_t line_start = i;
+            SamFields f;                  // 一次扫描切出行尾和前 4 列
+            sam_fields_scan(sam_buf + line_start, sam_size - line_start, 4, f);
+            size_t line_end = line_start + f.len;   // 不含 '\n'
+            i = line_start + f.next;
+            size_t line_len = i - line_start;  // 行长度（含 '\n'，最后一行没换行也行）
+
+            if (line_len == 0) continue;
+
+            char*  line_ptr  = sam_buf + line_start;
+            size_t text_len  = line_end - line_start;
+
+            if (line_ptr[0] == '@') {
+                // header 行，直接拷一份
+                chunk_headers[ck].emplace_back(line_ptr, line_len);
+                continue;
+            }
+
+            total_reads++;
+
+            const char* rname_s = NULL;
+            size_t      rname_l = 0;
+            long long   pos     = 0;
+            if (!sam_fields_rname_pos(line_ptr, text_len, f, rname_s, rname_l, pos)) {
+                continue;
+            }
+
+            // 不在 chr1-22/X/Y 内、unmapped 或 POS 越界：需要时单独收集（写 catch-all）
+            std::string rname(rname_s, rname_l);
+            auto it = chr_index.find(rname);
+            if (it == chr_index.end() || pos <= 0 || pos > chrs[it->second].length) {
+                if (unplaced) {
+                    SamRecord rec;
+                    rec.chr_id = -1;
+                    rec.pos    = pos;
+                    rec.offset = line_start;
+                    rec.len    = line_len;
+                    chunk_unplaced[ck].push_back(rec);
+                }
+                continue;
+            }
+            int chr_id = it->second;
+            ChrInfo& c = chrs[chr_id];
+
+            // 更新该 chr 的 bin_weight
+            if (accumulate_bins && c.num_bins > 0) {
+                int bin_idx = (int)((pos - 1) / BIN_SIZE);
+                if (bin_idx < 0) bin_idx = 0;
+                if (bin_idx >= (int)c.num_bins) bin_idx = (int)c.num_bins - 1;
+                // 权重都是整数字节，double 累加在 2^53 以内是精确的，与累加顺序无关
+                #pragma omp atomic
+                c.bin_weight[bin_idx] += (double)line_len;
+            }
+
+            // 记录 SamRecord
+            SamRecord rec;
+            rec.chr_id = chr_id;
+            rec.pos    = pos;
+            rec.offset = line_start;
+            rec.len    = line_len;
+            recs.push_back(rec);
+            used_reads++;
+        }
     }
 
-    size_t nread = std::fread(sam_buf, 1, sam_size, fp);
-    std::fclose(fp);
-    if (nread != sam_size) {
-        std::fprintf(stderr, "fread SAM incomplete: expect=%zu got=%zu\n",
-                     sam_size, nread);
-        std::free(sam_buf);
-        sam_buf = nullptr;
+    // 按块顺序拼接：header 串行，records 由解析该块的线程并行拷贝（同样按 first-touch 落点）
+    std::vector<size_t> rec_base(n_chunks + 1, 0);
+    for (int64_t ck = 0; ck < n_chunks; ++ck) {
+        rec_base[ck + 1] = rec_base[ck] + chunk_recs[ck].size();
+        for (size_t h = 0; h < chunk_headers[ck].size(); ++h)
+            header_lines.push_back(chunk_headers[ck][h]);
+    }
+    records.resize(rec_base[n_chunks]);
+
+    #pragma omp parallel for schedule(static)
+    for (int64_t ck = 0; ck < n_chunks; ++ck) {
+        if (!chunk_recs[ck].empty()) {
+            std::memcpy(&records[rec_base[ck]], chunk_recs[ck].data(),
+                        chunk_recs[ck].size() * sizeof(SamRecord));
+        }
+        RecordVec().swap(chunk_recs[ck]);
+    }
+    if (unplaced) {
+        unplaced->clear();
+        for (int64_t ck = 0; ck < n_chunks; ++ck)
+            unplaced->insert(unplaced->end(), chunk_unplaced[ck].begin(), chunk_unplaced[ck].end());
+    }
+
+    std::fprintf(stderr,
+                 "SAM loaded into memory: size=%.3f MB, total_reads=%ld, used_reads=%ld\n",
+                 sam_size / 1024.0 / 1024.0,
+                 (long)total_reads, (long)used_reads);
+    return true;
+}
+
+// ---------------- coverage profile：保存 / 加载 bin_weight ----------------
+//
+// 同一捕获试剂盒（外显子/panel）的样本之间 bin_weight 分布几乎一样，
+// 把它存成紧凑的二进制文件，之后可以直接用 --profile 规划 region，跳过直方图统计。
+//
+// 文件格式（本机字节序）：
+//   ProfileHeader
+//   每个 chr：
+//     uint32_t name_len; char name[name_len];
+//     int64_t  length;
+//     uint64_t n_nonzero;
+//     n_nonzero 个 ProfileBin（只存非零 bin，外显子数据非常稀疏）
+//     uint64_t n_hot;                                    （version >= 2）
+//     n_hot 个：uint32_t bin; uint32_t n_nonzero; n_nonzero 个 ProfileBin（bin 为 bin 内偏移）
+static const char     PROFILE_MAGIC[8] = {'S','W','B','P','R','O','F','\0'};
+static const uint32_t PROFILE_VERSION  = 2;
+
+struct ProfileHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t bin_size;
+    uint32_t n_chr;
+    uint32_t reserved;
+    uint64_t input_bytes;     // 生成 profile 时输入 SAM 的文件大小
+    uint64_t total_records;   // 参与统计的 record 数
+    double   total_weight;    // 所有 bin 权重之和（字节）
+};
+
+struct ProfileBin {
+    uint32_t bin;
+    float    weight;
+};
+
+static bool save_profile(const std::string& path,
+                         const std::vector<ChrInfo>& chrs,
+                         uint64_t input_bytes,
+                         uint64_t total_records)
+{
+    FILE* fp = std::fopen(path.c_str(), "wb");
+    if (!fp) {
+        std::fprintf(stderr, "Failed to open profile for writing: %s (%s)\n",
+                     path.c_str(), std::strerror(errno));
         return false;
     }
 
-    // 解析行
-    size_t i = 0;
-    int64_t total_reads = 0;
-    int64_t used_reads  = 0;
+    ProfileHeader h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, PROFILE_MAGIC, sizeof(h.magic));
+    h.version       = PROFILE_VERSION;
+    h.bin_size      = (uint32_t)BIN_SIZE;
+    h.n_chr         = (uint32_t)chrs.size();
+    h.input_bytes   = input_bytes;
+    h.total_records = total_records;
+    h.total_weight  = 0.0;
+    for (size_t i = 0; i < chrs.size(); ++i)
+        for (size_t b = 0; b < chrs[i].bin_weight.size(); ++b)
+            h.total_weight += chrs[i].bin_weight[b];
+
+    bool ok = std::fwrite(&h, sizeof(h), 1, fp) == 1;
+
+    std::vector<ProfileBin> bins;
+    for (size_t i = 0; i < chrs.size() && ok; ++i) {
+        const ChrInfo& c = chrs[i];
+        bins.clear();
+        for (size_t b = 0; b < c.bin_weight.size(); ++b) {
+            if (c.bin_weight[b] <= 0.0) continue;
+            ProfileBin pb;
+            pb.bin    = (uint32_t)b;
+            pb.weight = (float)c.bin_weight[b];
+            bins.push_back(pb);
+        }
 
-    while (i < sam_size) {
-        size_t line_start = i;
-        while (i < sam_size && sam_buf[i] != '\n') ++i;
-        size_t line_end = i;          // 不含 '\n'
-        if (i < sam_size && sam_buf[i] == '\n') ++i;
-        size_t line_len = i - line_start;  // 行长度（含 '\n'，最后一行没换行也行）
+        uint32_t name_len  = (uint32_t)c.name.size();
+        int64_t  length    = c.length;
+        uint64_t n_nonzero = bins.size();
+        ok = std::fwrite(&name_len, sizeof(name_len), 1, fp) == 1 &&
+             std::fwrite(c.name.data(), 1, name_len, fp) == name_len &&
+             std::fwrite(&length, sizeof(length), 1, fp) == 1 &&
+             std::fwrite(&n_nonzero, sizeof(n_nonzero), 1, fp) == 1 &&
+             (bins.empty() ||
+              std::fwrite(bins.data(), sizeof(ProfileBin), bins.size(), fp) == bins.size());
+
+        // 热点 bin 的 1bp 权重
+        uint64_t n_hot = c.hot_bins.size();
+        ok = ok && std::fwrite(&n_hot, sizeof(n_hot), 1, fp) == 1;
+        for (size_t k = 0; k < c.hot_bins.size() && ok; ++k) {
+            bins.clear();
+            const std::vector<double>& fw = c.fine_weight[k];
+            for (size_t p = 0; p < fw.size(); ++p) {
+                if (fw[p] <= 0.0) continue;
+                ProfileBin pb;
+                pb.bin    = (uint32_t)p;
+                pb.weight = (float)fw[p];
+                bins.push_back(pb);
+            }
+            uint32_t hot_bin = (uint32_t)c.hot_bins[k];
+            uint32_t n_fine  = (uint32_t)bins.size();
+            ok = std::fwrite(&hot_bin, sizeof(hot_bin), 1, fp) == 1 &&
+                 std::fwrite(&n_fine, sizeof(n_fine), 1, fp) == 1 &&
+                 (bins.empty() ||
+                  std::fwrite(bins.data(), sizeof(ProfileBin), bins.size(), fp) == bins.size());
+        }
+    }
 
-        if (line_len == 0) continue;
+    if (std::fclose(fp) != 0) ok = false;
+    if (!ok) {
+        std::fprintf(stderr, "Failed to write profile: %s\n", path.c_str());
+        return false;
+    }
+    std::fprintf(stderr,
+                 "Profile saved: %s (chrs=%u, records=%lu, weight=%.3f MB)\n",
+                 path.c_str(), h.n_chr, (unsigned long)h.total_records,
+                 h.total_weight / 1024.0 / 1024.0);
+    return true;
+}
 
-        char*  line_ptr  = sam_buf + line_start;
-        size_t text_len  = line_end - line_start;
+// 加载 profile 到 chrs[].bin_weight，h 返回 profile 头信息。
+static bool load_profile(const std::string& path,
+                         std::vector<ChrInfo>& chrs,
+                         const std::unordered_map<std::string,int>& chr_index,
+                         ProfileHeader& h)
+{
+    FILE* fp = std::fopen(path.c_str(), "rb");
+    if (!fp) {
+        std::fprintf(stderr, "Failed to open profile: %s (%s)\n",
+                     path.c_str(), std::strerror(errno));
+        return false;
+    }
 
-        if (line_ptr[0] == '@') {
-            // header 行，直接拷一份
-            header_lines.emplace_back(line_ptr, line_len);
-            continue;
+    bool ok = std::fread(&h, sizeof(h), 1, fp) == 1;
+    if (!ok || std::memcmp(h.magic, PROFILE_MAGIC, sizeof(h.magic)) != 0) {
+        std::fprintf(stderr, "Not a coverage profile: %s\n", path.c_str());
+        std::fclose(fp);
+        return false;
+    }
+    // version 1 没有热点 bin 的 1bp 权重，仍然可以读
+    if (h.version < 1 || h.version > PROFILE_VERSION || h.bin_size != (uint32_t)BIN_SIZE) {
+        std::fprintf(stderr,
+                     "Incompatible profile %s: version=%u bin_size=%u (expect %u/%d)\n",
+                     path.c_str(), h.version, h.bin_size, PROFILE_VERSION, BIN_SIZE);
+        std::fclose(fp);
+        return false;
+    }
+
+    std::vector<ProfileBin> bins;
+    size_t matched = 0;
+    for (uint32_t i = 0; i < h.n_chr && ok; ++i) {
+        uint32_t name_len  = 0;
+        int64_t  length    = 0;
+        uint64_t n_nonzero = 0;
+        std::string name;
+
+        ok = std::fread(&name_len, sizeof(name_len), 1, fp) == 1 && name_len < 4096;
+        if (ok) {
+            name.resize(name_len);
+            ok = std::fread(&name[0], 1, name_len, fp) == name_len &&
+                 std::fread(&length, sizeof(length), 1, fp) == 1 &&
+                 std::fread(&n_nonzero, sizeof(n_nonzero), 1, fp) == 1;
         }
+        if (!ok) break;
 
-        total_reads++;
+        bins.resize(n_nonzero);
+        if (n_nonzero > 0 &&
+            std::fread(bins.data(), sizeof(ProfileBin), n_nonzero, fp) != n_nonzero) {
+            ok = false;
+            break;
+        }
 
-        const char* rname_s = NULL;
-        size_t      rname_l = 0;
-        int64_t     pos     = 0;
-        if (!parse_sam_rname_pos(line_ptr, text_len, rname_s, rname_l, pos)) {
-            continue;
+        // 热点 bin（version >= 2）
+        std::vector<int64_t>               hot_bins;
+        std::vector< std::vector<double> > fine_weight;
+        uint64_t n_hot = 0;
+        if (h.version >= 2) {
+            ok = std::fread(&n_hot, sizeof(n_hot), 1, fp) == 1;
+        }
+        std::vector<ProfileBin> fine;
+        for (uint64_t k = 0; k < n_hot && ok; ++k) {
+            uint32_t hot_bin = 0;
+            uint32_t n_fine  = 0;
+            ok = std::fread(&hot_bin, sizeof(hot_bin), 1, fp) == 1 &&
+                 std::fread(&n_fine, sizeof(n_fine), 1, fp) == 1 &&
+                 n_fine <= (uint32_t)BIN_SIZE;
+            if (!ok) break;
+            fine.resize(n_fine);
+            if (n_fine > 0 &&
+                std::fread(fine.data(), sizeof(ProfileBin), n_fine, fp) != n_fine) {
+                ok = false;
+                break;
+            }
+            std::vector<double> fw(BIN_SIZE, 0.0);
+            for (size_t p = 0; p < fine.size(); ++p) {
+                if (fine[p].bin < (uint32_t)BIN_SIZE) fw[fine[p].bin] = (double)fine[p].weight;
+            }
+            hot_bins.push_back((int64_t)hot_bin);
+            fine_weight.push_back(fw);
         }
+        if (!ok) break;
 
-        std::string rname(rname_s, rname_l);
-        auto it = chr_index.find(rname);
+        auto it = chr_index.find(name);
         if (it == chr_index.end()) {
-            // 不在 chr1-22/X/Y 内
+            std::fprintf(stderr, "  [WARN] profile chr %s not in reference, ignored\n",
+                         name.c_str());
             continue;
         }
-        int chr_id = it->second;
-        ChrInfo& c = chrs[chr_id];
-
-        if (pos <= 0 || pos > c.length) {
-            continue;
+        ChrInfo& c = chrs[it->second];
+        if (c.length != length) {
+            std::fprintf(stderr,
+                         "Profile chr %s length=%ld mismatches reference length=%ld\n",
+                         name.c_str(), (long)length, (long)c.length);
+            std::fclose(fp);
+            return false;
         }
-
-        // 更新该 chr 的 bin_weight
-        if (c.num_bins > 0) {
-            int bin_idx = (int)((pos - 1) / BIN_SIZE);
-            if (bin_idx < 0) bin_idx = 0;
-            if (bin_idx >= (int)c.num_bins) bin_idx = (int)c.num_bins - 1;
-            c.bin_weight[bin_idx] += (double)line_len;
+        for (size_t k = 0; k < bins.size(); ++k) {
+            if (bins[k].bin < (uint32_t)c.num_bins)
+                c.bin_weight[bins[k].bin] = (double)bins[k].weight;
         }
-
-        // 记录 SamRecord
-        SamRecord rec;
-        rec.chr_id = chr_id;
-        rec.pos    = pos;
-        rec.offset = line_start;
-        rec.len    = line_len;
-        records.push_back(rec);
-        used_reads++;
+        c.hot_bins.clear();
+        c.fine_weight.clear();
+        for (size_t k = 0; k < hot_bins.size(); ++k) {
+            if (hot_bins[k] >= c.num_bins) continue;
+            if (!c.hot_bins.empty() && hot_bins[k] <= c.hot_bins.back()) continue;
+            c.hot_bins.push_back(hot_bins[k]);
+            c.fine_weight.push_back(fine_weight[k]);
+        }
+        matched++;
     }
+    std::fclose(fp);
 
+    if (!ok) {
+        std::fprintf(stderr, "Truncated or corrupt profile: %s\n", path.c_str());
+        return false;
+    }
     std::fprintf(stderr,
-                 "SAM loaded into memory: size=%.3f MB, total_reads=%ld, used_reads=%ld\n",
-                 sam_size / 1024.0 / 1024.0,
-                 (long)total_reads, (long)used_reads);
+                 "Profile loaded: %s (chrs=%zu/%u, input=%.3f MB, records=%lu)\n",
+                 path.c_str(), matched, h.n_chr,
+                 h.input_bytes / 1024.0 / 1024.0, (unsigned long)h.total_records);
     return true;
 }
 
-static void build_regions_for_chr(ChrInfo& c, double target_bytes)
+// 按比例缩放所有 bin_weight（profile 与当前输入大小不一致时使用）
+static void scale_bin_weights(std::vector<ChrInfo>& chrs, double scale)
+{
+    for (size_t i = 0; i < chrs.size(); ++i) {
+        for (size_t b = 0; b < chrs[i].bin_weight.size(); ++b)
+            chrs[i].bin_weight[b] *= scale;
+        for (size_t k = 0; k < chrs[i].fine_weight.size(); ++k)
+            for (size_t p = 0; p < chrs[i].fine_weight[k].size(); ++p)
+                chrs[i].fine_weight[k][p] *= scale;
+    }
+}
+
+// ---------------- 自适应直方图：把热点 bin 细化到 1bp ----------------
+// 固定 1000bp 的 bin 在着丝粒 / 扩增子堆积处可能一个 bin 就有几百 MB，
+// 只在 bin 边界切分时 region 会远超 MAX_REGION_MB。这里对权重超过
+// target_bytes * HOT_BIN_FRACTION 的 bin 再扫一遍 records，按位置统计字节数。
+// 选出热点 bin 并分配 1bp 权重数组；hot_slot[chr][bin] 为 hot 下标（-1 表示不细化）
+static size_t select_hot_bins(std::vector<ChrInfo>& chrs,
+                              double hot_threshold,
+                              std::vector< std::vector<int> >& hot_slot)
+{
+    hot_slot.assign(chrs.size(), std::vector<int>());
+    size_t n_hot = 0;
+    for (size_t i = 0; i < chrs.size(); ++i) {
+        ChrInfo& c = chrs[i];
+        c.hot_bins.clear();
+        c.fine_weight.clear();
+        for (int64_t b = 0; b < (int64_t)c.bin_weight.size(); ++b) {
+            if (c.bin_weight[b] <= hot_threshold) continue;
+            if (hot_slot[i].empty()) hot_slot[i].assign(c.bin_weight.size(), -1);
+            hot_slot[i][b] = (int)c.hot_bins.size();
+            c.hot_bins.push_back(b);
+            c.fine_weight.push_back(std::vector<double>(BIN_SIZE, 0.0));
+        }
+        n_hot += c.hot_bins.size();
+    }
+    return n_hot;
+}
+
+static inline void add_fine_weight(std::vector<ChrInfo>& chrs,
+                                   const std::vector< std::vector<int> >& hot_slot,
+                                   int chr_id, int64_t pos, size_t len)
+{
+    const std::vector<int>& slots = hot_slot[chr_id];
+    if (slots.empty()) return;
+
+    int64_t b = (pos - 1) / BIN_SIZE;
+    if (b < 0 || b >= (int64_t)slots.size() || slots[b] < 0) return;
+    chrs[chr_id].fine_weight[slots[b]][(pos - 1) % BIN_SIZE] += (double)len;
+}
+
+static void refine_hot_bins(std::vector<ChrInfo>& chrs,
+                            const RecordVec& records,
+                            double target_bytes)
+{
+    double hot_threshold = target_bytes * HOT_BIN_FRACTION;
+
+    std::vector< std::vector<int> > hot_slot;
+    size_t n_hot = select_hot_bins(chrs, hot_threshold, hot_slot);
+    if (n_hot == 0) return;
+
+    for (size_t r = 0; r < records.size(); ++r) {
+        add_fine_weight(chrs, hot_slot, records[r].chr_id, records[r].pos, records[r].len);
+    }
+
+    std::fprintf(stderr, "Refined %zu hot bins (> %.1f MB) to 1bp resolution\n",
+                 n_hot, hot_threshold / 1024.0 / 1024.0);
+}
+
+// 规划时的最小单位：普通 bin 或热点 bin 内的 1bp
+struct PlanUnit {
+    int64_t start;
+    int64_t end;
+    double  w;
+};
+
+static void build_regions_for_chr(ChrInfo& c, double target_bytes, double max_bytes)
 {
     if (c.length <= 0) return;
 
@@ -383,10 +829,10 @@ static void build_regions_for_chr(ChrInfo& c, double target_bytes)
     double   accum_bytes   = 0.0;     // 当前 region 已累积的“字节”
     int64_t  region_start  = 1;       // 当前 region 的起始坐标（1-based）
     int64_t  chr_len       = c.length;
+    size_t   hot_k         = 0;       // 下一个热点 bin 在 c.hot_bins 中的下标
+    std::vector<PlanUnit> units;
 
     for (int64_t b = 0; b < c.num_bins; ++b) {
-        double w = c.bin_weight[b];
-
         int64_t bin_start_pos = b * (int64_t)BIN_SIZE + 1;
         int64_t bin_end_pos   = (b + 1) * (int64_t)BIN_SIZE;
         if (bin_end_pos > chr_len) bin_end_pos = chr_len;
@@ -394,19 +840,56 @@ static void build_regions_for_chr(ChrInfo& c, double target_bytes)
         if (region_start > chr_len)
             break;
 
-        // 如果把这个 bin 加进来就 >= target_bytes，
-        // 那就直接在这个 bin 的末尾结束一个 region，允许略微超过 target_bytes。
-        if (accum_bytes + w >= target_bytes) {
-            Region r;
-            r.start = region_start;
-            r.end   = bin_end_pos;  // 这个 bin 的尾巴作为 region 结束
-            c.regions.push_back(r);
-
-            region_start = bin_end_pos + 1;
-            accum_bytes  = 0.0;     // 下一个 region 从下一个位置重新累计
+        // 热点 bin 拆成 1bp 单位，其余 bin 整体作为一个单位
+        units.clear();
+        while (hot_k < c.hot_bins.size() && c.hot_bins[hot_k] < b) ++hot_k;
+        if (hot_k < c.hot_bins.size() && c.hot_bins[hot_k] == b) {
+            const std::vector<double>& fw = c.fine_weight[hot_k];
+            for (int64_t p = bin_start_pos; p <= bin_end_pos; ++p) {
+                PlanUnit u = { p, p, fw[p - bin_start_pos] };
+                units.push_back(u);
+            }
         } else {
-            // 还没到 target，继续累计
-            accum_bytes += w;
+            PlanUnit u = { bin_start_pos, bin_end_pos, c.bin_weight[b] };
+            units.push_back(u);
+        }
+
+        for (size_t k = 0; k < units.size(); ++k) {
+            const PlanUnit& u = units[k];
+
+            // 加上这个单位会超过上限：先在它前面结束当前 region
+            if (accum_bytes > 0.0 && accum_bytes + u.w > max_bytes) {
+                Region r;
+                r.start = region_start;
+                r.end   = u.start - 1;
+                r.bytes = accum_bytes;
+                c.regions.push_back(r);
+
+                region_start = u.start;
+                accum_bytes  = 0.0;
+            }
+
+            // 如果把这个单位加进来就 >= target_bytes，
+            // 那就直接在它的末尾结束一个 region，允许略微超过 target_bytes。
+            if (accum_bytes + u.w >= target_bytes) {
+                if (u.w > max_bytes) {
+                    std::fprintf(stderr,
+                                 "  [WARN] %s:%ld-%ld alone holds %.1f MB (> %.1f MB), cannot split further\n",
+                                 c.name.c_str(), (long)u.start, (long)u.end,
+                                 u.w / 1024.0 / 1024.0, max_bytes / 1024.0 / 1024.0);
+                }
+                Region r;
+                r.start = region_start;
+                r.end   = u.end;    // 这个单位的尾巴作为 region 结束
+                r.bytes = accum_bytes + u.w;
+                c.regions.push_back(r);
+
+                region_start = u.end + 1;
+                accum_bytes  = 0.0; // 下一个 region 从下一个位置重新累计
+            } else {
+                // 还没到 target，继续累计
+                accum_bytes += u.w;
+            }
         }
     }
 
@@ -415,6 +898,7 @@ static void build_regions_for_chr(ChrInfo& c, double target_bytes)
         Region r;
         r.start = region_start;
         r.end   = chr_len;
+        r.bytes = accum_bytes;
         c.regions.push_back(r);
     }
 
@@ -477,7 +961,7 @@ static void build_regions_for_chr_init(ChrInfo& c, double target_bytes)
 }
 
 // ---------------- 按 chr 构建 per-chr record 列表 ----------------
-static void build_chr_record_indices(const std::vector<SamRecord>& records,
+static void build_chr_record_indices(const RecordVec& records,
                                      size_t n_chr,
                                      std::vector< std::vector<int> >& chr_rec_indices)
 {
@@ -496,13 +980,195 @@ static void build_chr_record_indices(const std::vector<SamRecord>& records,
     }
 }
 
-// ---------------- 并行按 chr split：从 sam_buf 直接写 region 文件（每个region一块buffer） ----------------
+// ---------------- writev 辅助：处理部分写入，直到全部写完 ----------------
+static bool writev_all(int fd, struct iovec* iov, int iovcnt)
+{
+    while (iovcnt > 0) {
+        ssize_t n = ::writev(fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        // 跳过已经完整写出的 iovec，调整写了一半的那个
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= (ssize_t)iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt > 0 && n > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= (size_t)n;
+        }
+    }
+    return true;
+}
+
+// 一个 region 的写出任务：调度单位是 region 而不是 chr
+struct RegionTask {
+    int     chr_id;
+    int     region_idx;     // chrs[chr_id].regions 下标
+    int64_t bytes;          // 该 region 所有 record 的总字节数（用于按大小调度）
+    std::vector<int> rec_ids;
+};
+
+// 每次 writev 最多携带的 iovec 个数（Linux IOV_MAX = 1024）
+static const int WRITEV_BATCH = 1024;
+
+// ---------------- region 内按 POS 稳定排序 ----------------
+// 先按 region 内的 bin 做一次计数排序（稳定），再在每个 bin 内按 POS 稳定排序。
+// 每个 bin 内的记录很少，整体接近线性。
+static void sort_region_records_by_pos(const RecordVec& records,
+                                       const Region& rg,
+                                       std::vector<int>& rec_ids)
+{
+    if (rec_ids.size() <= 1) return;
+
+    int64_t n_bins = (rg.end - rg.start) / BIN_SIZE + 1;
+    std::vector<size_t> bin_start((size_t)n_bins + 1, 0);
+
+    for (size_t k = 0; k < rec_ids.size(); ++k) {
+        int64_t b = (records[rec_ids[k]].pos - rg.start) / BIN_SIZE;
+        bin_start[(size_t)b + 1]++;
+    }
+    for (int64_t b = 0; b < n_bins; ++b)
+        bin_start[(size_t)b + 1] += bin_start[(size_t)b];
+
+    std::vector<int>    sorted(rec_ids.size());
+    std::vector<size_t> fill(bin_start.begin(), bin_start.end() - 1);
+    for (size_t k = 0; k < rec_ids.size(); ++k) {
+        int64_t b = (records[rec_ids[k]].pos - rg.start) / BIN_SIZE;
+        sorted[fill[(size_t)b]++] = rec_ids[k];
+    }
+
+    for (int64_t b = 0; b < n_bins; ++b) {
+        size_t lo = bin_start[(size_t)b];
+        size_t hi = bin_start[(size_t)b + 1];
+        if (hi - lo <= 1) continue;
+        std::stable_sort(sorted.begin() + lo, sorted.begin() + hi,
+                         [&](int a, int b2) {
+                             return records[a].pos < records[b2].pos;
+                         });
+    }
+    rec_ids.swap(sorted);
+}
+
+// 生成标记为已排序的 header：@HD 行的 SO 改为 coordinate（没有 @HD 就补一行）。
+// sw_sam_process 看到 SO:coordinate 会跳过排序直接去重。
+static std::string make_sorted_header(const std::vector<std::string>& header_lines)
+{
+    std::string out;
+    bool has_hd = !header_lines.empty() && header_lines[0].compare(0, 3, "@HD") == 0;
+    if (!has_hd) {
+        out += "@HD\tVN:1.6\tSO:coordinate\n";
+    }
+
+    for (size_t i = 0; i < header_lines.size(); ++i) {
+        if (i > 0 || !has_hd) {
+            out += header_lines[i];
+            continue;
+        }
+
+        // 重写 @HD 行：去掉原来的 SO 字段，在行尾追加 SO:coordinate
+        const std::string& hd = header_lines[i];
+        size_t text_len = hd.size();
+        while (text_len > 0 && (hd[text_len-1] == '\n' || hd[text_len-1] == '\r'))
+            --text_len;
+
+        size_t p = 0;
+        bool first = true;
+        while (p <= text_len) {
+            size_t q = hd.find('\t', p);
+            if (q == std::string::npos || q > text_len) q = text_len;
+            if (hd.compare(p, 3, "SO:") != 0) {
+                if (!first) out += '\t';
+                out.append(hd, p, q - p);
+                first = false;
+            }
+            p = q + 1;
+        }
+        out += "\tSO:coordinate\n";
+    }
+    return out;
+}
+
+// ---------------- catch-all 文件：header + 记录（按给定顺序，相邻的行合并成一个 iovec） ----------------
+static bool write_catch_all(const std::string& path,
+                            const char* sam_buf,
+                            const std::string& header_blob,
+                            const std::vector<const SamRecord*>& recs,
+                            const SidecarContigs* sidecar)
+{
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        std::fprintf(stderr, "[OMP] Failed to open %s (%s)\n", path.c_str(), std::strerror(errno));
+        return false;
+    }
+
+    struct iovec iov[WRITEV_BATCH];
+    int  iovcnt = 0;
+    bool ok     = true;
+    if (!header_blob.empty()) {
+        iov[iovcnt].iov_base = (void*)header_blob.data();
+        iov[iovcnt].iov_len  = header_blob.size();
+        iovcnt++;
+    }
+    for (size_t k = 0; k < recs.size() && ok; ++k) {
+        const char* p = sam_buf + recs[k]->offset;
+        if (iovcnt > 0 &&
+            (const char*)iov[iovcnt-1].iov_base + iov[iovcnt-1].iov_len == p) {
+            iov[iovcnt-1].iov_len += recs[k]->len;
+            continue;
+        }
+        if (iovcnt == WRITEV_BATCH) {
+            ok = writev_all(fd, iov, iovcnt);
+            iovcnt = 0;
+        }
+        iov[iovcnt].iov_base = (void*)p;
+        iov[iovcnt].iov_len  = recs[k]->len;
+        iovcnt++;
+    }
+    if (ok && iovcnt > 0) ok = writev_all(fd, iov, iovcnt);
+    if (::close(fd) != 0) ok = false;
+    if (!ok) {
+        std::fprintf(stderr, "[OMP] writev failed for %s (%s)\n", path.c_str(), std::strerror(errno));
+        return false;
+    }
+
+    if (sidecar) {
+        std::vector<SamIdxEntry> entries(recs.size());
+        SidecarNames names;
+        uint64_t off = header_blob.size();
+        for (size_t k = 0; k < recs.size(); ++k) {
+            const char* p = sam_buf + recs[k]->offset;
+            size_t text_len = recs[k]->len;
+            while (text_len > 0 && (p[text_len-1] == '\n' || p[text_len-1] == '\r'))
+                --text_len;
+            sidecar_parse_line(p, text_len, recs[k]->len, off, *sidecar, entries[k]);
+            sidecar_assign_name(names, p, entries[k]);
+            off += recs[k]->len;
+        }
+        ok = sidecar_write(sidecar_path_for(path), header_blob.size(),
+                           entries.data(), entries.size(), names);
+    }
+    return ok;
+}
+
+// ---------------- 并行按 region split：从 sam_buf 直接写 region 文件 ----------------
+//
+//   1. 按 chr 并行，把 record 分桶到各自 region（二分查找，开销很小）；
+//   2. 所有非空 region 拉平成一个任务队列，按字节数从大到小排序；
+//   3. OpenMP 动态调度任务队列：大 region 先开始，小 region 填补空闲线程，
+//      线程数不再受限于 chr 个数（chr1/chr2 不会拖住整体）；
+//   4. 每个 region 的行以 iovec 批量 writev 写出，文件中相邻的行合并成一个 iovec。
 static bool split_sam_by_regions_from_memory(const char* sam_buf,
                                              const std::string& out_dir,
                                              const std::vector<ChrInfo>& chrs,
                                              const std::vector<std::string>& header_lines,
-                                             const std::vector<SamRecord>& records,
-                                             const std::vector< std::vector<int> >& chr_rec_indices)
+                                             const RecordVec& records,
+                                             const std::vector< std::vector<int> >& chr_rec_indices,
+                                             bool sort_by_pos,
+                                             const SidecarContigs* sidecar,
+                                             const RecordVec* unplaced)
 {
     int n_chr = (int)chrs.size();
     if (n_chr == 0) {
@@ -510,23 +1176,27 @@ static bool split_sam_by_regions_from_memory(const char* sam_buf,
         return true;
     }
 
-    int global_ok = 1;
+    // 1. 按 chr 并行分桶（落不进任何 region 的记录留给 catch-all）
+    std::vector< std::vector< std::vector<int> > > chr_reg_rec_ids(n_chr);
+    std::vector< std::vector<int> >                chr_leftover(n_chr);
 
-    // 按 chr 并行
     #pragma omp parallel for schedule(dynamic)
     for (int chr_id = 0; chr_id < n_chr; ++chr_id) {
         const ChrInfo& c = chrs[chr_id];
         const std::vector<int>& idx_list = chr_rec_indices[chr_id];
 
-        if (c.regions.empty() || idx_list.empty()) {
+        if (idx_list.empty()) {
+            continue;
+        }
+        if (c.regions.empty()) {
+            chr_leftover[chr_id] = idx_list;
             continue;
         }
 
         size_t n_region = c.regions.size();
-        // 每个 region 一块 buffer：保存属于该 region 的 SamRecord 下标
-        std::vector< std::vector<int> > reg_rec_ids(n_region);
+        std::vector< std::vector<int> >& reg_rec_ids = chr_reg_rec_ids[chr_id];
+        reg_rec_ids.resize(n_region);
 
-        // 先按 region 把 record 分桶
         for (size_t k = 0; k < idx_list.size(); ++k) {
             int rec_id = idx_list[k];
             const SamRecord& rec = records[rec_id];
@@ -554,59 +1224,178 @@ static bool split_sam_by_regions_from_memory(const char* sam_buf,
 
             if (found >= 0) {
                 reg_rec_ids[found].push_back(rec_id);
+            } else {
+                chr_leftover[chr_id].push_back(rec_id);
             }
-            // 找不到的就直接忽略（理论上不会太多）
         }
+    }
 
-        // 再按 region 输出文件
-        int64_t written_reads = 0;
-
-        for (size_t r_idx = 0; r_idx < n_region; ++r_idx) {
-            const std::vector<int>& rec_ids = reg_rec_ids[r_idx];
-            if (rec_ids.empty()) continue;  // 这个 region 没有 read，跳过
+    // 2. 拉平成任务队列，按字节数降序
+    std::vector<RegionTask> tasks;
+    for (int chr_id = 0; chr_id < n_chr; ++chr_id) {
+        std::vector< std::vector<int> >& reg_rec_ids = chr_reg_rec_ids[chr_id];
+        for (size_t r_idx = 0; r_idx < reg_rec_ids.size(); ++r_idx) {
+            if (reg_rec_ids[r_idx].empty()) continue;  // 这个 region 没有 read，跳过
+
+            tasks.push_back(RegionTask());
+            RegionTask& t = tasks.back();
+            t.chr_id     = chr_id;
+            t.region_idx = (int)r_idx;
+            t.bytes      = 0;
+            t.rec_ids.swap(reg_rec_ids[r_idx]);
+            for (size_t k = 0; k < t.rec_ids.size(); ++k)
+                t.bytes += (int64_t)records[t.rec_ids[k]].len;
+        }
+    }
+    std::sort(tasks.begin(), tasks.end(),
+              [](const RegionTask& a, const RegionTask& b) {
+                  return a.bytes > b.bytes;
+              });
+
+    // header 拼成一整块，每个 region 文件一个 iovec 即可
+    std::string header_blob;
+    if (sort_by_pos) {
+        header_blob = make_sorted_header(header_lines);
+    } else {
+        for (const auto& hline : header_lines) header_blob += hline;
+    }
 
-            const Region& rg = c.regions[r_idx];
+    std::fprintf(stderr, "[OMP] split tasks: %zu non-empty regions\n", tasks.size());
 
-            char path[4096];
-            std::snprintf(path, sizeof(path),
-                          "%s/%s_%ld_%ld.sam",
-                          out_dir.c_str(), c.name.c_str(),
-                          (long)rg.start, (long)rg.end);
+    int global_ok = 1;
+    int64_t total_written = 0;
+
+    // 3. 按 region 并行写出
+    #pragma omp parallel for schedule(dynamic, 1) reduction(+:total_written)
+    for (int t_idx = 0; t_idx < (int)tasks.size(); ++t_idx) {
+        RegionTask&    t  = tasks[t_idx];
+        const ChrInfo& c  = chrs[t.chr_id];
+        const Region&  rg = c.regions[t.region_idx];
+        const std::vector<int>& rec_ids = t.rec_ids;
+
+        if (sort_by_pos) {
+            sort_region_records_by_pos(records, rg, t.rec_ids);
+        }
 
-            FILE* out = std::fopen(path, "wb");
-            if (!out) {
-                std::fprintf(stderr,
-                             "[OMP] Failed to open region SAM: %s (%s)\n",
-                             path, std::strerror(errno));
-                // 简单处理一下错误标记
-                #pragma omp critical
-                {
-                    global_ok = 0;
-                }
-                continue;
+        char path[4096];
+        std::snprintf(path, sizeof(path),
+                      "%s/%s_%ld_%ld.sam",
+                      out_dir.c_str(), c.name.c_str(),
+                      (long)rg.start, (long)rg.end);
+
+        int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            std::fprintf(stderr,
+                         "[OMP] Failed to open region SAM: %s (%s)\n",
+                         path, std::strerror(errno));
+            #pragma omp critical
+            {
+                global_ok = 0;
             }
+            continue;
+        }
 
-            // 写 header
-            for (const auto& hline : header_lines) {
-                std::fwrite(hline.data(), 1, hline.size(), out);
-            }
+        struct iovec iov[WRITEV_BATCH];
+        int  iovcnt = 0;
+        bool ok     = true;
+
+        if (!header_blob.empty()) {
+            iov[iovcnt].iov_base = (void*)header_blob.data();
+            iov[iovcnt].iov_len  = header_blob.size();
+            iovcnt++;
+        }
 
-            // 写属于这个 region 的所有 record（按它们在原 SAM 里的顺序）
-            for (size_t t = 0; t < rec_ids.size(); ++t) {
-                int rec_id = rec_ids[t];
-                const SamRecord& rec = records[rec_id];
-                std::fwrite(sam_buf + rec.offset, 1, rec.len, out);
-                written_reads++;
+        // 写属于这个 region 的所有 record（按它们在原 SAM 里的顺序，--sorted 时按 POS）
+        for (size_t k = 0; k < rec_ids.size() && ok; ++k) {
+            const SamRecord& rec = records[rec_ids[k]];
+            const char* p = sam_buf + rec.offset;
+
+            // 与上一个 iovec 在 sam_buf 中首尾相接时直接合并
+            if (iovcnt > 0 &&
+                (const char*)iov[iovcnt-1].iov_base + iov[iovcnt-1].iov_len == p) {
+                iov[iovcnt-1].iov_len += rec.len;
+                continue;
+            }
+            if (iovcnt == WRITEV_BATCH) {
+                ok = writev_all(fd, iov, iovcnt);
+                iovcnt = 0;
             }
+            iov[iovcnt].iov_base = (void*)p;
+            iov[iovcnt].iov_len  = rec.len;
+            iovcnt++;
+        }
+        if (ok && iovcnt > 0) {
+            ok = writev_all(fd, iov, iovcnt);
+        }
 
-            std::fclose(out);
+        if (!ok) {
+            std::fprintf(stderr,
+                         "[OMP] writev failed for region SAM: %s (%s)\n",
+                         path, std::strerror(errno));
+            #pragma omp critical
+            {
+                global_ok = 0;
+            }
+        } else {
+            total_written += (int64_t)rec_ids.size();
         }
+        ::close(fd);
+
+        // sidecar：按写出顺序记录每行在 region 文件中的偏移和预解析字段
+        if (ok && sidecar) {
+            std::vector<SamIdxEntry> entries(rec_ids.size());
+            SidecarNames names;
+            uint64_t off = header_blob.size();
+            for (size_t k = 0; k < rec_ids.size(); ++k) {
+                const SamRecord& rec = records[rec_ids[k]];
+                const char* p = sam_buf + rec.offset;
+                size_t text_len = rec.len;
+                while (text_len > 0 && (p[text_len-1] == '\n' || p[text_len-1] == '\r'))
+                    --text_len;
+                sidecar_parse_line(p, text_len, rec.len, off, *sidecar, entries[k]);
+                sidecar_assign_name(names, p, entries[k]);
+                off += rec.len;
+            }
+            if (!sidecar_write(sidecar_path_for(path), header_blob.size(),
+                               entries.data(), entries.size(), names)) {
+                #pragma omp critical
+                {
+                    global_ok = 0;
+                }
+            }
+        }
+    }
 
-        std::fprintf(stderr,
-                     "[OMP] chr %s done, regions=%zu, written_reads=%ld\n",
-                     c.name.c_str(), c.regions.size(), (long)written_reads);
+    // 4. catch-all：unmapped、不在 chr1-22/X/Y 上或落不进任何 region 的记录，
+    //    按输入顺序一次性大块写到 out_dir/unmapped.sam（不排序，header 保持原样）
+    if (unplaced) {
+        std::vector<const SamRecord*> rest;
+        for (int chr_id = 0; chr_id < n_chr; ++chr_id) {
+            for (size_t k = 0; k < chr_leftover[chr_id].size(); ++k)
+                rest.push_back(&records[chr_leftover[chr_id][k]]);
+        }
+        for (size_t k = 0; k < unplaced->size(); ++k) rest.push_back(&(*unplaced)[k]);
+        std::sort(rest.begin(), rest.end(),
+                  [](const SamRecord* a, const SamRecord* b) { return a->offset < b->offset; });
+
+        if (!rest.empty()) {
+            std::string raw_header;
+            for (const auto& hline : header_lines) raw_header += hline;
+            std::string path = out_dir + "/" + SAM_CATCH_ALL_NAME;
+            if (!write_catch_all(path, sam_buf, raw_header, rest, sidecar)) {
+                global_ok = 0;
+            } else {
+                total_written += (int64_t)rest.size();
+            }
+            std::fprintf(stderr, "[OMP] catch-all: %zu unplaced reads -> %s\n",
+                         rest.size(), path.c_str());
+        }
     }
 
+    std::fprintf(stderr,
+                 "[OMP] split done, regions=%zu, written_reads=%ld\n",
+                 tasks.size(), (long)total_written);
+
     return global_ok != 0;
 }
 
@@ -616,7 +1405,7 @@ static bool split_sam_by_regions_from_memory_init(const char* sam_buf,
                                              const std::string& out_dir,
                                              const std::vector<ChrInfo>& chrs,
                                              const std::vector<std::string>& header_lines,
-                                             const std::vector<SamRecord>& records,
+                                             const RecordVec& records,
                                              const std::vector< std::vector<int> >& chr_rec_indices)
 {
     int n_chr = (int)chrs.size();
@@ -715,25 +1504,635 @@ static bool split_sam_by_regions_from_memory_init(const char* sam_buf,
     return global_ok != 0;
 }
 
+// ---------------- region 文件的 header ----------------
+// 每个 region 文件开头都有一份 header，sw_sam_process 的单文件上限（MAX_BUF_SIZE）也算它。
+// 取原样拷贝和 --sorted 改写后两者中较大的字节数（--plan-only 时不知道切分用哪一种）。
+static size_t region_header_bytes(const std::vector<std::string>& header_lines)
+{
+    size_t raw = 0;
+    for (const auto& hline : header_lines) raw += hline.size();
+    return std::max(raw, make_sorted_header(header_lines).size());
+}
+
+// 只读输入开头的 header 行（带 '\n'）：profile / 抽样 / --plan-only 在载入 SAM 之前规划 region，
+// 用它扣掉 region 上限里 header 占的部分
+static bool read_sam_header(const std::string& sam_path, std::vector<std::string>& header_lines)
+{
+    FILE* fp = sam_input_open(sam_path);
+    if (!fp) {
+        std::fprintf(stderr, "Failed to open SAM: %s (%s)\n",
+                     sam_path.c_str(), std::strerror(errno));
+        return false;
+    }
+    char*  line = NULL;
+    size_t cap  = 0;
+    while (true) {
+        ssize_t n = getline(&line, &cap, fp);
+        if (n <= 0 || line[0] != '@') break;
+        header_lines.push_back(std::string(line, (size_t)n));
+    }
+    if (line) std::free(line);
+    std::fclose(fp);
+    return true;
+}
+
+// region 字节数上限：MAX_REGION_MB 扣掉 header
+static double region_max_bytes(size_t header_bytes)
+{
+    double max_bytes = MAX_REGION_MB * 1024.0 * 1024.0 - (double)header_bytes;
+    std::fprintf(stderr, "Region size cap: %.1f MB (%zu header bytes per region file)\n",
+                 max_bytes / 1024.0 / 1024.0, header_bytes);
+    return max_bytes;
+}
+
+// ---------------- 对每个 chr 划分 region ----------------
+static void build_all_regions(std::vector<ChrInfo>& chrs, double target_bytes, double max_bytes)
+{
+    std::fprintf(stderr, "Target region size: %.1f MB (%.0f bytes)\n",
+                 target_bytes / 1024.0 / 1024.0, target_bytes);
+
+    double t_reg0 = now_ms();
+    for (size_t i = 0; i < chrs.size(); ++i) {
+        std::fprintf(stderr, "Build regions for chr %s ...\n",
+                     chrs[i].name.c_str());
+        build_regions_for_chr(chrs[i], target_bytes, max_bytes);
+    }
+    double t_reg1 = now_ms();
+    std::fprintf(stderr, "Region building time: %.3f ms\n", t_reg1 - t_reg0);
+
+    // 统计总 region 数
+    size_t total_regions = 0;
+    for (size_t i = 0; i < chrs.size(); ++i)
+        total_regions += chrs[i].regions.size();
+    std::fprintf(stderr, "Total regions: %zu\n", total_regions);
+}
+
+// ---------------- 抽样规划（--plan-sample） ----------------
+//
+// 把文件等分成 n 段，每段开头 pread 一个 PLAN_SAMPLE_BLOCK 大小的块，
+// 只统计“行首落在块内”的记录（块首对齐到下一行行首，块内最后一行续读到它的行尾），
+// 这样每行被抽中的概率都等于抽样比例，bin 权重乘以 文件大小 / 抽样字节数 即为估计值。
+// 每个块作为一个整群，用块间方差估计各 region 预测大小的标准误。
+
+// 从 read_off + got 处再 pread 最多 want 字节追加到 buf，got 随之增加（到文件尾时读得更少）
+static bool sample_read_more(int fd, uint64_t read_off, uint64_t file_size, size_t want,
+                             std::vector<char>& buf, size_t& got)
+{
+    if (read_off + got + want > file_size) want = (size_t)(file_size - read_off - got);
+    size_t end = got + want;
+    buf.resize(end);
+    while (got < end) {
+        ssize_t n = pread(fd, &buf[got], end - got, (off_t)(read_off + got));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        if (n == 0) break;
+        got += (size_t)n;
+    }
+    buf.resize(got);
+    return true;
+}
+
+// 解析一个抽样块，block_recs 收集行首在 [off, off+block_len) 内的记录。
+// 行首在块内的行一定读完：块尾多读的 PLAN_SAMPLE_TAIL 不够时继续 pread 到它的 '\n'，
+// 否则长读长（ONT / PacBio 一行上百 KB）的行会被系统性地漏掉，低估它们所在的 bin
+static bool sample_one_block(int fd,
+                             uint64_t off,
+                             size_t block_len,
+                             uint64_t file_size,
+                             const std::unordered_map<std::string,int>& chr_index,
+                             const std::vector<ChrInfo>& chrs,
+                             std::vector<SamRecord>& block_recs,
+                             uint64_t& sampled_bytes)
+{
+    // 多读前一个字节用来判断 off 是否正好是行首
+    uint64_t read_off = (off > 0) ? off - 1 : 0;
+    std::vector<char> buf;
+    size_t got = 0;
+    if (!sample_read_more(fd, read_off, file_size,
+                          (size_t)(off - read_off) + block_len + PLAN_SAMPLE_TAIL, buf, got))
+        return false;
+
+    size_t i         = (size_t)(off - read_off);
+    size_t block_end = std::min(i + block_len, got);
+    if (off > 0 && buf[i - 1] != '\n') {
+        // 块首落在行中间：下一个行首之前没有 '\n' 时块内就没有行首
+        const char* nl = (const char*)std::memchr(&buf[i], '\n', block_end - i);
+        i = nl ? (size_t)(nl - &buf[0]) + 1 : block_end;
+    }
+
+    while (i < block_end) {
+        size_t line_start = i;
+        SamFields f;
+        sam_fields_scan(&buf[line_start], got - line_start, 4, f);
+        if (!f.newline && read_off + got < file_size) {
+            // 行没读完：按已读长度倍增地继续读，再从行首重新切分
+            if (!sample_read_more(fd, read_off, file_size,
+                                  std::max(PLAN_SAMPLE_TAIL, got - line_start), buf, got))
+                return false;
+            continue;
+        }
+        size_t text_len = f.len;
+        i = line_start + f.next;
+        size_t line_len = i - line_start;
+        if (line_len == 0) continue;
+
+        sampled_bytes += line_len;
+        const char* line_ptr = &buf[line_start];
+        if (line_ptr[0] == '@') continue;
+
+        const char* rname_s = NULL;
+        size_t      rname_l = 0;
+        long long   pos     = 0;
+        if (!sam_fields_rname_pos(line_ptr, text_len, f, rname_s, rname_l, pos)) continue;
+
+        auto it = chr_index.find(std::string(rname_s, rname_l));
+        if (it == chr_index.end()) continue;
+        if (pos <= 0 || pos > chrs[it->second].length) continue;
+
+        SamRecord rec;
+        rec.chr_id = it->second;
+        rec.pos    = pos;
+        rec.offset = (size_t)(read_off + line_start);
+        rec.len    = line_len;
+        block_recs.push_back(rec);
+    }
+    return true;
+}
+
+// 抽样统计 bin_weight（已按抽样比例放大，热点 bin 同样细化），block_recs 按块保存抽中的记录
+static bool sample_bin_weights(const std::string& sam_path,
+                               const std::unordered_map<std::string,int>& chr_index,
+                               std::vector<ChrInfo>& chrs,
+                               double target_bytes,
+                               std::vector< std::vector<SamRecord> >& block_recs,
+                               double& scale,
+                               uint64_t& est_records)
+{
+    int fd = open(sam_path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::fprintf(stderr, "Failed to open SAM: %s (%s)\n",
+                     sam_path.c_str(), std::strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        std::fprintf(stderr, "Empty or unreadable SAM: %s\n", sam_path.c_str());
+        close(fd);
+        return false;
+    }
+    uint64_t file_size = (uint64_t)st.st_size;
+
+    // 块数：约 PLAN_SAMPLE_FRACTION 的字节；文件太小则整个读完（每段即一个块）
+    uint64_t n_blocks = (uint64_t)(file_size * PLAN_SAMPLE_FRACTION / PLAN_SAMPLE_BLOCK) + 1;
+    if (n_blocks < PLAN_SAMPLE_MIN_BLOCKS) n_blocks = PLAN_SAMPLE_MIN_BLOCKS;
+    if (n_blocks > file_size) n_blocks = file_size;
+    uint64_t stride   = file_size / n_blocks;
+    size_t   block_len = PLAN_SAMPLE_BLOCK;
+    if (stride <= PLAN_SAMPLE_BLOCK) {
+        block_len = (size_t)stride;           // 相邻块首尾相接：块 b 只取行首落在 [b*stride, (b+1)*stride) 的行
+    }
+
+    block_recs.assign(n_blocks, std::vector<SamRecord>());
+    std::vector<uint64_t> block_bytes(n_blocks, 0);
+    int failed = 0;
+
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (int64_t b = 0; b < (int64_t)n_blocks; ++b) {
+        uint64_t off = (uint64_t)b * stride;
+        size_t   len = block_len;
+        if (b == (int64_t)n_blocks - 1 && stride <= PLAN_SAMPLE_BLOCK) {
+            len = (size_t)(file_size - off);     // 整个读完时最后一段包含余数
+        }
+        if (!sample_one_block(fd, off, len, file_size, chr_index, chrs,
+                              block_recs[b], block_bytes[b])) {
+            #pragma omp atomic write
+            failed = 1;
+        }
+    }
+    close(fd);
+    if (failed) {
+        std::fprintf(stderr, "pread failed while sampling %s (%s)\n",
+                     sam_path.c_str(), std::strerror(errno));
+        return false;
+    }
+
+    uint64_t sampled_bytes = 0;
+    RecordVec all;
+    for (uint64_t b = 0; b < n_blocks; ++b) {
+        sampled_bytes += block_bytes[b];
+        all.insert(all.end(), block_recs[b].begin(), block_recs[b].end());
+    }
+    if (sampled_bytes == 0) {
+        std::fprintf(stderr, "Sampling read no complete lines from %s\n", sam_path.c_str());
+        return false;
+    }
+    scale       = (double)file_size / (double)sampled_bytes;
+    est_records = (uint64_t)(all.size() * scale + 0.5);
+
+    for (size_t r = 0; r < all.size(); ++r) {
+        ChrInfo& c = chrs[all[r].chr_id];
+        if (c.num_bins <= 0) continue;
+        int64_t bin_idx = (all[r].pos - 1) / BIN_SIZE;
+        if (bin_idx >= c.num_bins) bin_idx = c.num_bins - 1;
+        c.bin_weight[bin_idx] += (double)all[r].len;
+    }
+    // 阈值按未放大的权重换算
+    refine_hot_bins(chrs, all, target_bytes / scale);
+    scale_bin_weights(chrs, scale);
+
+    std::fprintf(stderr,
+                 "Sampled %lu blocks: %.3f MB of %.3f MB (%.2f%%), records=%zu, scale=%.2f\n",
+                 (unsigned long)n_blocks, sampled_bytes / 1024.0 / 1024.0,
+                 file_size / 1024.0 / 1024.0, 100.0 / scale, all.size(), scale);
+    return true;
+}
+
+// 用块间方差估计每个 region 预测大小的标准误：
+//   T = scale * sum_i y_i，Var(T) ≈ scale^2 * n * s^2 * (1 - 1/scale)，y_i 为第 i 块落在该 region 的字节数
+static void report_sample_error(const std::vector<ChrInfo>& chrs,
+                                const std::vector< std::vector<SamRecord> >& block_recs,
+                                double scale,
+                                double max_bytes)
+{
+    // region 编号：chr 内按顺序，全局偏移 base[chr]
+    std::vector<size_t> base(chrs.size() + 1, 0);
+    for (size_t c = 0; c < chrs.size(); ++c)
+        base[c + 1] = base[c] + chrs[c].regions.size();
+    size_t n_regions = base[chrs.size()];
+    if (n_regions == 0) return;
+
+    std::vector<double> sum(n_regions, 0.0), sumsq(n_regions, 0.0);
+    std::vector<double> y(n_regions, 0.0);
+    std::vector<size_t> touched;
+
+    for (size_t b = 0; b < block_recs.size(); ++b) {
+        touched.clear();
+        for (size_t k = 0; k < block_recs[b].size(); ++k) {
+            const SamRecord& rec = block_recs[b][k];
+            const std::vector<Region>& regs = chrs[rec.chr_id].regions;
+            size_t lo = 0, hi = regs.size();
+            while (lo < hi) {                        // 第一个 end >= pos 的 region
+                size_t mid = (lo + hi) / 2;
+                if (regs[mid].end < rec.pos) lo = mid + 1;
+                else hi = mid;
+            }
+            if (lo >= regs.size()) continue;
+            size_t r = base[rec.chr_id] + lo;
+            if (y[r] == 0.0) touched.push_back(r);
+            y[r] += (double)rec.len;
+        }
+        for (size_t k = 0; k < touched.size(); ++k) {
+            size_t r = touched[k];
+            sum[r]   += y[r];
+            sumsq[r] += y[r] * y[r];
+            y[r] = 0.0;
+        }
+    }
+
+    double n    = (double)block_recs.size();
+    double fpc  = (scale > 1.0) ? (1.0 - 1.0 / scale) : 0.0;
+    std::vector<double> rel_err;
+    double worst = 0.0;
+    size_t worst_r = 0;
+    size_t over_cap = 0;
+    for (size_t r = 0; r < n_regions; ++r) {
+        double est = scale * sum[r];
+        if (est <= 0.0) continue;
+        double var_y = (n > 1.0) ? (sumsq[r] - sum[r] * sum[r] / n) / (n - 1.0) : 0.0;
+        if (var_y < 0.0) var_y = 0.0;
+        double se  = scale * std::sqrt(n * var_y * fpc);
+        double rel = se / est;
+        rel_err.push_back(rel);
+        if (rel > worst) {
+            worst   = rel;
+            worst_r = r;
+        }
+        if (est + 2.0 * se > max_bytes) over_cap++;
+    }
+    if (rel_err.empty()) return;
+
+    std::sort(rel_err.begin(), rel_err.end());
+    size_t wc = 0;
+    while (wc + 1 < chrs.size() && base[wc + 1] <= worst_r) ++wc;
+    const Region& wr = chrs[wc].regions[worst_r - base[wc]];
+    std::fprintf(stderr,
+                 "Sampling error of predicted region sizes (1 s.e.): median=%.1f%%, max=%.1f%% (%s:%ld-%ld)\n",
+                 rel_err[rel_err.size() / 2] * 100.0, worst * 100.0,
+                 chrs[wc].name.c_str(), (long)wr.start, (long)wr.end);
+    if (over_cap > 0) {
+        std::fprintf(stderr,
+                     "  [WARN] %zu regions may exceed %.1f MB within 2 s.e.; consider a larger sample or a profile\n",
+                     over_cap, max_bytes / 1024.0 / 1024.0);
+    }
+}
+
+// ---------------- 只规划（--plan-only） ----------------
+//
+// 不把 SAM 读进内存、也不写 region 文件，直接把规划结果写成 region_auto.txt，
+// 供 split_from_region 使用（省掉一次完整的切分写盘和 check_sam 扫描）。
+// 没有 --profile / --plan-sample 时流式读一遍 SAM 统计直方图，
+// 有热点 bin 时再读一遍统计 1bp 权重。
+
+static const size_t PLAN_READ_CHUNK = 16 * 1024 * 1024;
+
+// 流式逐行读取 SAM，对每个比对记录调用 fn(chr_id, pos, line_len)
+template <typename Fn>
+static bool stream_sam_records(const std::string& sam_path,
+                               const std::unordered_map<std::string,int>& chr_index,
+                               const std::vector<ChrInfo>& chrs,
+                               Fn fn)
+{
+    FILE* fp = sam_input_open(sam_path);
+    if (!fp) {
+        std::fprintf(stderr, "Failed to open SAM: %s (%s)\n",
+                     sam_path.c_str(), std::strerror(errno));
+        return false;
+    }
+
+    std::vector<char> buf(PLAN_READ_CHUNK);
+    size_t carry = 0;     // 上一块末尾不完整的行，已挪到 buf 开头
+    bool   eof   = false;
+    while (!eof) {
+        if (carry == buf.size()) buf.resize(buf.size() * 2);   // 超长行
+        size_t n = std::fread(&buf[carry], 1, buf.size() - carry, fp);
+        if (n == 0) eof = true;
+        size_t avail = carry + n;
+
+        size_t i = 0;
+        while (i < avail) {
+            size_t line_start = i;
+            SamFields f;
+            sam_fields_scan(&buf[line_start], avail - line_start, 4, f);
+            if (!f.newline && !eof) {
+                i = line_start;              // 行没读完，留到下一块
+                break;
+            }
+            size_t text_len = f.len;
+            i = line_start + f.next;
+            size_t line_len = i - line_start;
+
+            const char* line_ptr = &buf[line_start];
+            if (line_len == 0 || line_ptr[0] == '@') continue;
+
+            const char* rname_s = NULL;
+            size_t      rname_l = 0;
+            long long   pos     = 0;
+            if (!sam_fields_rname_pos(line_ptr, text_len, f, rname_s, rname_l, pos)) continue;
+
+            auto it = chr_index.find(std::string(rname_s, rname_l));
+            if (it == chr_index.end()) continue;
+            if (pos <= 0 || pos > chrs[it->second].length) continue;
+
+            fn(it->second, pos, line_len);
+        }
+
+        carry = avail - i;
+        if (carry > 0) std::memmove(&buf[0], &buf[i], carry);
+    }
+
+    bool ok = !std::ferror(fp);
+    if (std::fclose(fp) != 0) ok = false;
+    if (!ok) {
+        std::fprintf(stderr, "Read error on SAM: %s\n", sam_path.c_str());
+    }
+    return ok;
+}
+
+// 流式统计 bin_weight（含热点 bin 的 1bp 权重），n_records 返回参与统计的记录数
+static bool stream_bin_weights(const std::string& sam_path,
+                               const std::unordered_map<std::string,int>& chr_index,
+                               std::vector<ChrInfo>& chrs,
+                               double target_bytes,
+                               uint64_t& n_records)
+{
+    n_records = 0;
+    bool ok = stream_sam_records(sam_path, chr_index, chrs,
+        [&](int chr_id, int64_t pos, size_t len) {
+            ChrInfo& c = chrs[chr_id];
+            if (c.num_bins <= 0) return;
+            int64_t bin_idx = (pos - 1) / BIN_SIZE;
+            if (bin_idx >= c.num_bins) bin_idx = c.num_bins - 1;
+            c.bin_weight[bin_idx] += (double)len;
+            n_records++;
+        });
+    if (!ok) return false;
+
+    double hot_threshold = target_bytes * HOT_BIN_FRACTION;
+    std::vector< std::vector<int> > hot_slot;
+    size_t n_hot = select_hot_bins(chrs, hot_threshold, hot_slot);
+    if (n_hot == 0) return true;
+
+    ok = stream_sam_records(sam_path, chr_index, chrs,
+        [&](int chr_id, int64_t pos, size_t len) {
+            add_fine_weight(chrs, hot_slot, chr_id, pos, len);
+        });
+    if (ok) {
+        std::fprintf(stderr, "Refined %zu hot bins (> %.1f MB) to 1bp resolution\n",
+                     n_hot, hot_threshold / 1024.0 / 1024.0);
+    }
+    return ok;
+}
+
+// 写 region 列表：chr start end pred_bytes pred_records（split_from_region 只用前三列）
+static bool write_region_plan(const std::string& path,
+                              const std::vector<ChrInfo>& chrs,
+                              double avg_record_bytes)
+{
+    FILE* fp = std::fopen(path.c_str(), "wb");
+    if (!fp) {
+        std::fprintf(stderr, "Failed to write region file: %s (%s)\n",
+                     path.c_str(), std::strerror(errno));
+        return false;
+    }
+
+    std::fprintf(fp, "#chr\tstart\tend\tpred_bytes\tpred_records\tpred_mapped\n");
+    size_t n = 0;
+    for (size_t i = 0; i < chrs.size(); ++i) {
+        for (size_t k = 0; k < chrs[i].regions.size(); ++k) {
+            const Region& r = chrs[i].regions[k];
+            double records = (avg_record_bytes > 0.0) ? r.bytes / avg_record_bytes : 0.0;
+            // region 里只会有落在该区间的已比对记录，pred_mapped 与 pred_records 相同
+            std::fprintf(fp, "%s\t%lld\t%lld\t%.0f\t%.0f\t%.0f\n",
+                         chrs[i].name.c_str(), (long long)r.start, (long long)r.end,
+                         r.bytes, records, records);
+            n++;
+        }
+    }
+
+    bool ok = !std::ferror(fp);
+    if (std::fclose(fp) != 0) ok = false;
+    if (!ok) {
+        std::fprintf(stderr, "Failed to write region file: %s\n", path.c_str());
+        return false;
+    }
+    std::fprintf(stderr, "Region plan written: %s (regions=%zu)\n", path.c_str(), n);
+    return true;
+}
+
+// 所有 bin 的权重之和（字节）
+static double total_bin_weight(const std::vector<ChrInfo>& chrs)
+{
+    double total = 0.0;
+    for (size_t i = 0; i < chrs.size(); ++i)
+        for (size_t b = 0; b < chrs[i].bin_weight.size(); ++b)
+            total += chrs[i].bin_weight[b];
+    return total;
+}
+
+// ---------------- 线程绑核 ----------------
+//
+// 多 socket 机器上把 OpenMP 线程轮流绑到各个 socket（physical_package_id）的 CPU 上，
+// 配合分块 first-touch，读 / 解析 / 切分的内存带宽分散到所有节点。
+// 用户设置了 OMP_PROC_BIND / OMP_PLACES / GOMP_CPU_AFFINITY 时不做任何处理。
+static void pin_threads_across_sockets()
+{
+#ifdef _OPENMP
+    if (std::getenv("OMP_PROC_BIND") || std::getenv("OMP_PLACES") ||
+        std::getenv("GOMP_CPU_AFFINITY")) {
+        return;
+    }
+
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return;
+
+    // socket -> CPU 列表
+    std::vector< std::vector<int> > by_pkg;
+    std::vector<int> pkg_ids;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (!CPU_ISSET(cpu, &allowed)) continue;
+        char path[128];
+        std::snprintf(path, sizeof(path),
+                      "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+        int pkg = 0;
+        FILE* fp = std::fopen(path, "r");
+        if (fp) {
+            if (std::fscanf(fp, "%d", &pkg) != 1) pkg = 0;
+            std::fclose(fp);
+        }
+        size_t k = 0;
+        while (k < pkg_ids.size() && pkg_ids[k] != pkg) ++k;
+        if (k == pkg_ids.size()) {
+            pkg_ids.push_back(pkg);
+            by_pkg.push_back(std::vector<int>());
+        }
+        by_pkg[k].push_back(cpu);
+    }
+    if (by_pkg.size() <= 1) return;   // 单 socket 不需要
+
+    // 轮流从各 socket 取 CPU
+    std::vector<int> order;
+    for (size_t r = 0; ; ++r) {
+        bool any = false;
+        for (size_t k = 0; k < by_pkg.size(); ++k) {
+            if (r < by_pkg[k].size()) {
+                order.push_back(by_pkg[k][r]);
+                any = true;
+            }
+        }
+        if (!any) break;
+    }
+
+    #pragma omp parallel
+    {
+        int tid = omp_get_thread_num();
+        cpu_set_t one;
+        CPU_ZERO(&one);
+        CPU_SET(order[tid % order.size()], &one);
+        sched_setaffinity(0, sizeof(one), &one);
+    }
+    std::fprintf(stderr, "Pinned %d threads across %zu sockets\n",
+                 omp_get_max_threads(), by_pkg.size());
+#endif
+}
+
+static void print_usage(const char* prog)
+{
+    std::fprintf(stderr,
+                 "Usage: %s [options] <ref.fa> <in.sam> <out_dir>\n"
+                 "       %s --plan-only [options] <ref.fa> <in.sam> <region_auto.txt>\n"
+                 "Options:\n"
+                 "  --save-profile <file> : save the per-bin coverage profile after parsing\n"
+                 "  --profile <file>      : plan regions from a saved profile (skip histogram)\n"
+                 "  --profile-rescale     : rescale profile weights by in.sam size / profile input size\n"
+                 "  --sorted              : write each region sorted by POS (header marked SO:coordinate)\n"
+                 "  --sidecar             : also write a binary field index <region>.sidx per region\n"
+                 "  --plan-sample         : plan regions from ~1%% evenly spaced blocks of in.sam (skip histogram)\n"
+                 "  --plan-only           : only write the region list (with predicted bytes/records), no split\n"
+                 "  --drop-unmapped       : drop reads outside all regions instead of writing " SAM_CATCH_ALL_NAME "\n"
+                 "Example:\n"
+                 "  %s ref.fa input.sam out_regions\n"
+                 "  %s --save-profile kit.prof ref.fa sample1.sam out_regions1\n"
+                 "  %s --profile kit.prof --profile-rescale ref.fa sample2.sam out_regions2\n"
+                 "  %s --plan-only --plan-sample ref.fa input.sam region_auto.txt\n",
+                 prog, prog, prog, prog, prog, prog);
+}
+
 // ---------------- main ----------------
 int main(int argc, char** argv)
 {
-    if (argc < 4) {
-        std::fprintf(stderr,
-                     "Usage: %s <ref.fa> <in.sam> <out_dir>\n"
-                     "Example:\n"
-                     "  %s ref.fa input.sam out_regions\n",
-                     argv[0], argv[0]);
+    std::string save_profile_path;
+    std::string profile_path;
+    bool        profile_rescale = false;
+    bool        sort_by_pos     = false;
+    bool        write_sidecar   = false;
+    bool        plan_sample     = false;
+    bool        plan_only       = false;
+    bool        drop_unmapped   = false;
+    std::vector<std::string> positional;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--save-profile" && i + 1 < argc) {
+            save_profile_path = argv[++i];
+        } else if (arg == "--profile" && i + 1 < argc) {
+            profile_path = argv[++i];
+        } else if (arg == "--profile-rescale") {
+            profile_rescale = true;
+        } else if (arg == "--sorted") {
+            sort_by_pos = true;
+        } else if (arg == "--sidecar") {
+            write_sidecar = true;
+        } else if (arg == "--plan-sample") {
+            plan_sample = true;
+        } else if (arg == "--plan-only") {
+            plan_only = true;
+        } else if (arg == "--drop-unmapped") {
+            drop_unmapped = true;
+        } else if (arg.size() > 2 && arg.compare(0, 2, "--") == 0) {
+            std::fprintf(stderr, "Unknown or incomplete option: %s\n", arg.c_str());
+            print_usage(argv[0]);
+            return 1;
+        } else {
+            positional.push_back(arg);
+        }
+    }
+
+    if (positional.size() < 3) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (plan_sample && !profile_path.empty()) {
+        std::fprintf(stderr, "--plan-sample and --profile are mutually exclusive\n");
+        return 1;
+    }
+    // 抽样需要随机访问、按文件大小缩放需要未压缩的大小，这两者只支持 plain SAM
+    if ((plan_sample || profile_rescale) && sam_input_format(positional[1]) != SAM_INPUT_PLAIN) {
+        std::fprintf(stderr, "--plan-sample / --profile-rescale need an uncompressed SAM input\n");
         return 1;
     }
 
-    std::string fasta_path = argv[1];
-    std::string sam_path   = argv[2];
-    std::string out_dir    = argv[3];
+    std::string fasta_path = positional[0];
+    std::string sam_path   = positional[1];
+    std::string out_dir    = positional[2];   // --plan-only 时为 region 列表文件
 
     // 创建输出目录（如果不存在）
     struct stat st;
-    if (stat(out_dir.c_str(), &st) != 0) {
+    if (plan_only) {
+        // 不需要输出目录
+    } else if (stat(out_dir.c_str(), &st) != 0) {
         if (mkdir(out_dir.c_str(), 0755) != 0) {
             std::fprintf(stderr, "Failed to create out_dir: %s (%s)\n",
                          out_dir.c_str(), std::strerror(errno));
@@ -747,6 +2146,8 @@ int main(int argc, char** argv)
         }
     }
 
+    pin_threads_across_sockets();
+
     // 1. 解析 FASTA（只保留 chr1-22, chrX, chrY）
     std::vector<ChrInfo> chrs;
     std::unordered_map<std::string,int> chr_index;
@@ -754,51 +2155,153 @@ int main(int argc, char** argv)
         return 1;
     }
 
+    double target_bytes = TARGET_REGION_MB * 1024.0 * 1024.0;
+    double max_bytes    = MAX_REGION_MB * 1024.0 * 1024.0;
+    double n_records_planned = 0.0;   // 规划所依据的记录数（用于预测每个 region 的记录数）
+
+    // 载入 SAM 之前就要规划 region 时，先只读 header 来确定 region 上限
+    bool use_profile = !profile_path.empty();
+    if (use_profile || plan_sample || plan_only) {
+        std::vector<std::string> plan_header;
+        if (!read_sam_header(sam_path, plan_header)) {
+            return 1;
+        }
+        max_bytes = region_max_bytes(region_header_bytes(plan_header));
+    }
+
+    // 1.5 有 profile 时直接规划 region，不需要等 SAM 解析完
+    if (use_profile) {
+        ProfileHeader ph;
+        if (!load_profile(profile_path, chrs, chr_index, ph)) {
+            return 1;
+        }
+        if (profile_rescale) {
+            struct stat sst;
+            if (stat(sam_path.c_str(), &sst) != 0 || ph.input_bytes == 0) {
+                std::fprintf(stderr, "Cannot rescale profile: stat %s failed or profile input size is 0\n",
+                             sam_path.c_str());
+                return 1;
+            }
+            double scale = (double)sst.st_size / (double)ph.input_bytes;
+            std::fprintf(stderr, "Rescale profile weights by %.4f\n", scale);
+            scale_bin_weights(chrs, scale);
+            n_records_planned = (double)ph.total_records * scale;
+        } else {
+            n_records_planned = (double)ph.total_records;
+        }
+        build_all_regions(chrs, target_bytes, max_bytes);
+    }
+
+    // 1.6 抽样估计 bin_weight 并规划 region
+    if (plan_sample) {
+        std::vector< std::vector<SamRecord> > block_recs;
+        double   scale       = 1.0;
+        uint64_t est_records = 0;
+        double t_sample0 = now_ms();
+        if (!sample_bin_weights(sam_path, chr_index, chrs, target_bytes,
+                                block_recs, scale, est_records)) {
+            return 1;
+        }
+        build_all_regions(chrs, target_bytes, max_bytes);
+        report_sample_error(chrs, block_recs, scale, max_bytes);
+        n_records_planned = (double)est_records;
+        std::fprintf(stderr, "Sample planning time: %.3f ms\n", now_ms() - t_sample0);
+
+        if (!save_profile_path.empty()) {
+            struct stat sst;
+            uint64_t input_bytes = (stat(sam_path.c_str(), &sst) == 0) ? (uint64_t)sst.st_size : 0;
+            if (!save_profile(save_profile_path, chrs, input_bytes, est_records)) {
+                return 1;
+            }
+        }
+    }
+
+    // 1.7 只规划：必要时流式统计直方图，写出 region 列表后直接结束
+    if (plan_only) {
+        if (!use_profile && !plan_sample) {
+            uint64_t n_records = 0;
+            double t_scan0 = now_ms();
+            if (!stream_bin_weights(sam_path, chr_index, chrs, target_bytes, n_records)) {
+                return 1;
+            }
+            std::fprintf(stderr, "Histogram scan time: %.3f ms (records=%lu)\n",
+                         now_ms() - t_scan0, (unsigned long)n_records);
+            n_records_planned = (double)n_records;
+
+            if (!save_profile_path.empty()) {
+                struct stat sst;
+                uint64_t input_bytes = (stat(sam_path.c_str(), &sst) == 0) ? (uint64_t)sst.st_size : 0;
+                if (!save_profile(save_profile_path, chrs, input_bytes, n_records)) {
+                    return 1;
+                }
+            }
+            build_all_regions(chrs, target_bytes, max_bytes);
+        }
+
+        double total_w = total_bin_weight(chrs);
+        double avg_len = (n_records_planned > 0.0) ? total_w / n_records_planned : 0.0;
+        return write_region_plan(out_dir, chrs, avg_len) ? 0 : 1;
+    }
+
+    bool planned = use_profile || plan_sample;
+
     // 2. 整个 SAM 读入内存并解析
     char* sam_buf = nullptr;
     size_t sam_size = 0;
     std::vector<std::string> header_lines;
-    std::vector<SamRecord>   records;
+    RecordVec                records;
+    RecordVec                unplaced;
 
     double t_load0 = now_ms();
     if (!load_and_parse_sam(sam_path, sam_buf, sam_size,
                             chr_index, chrs,
-                            header_lines, records)) {
+                            header_lines, records,
+                            !planned,
+                            drop_unmapped ? nullptr : &unplaced)) {
         return 1;
     }
     double t_load1 = now_ms();
     std::fprintf(stderr, "Load & parse SAM time: %.3f ms\n", t_load1 - t_load0);
 
-    // 3. 对每个 chr 划分 region
-    double target_bytes = TARGET_REGION_MB * 1024.0 * 1024.0;
-    std::fprintf(stderr, "Target region size: %.1f MB (%.0f bytes)\n",
-                 TARGET_REGION_MB, target_bytes);
+    // 2.5 热点 bin 细化到 1bp（profile / 抽样规划时已带有细化结果）
+    if (!planned) {
+        refine_hot_bins(chrs, records, target_bytes);
+    }
 
-    double t_reg0 = now_ms();
-    for (size_t i = 0; i < chrs.size(); ++i) {
-        std::fprintf(stderr, "Build regions for chr %s ...\n",
-                     chrs[i].name.c_str());
-        build_regions_for_chr(chrs[i], target_bytes);
+    if (!save_profile_path.empty() && !plan_sample) {
+        if (use_profile) {
+            std::fprintf(stderr, "[WARN] --save-profile ignored with --profile (no histogram computed)\n");
+        } else if (!save_profile(save_profile_path, chrs,
+                                 (uint64_t)sam_size, (uint64_t)records.size())) {
+            return 1;
+        }
     }
-    double t_reg1 = now_ms();
-    std::fprintf(stderr, "Region building time: %.3f ms\n", t_reg1 - t_reg0);
 
-    // 统计总 region 数
-    size_t total_regions = 0;
-    for (size_t i = 0; i < chrs.size(); ++i)
-        total_regions += chrs[i].regions.size();
-    std::fprintf(stderr, "Total regions: %zu\n", total_regions);
+    // 3. 对每个 chr 划分 region
+    if (!planned) {
+        max_bytes = region_max_bytes(region_header_bytes(header_lines));
+        build_all_regions(chrs, target_bytes, max_bytes);
+    }
 
     // 4. 构建 per-chr record 列表
     std::vector< std::vector<int> > chr_rec_indices;
     build_chr_record_indices(records, chrs.size(), chr_rec_indices);
 
-    // 5. 并行按 chr 切分：直接从 sam_buf 写 region
+    // sidecar 的 contig id 按 header 中 @SQ 顺序编号
+    SidecarContigs sidecar_contigs;
+    if (write_sidecar) {
+        sidecar_contigs_from_header(header_lines, sidecar_contigs);
+    }
+
+    // 5. 并行按 region 切分：直接从 sam_buf 写 region
     double t_split0 = now_ms();
-    std::fprintf(stderr, "Using OpenMP to split SAM by chromosome from memory.\n");
+    std::fprintf(stderr, "Using OpenMP to split SAM by region from memory.\n");
     bool ok = split_sam_by_regions_from_memory(sam_buf, out_dir,
                                                chrs, header_lines,
-                                               records, chr_rec_indices);
+                                               records, chr_rec_indices,
+                                               sort_by_pos,
+                                               write_sidecar ? &sidecar_contigs : nullptr,
+                                               drop_unmapped ? nullptr : &unplaced);
     double t_split1 = now_ms();
     std::fprintf(stderr, "Split time: %.3f ms\n", t_split1 - t_split0);
 
@@ -806,4 +2309,3 @@ int main(int argc, char** argv)
 
     return ok ? 0 : 1;
 }
-
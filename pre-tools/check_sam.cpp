@@ -1,7 +1,8 @@
 // check_sam.cpp
 // 用法：
-//   g++ -O3 -std=gnu++11 check_sam.cpp -o check_sam
-//   ./check_sam sam_dir
+//   g++ -O3 -std=gnu++11 check_sam.cpp -o check_sam -pthread
+//   ./check_sam [--threads N] sam_dir
+//   ./check_sam [--threads N] --validate <in_dir|region_manifest.txt> out_dir
 //
 // 功能：
 //   1) 对 sam_dir 中的每个 SAM 文件：
@@ -10,28 +11,47 @@
 //                chr10_42163648_43168944_1708.sam.sorted.sw.sam
 //            取第一个 ".sam" 前的部分，按 '_' 拆出前三段：
 //                tokens[0]=chrName, tokens[1]=start, tokens[2]=end
-//        - 扫描 SAM 内容，解析每条记录的 RNAME, POS；
+//        - 扫描 SAM 内容（mmap），解析每条记录的 RNAME, POS；
+//          多个文件由 --threads 个线程（默认全部硬件线程）并发检查；
 //
 //        - 只打印**有问题**的文件：
 //             - RNAME != chrName，或
 //             - POS 不在 [start,end]
-//          正常通过的文件不打印。
+//          正常通过的文件不打印；有问题的文件按目录遍历顺序打印，与线程数无关。
 //
-//   2) 扫描结束后，在 sam_dir 里生成 region_auto.txt：
-//        每行：chr  start  end
-//        只包含能从文件名解析出的 region（自动去重）。
+//   2) 扫描结束后，在当前目录生成 region_auto.txt：
+//        每行：chr  start  end  bytes  records  mapped（文件字节数、记录数、已比对记录数）
+//        只包含能从文件名解析出的 region（自动去重），按 contig 顺序（header 的 @SQ 顺序）
+//        再按 start 排序。
+//
+//   3) --validate in_dir out_dir：校验 sw_sam_process 的输出（排序、region 范围、
+//      与输入的记录数/摘要一致、重复标记统计），细节见 validate_outputs 前的说明。
+//      in_dir 也可以是之前生成的 region_manifest.txt。有问题时退出码为 1。
 //
 // ----------------------------------------------------------
 
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <cstdarg>
 #include <string>
 #include <vector>
 #include <unordered_set>
+#include <unordered_map>
+#include <algorithm>
+#include <functional>
+#include <atomic>
+#include <thread>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <errno.h>
+#include <climits>
+#include "../slave/sam_process_para.h"
+#include "sam_fields.h"
 
 // 简单辅助：判断字符串是否以 suffix 结尾（目前没用到，可留着）
 static bool ends_with(const std::string& s, const std::string& suf) {
@@ -85,74 +105,88 @@ static bool parse_filename_region(const std::string& fname,
     return true;
 }
 
-// 解析 SAM 一行的 RNAME + POS
-// 输入: line(不一定以 '\0' 结束)，len(不含 '\n')。
-// 输出: rname_start/rname_len, pos_out
-// 返回: true=解析成功且不是 header；false=失败或 header。
-static bool parse_sam_rname_pos(const char* line,
-                                size_t len,
-                                const char*& rname_start,
-                                size_t& rname_len,
-                                long long& pos_out)
+// 往 report 里追加格式化文本（各线程先写自己的 report，最后按文件顺序统一打印）
+static void report_printf(std::string& report, const char* fmt, ...)
 {
-    if (len == 0) return false;
-    if (line[0] == '@') return false; // header 行
-
-    int    field = 0;
-    size_t i     = 0;
-    size_t start = 0;
-    size_t end   = 0;
-
-    const char* rname_s = nullptr;
-    size_t      rname_l = 0;
-    const char* pos_s   = nullptr;
-    size_t      pos_l   = 0;
-
-    for (i = 0; i <= len; ++i) {
-        char c = (i == len) ? '\t' : line[i];
-
-        if (c == '\t') {
-            end = i;
-            if (field == 2) {
-                rname_s = line + start;
-                rname_l = end - start;
-            } else if (field == 3) {
-                pos_s = line + start;
-                pos_l = end - start;
-                break;  // 后面字段不关心
-            }
-            field++;
-            start = i + 1;
+    char buf[1024];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = std::vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    report.append(buf, (size_t)n < sizeof(buf) ? (size_t)n : sizeof(buf) - 1);
+}
+
+// 只读 mmap 整个文件（空文件时 data=nullptr, size=0）；失败信息写进 report
+static bool map_sam_file(const std::string& path, const char*& data, size_t& size, std::string& report)
+{
+    data = nullptr;
+    size = 0;
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        report_printf(report, "[ERROR] Failed to open %s (%s)\n",
+                      path.c_str(), std::strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        report_printf(report, "[ERROR] Failed to stat %s (%s)\n",
+                      path.c_str(), std::strerror(errno));
+        ::close(fd);
+        return false;
+    }
+    size = (size_t)st.st_size;
+    if (size > 0) {
+        void* m = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m == MAP_FAILED) {
+            report_printf(report, "[ERROR] Failed to mmap %s (%s)\n",
+                          path.c_str(), std::strerror(errno));
+            ::close(fd);
+            size = 0;
+            return false;
         }
+        madvise(m, size, MADV_SEQUENTIAL);
+        data = (const char*)m;
     }
+    ::close(fd);
+    return true;
+}
 
-    if (!rname_s || !pos_s || pos_l == 0) return false;
+static void unmap_sam_file(const char* data, size_t size)
+{
+    if (data) munmap((void*)data, size);
+}
 
-    // 解析 POS
-    long long value = 0;
-    int       neg   = 0;
-    size_t    idx   = 0;
-    if (pos_s[0] == '-') {
-        neg = 1;
-        idx++;
-        if (idx >= pos_l) return false;
-    }
-    for (; idx < pos_l; ++idx) {
-        char c = pos_s[idx];
-        if (c < '0' || c > '9') return false;
-        value = value * 10 + (c - '0');
-    }
-    if (neg) value = -value;
+// 检查时顺带统计的文件信息，写进 region_auto.txt
+struct SamFileStats {
+    long long                bytes;
+    long long                records;
+    long long                mapped;     // RNAME/POS 解析成功且不是 unmapped 的记录
+    std::vector<std::string> contigs;    // header 中 @SQ 的顺序
 
-    rname_start = rname_s;
-    rname_len   = rname_l;
-    pos_out     = value;
-    return true;
+    SamFileStats() : bytes(0), records(0), mapped(0) {}
+};
+
+// "@SQ\tSN:xxx..." -> xxx（不是 @SQ 或没有 SN 时返回 false）
+static bool header_sq_name(const char* line, size_t len, std::string& name)
+{
+    if (len < 4 || std::memcmp(line, "@SQ\t", 4) != 0) return false;
+    for (size_t i = 3; i + 4 <= len; ++i) {
+        if (std::memcmp(line + i, "\tSN:", 4) != 0) continue;
+        size_t b = i + 4, e = b;
+        while (e < len && line[e] != '\t') ++e;
+        name.assign(line + b, e - b);
+        return true;
+    }
+    return false;
 }
 
-// 检查单个 SAM 文件
+// 检查单个 SAM 文件：整个文件 mmap 后用 sam_fields_scan 一次找出行尾和前几列（SIMD），
+// RNAME 直接和文件名里的 chr 比较，不为每条记录分配 std::string。
+// 问题信息写进 report（不直接打印，保证多线程时输出顺序确定）。
 // 返回：true = 该文件通过（没有 bad_chr/bad_range）；false = 有问题，需要在主调那边计数。
-static bool check_one_sam(const std::string& path, const std::string& fname)
+static bool check_one_sam(const std::string& path, const std::string& fname, std::string& report,
+                          SamFileStats& stats)
 {
     std::string chrName;
     long long region_start = 0;
@@ -160,24 +194,15 @@ static bool check_one_sam(const std::string& path, const std::string& fname)
 
     if (!parse_filename_region(fname, chrName, region_start, region_end)) {
         // 无法从文件名解析 region，就跳过检查（不判为“错误文件”）
-        // 如果你想在这里报警，可以解开注释：
-        // std::fprintf(stderr,
-        //              "[SKIP] %s: cannot parse chr/start/end from filename\n",
-        //              fname.c_str());
         return true;
     }
 
-    FILE* fp = std::fopen(path.c_str(), "rb");
-    if (!fp) {
-        std::fprintf(stderr,
-                     "[ERROR] Failed to open %s (%s)\n",
-                     path.c_str(), std::strerror(errno));
+    const char* data      = nullptr;
+    size_t      file_size = 0;
+    if (!map_sam_file(path, data, file_size, report)) {
         return false;
     }
 
-    char*  line = nullptr;
-    size_t cap  = 0;
-
     long long total_records    = 0;
     long long checked_records  = 0;
     long long bad_chr          = 0;
@@ -187,20 +212,20 @@ static bool check_one_sam(const std::string& path, const std::string& fname)
     const int MAX_PRINT_ERR = 10;
     int printed_err = 0;
 
-    while (true) {
-        ssize_t n = getline(&line, &cap, fp);
-        if (n < 0) break;
-        if (n == 0) continue;
+    size_t off = 0;
+    while (off < file_size) {
+        const char* line = data + off;
+        SamFields   f;                  // 行尾和前 4 列的 tab 一次扫出来
+        sam_fields_scan(line, file_size - off, 4, f);
+        size_t text_len  = f.len;
+        off += f.next;
 
-        size_t len      = (size_t)n;
-        size_t text_len = len;
-        while (text_len > 0 &&
-              (line[text_len-1] == '\n' || line[text_len-1] == '\r')) {
-            --text_len;
-        }
+        while (text_len > 0 && line[text_len-1] == '\r') --text_len;
         if (text_len == 0) continue;
 
         if (line[0] == '@') {
+            std::string sq;
+            if (header_sq_name(line, text_len, sq)) stats.contigs.push_back(sq);
             continue; // header
         }
 
@@ -209,34 +234,32 @@ static bool check_one_sam(const std::string& path, const std::string& fname)
         const char* rname_s = nullptr;
         size_t      rname_l = 0;
         long long   pos     = 0;
-        if (!parse_sam_rname_pos(line, text_len, rname_s, rname_l, pos)) {
+        if (!sam_fields_rname_pos(line, text_len, f, rname_s, rname_l, pos)) {
             // 解析失败，记到 unmapped_or_zero
             unmapped_or_zero++;
             if (printed_err < MAX_PRINT_ERR) {
-                std::fprintf(stderr,
-                             "  [WARN] %s: failed to parse RNAME/POS, line: %.80s\n",
-                             fname.c_str(), line);
+                report_printf(report,
+                              "  [WARN] %s: failed to parse RNAME/POS, line: %.*s\n",
+                              fname.c_str(), (int)(text_len < 80 ? text_len : 80), line);
                 printed_err++;
             }
             continue;
         }
 
-        std::string rname(rname_s, rname_l);
-
-        if (rname == "*" || pos <= 0) {
+        if ((rname_l == 1 && rname_s[0] == '*') || pos <= 0) {
             unmapped_or_zero++;
             continue;
         }
 
         checked_records++;
 
-        if (rname != chrName) {
+        if (rname_l != chrName.size() || std::memcmp(rname_s, chrName.data(), rname_l) != 0) {
             bad_chr++;
             if (printed_err < MAX_PRINT_ERR) {
-                std::fprintf(stderr,
-                             "  [ERR-CHR] %s: RNAME=%s POS=%lld (expect chr=%s [%lld,%lld])\n",
-                             fname.c_str(), rname.c_str(), pos,
-                             chrName.c_str(), region_start, region_end);
+                report_printf(report,
+                              "  [ERR-CHR] %s: RNAME=%.*s POS=%lld (expect chr=%s [%lld,%lld])\n",
+                              fname.c_str(), (int)rname_l, rname_s, pos,
+                              chrName.c_str(), region_start, region_end);
                 printed_err++;
             }
             continue;
@@ -245,17 +268,20 @@ static bool check_one_sam(const std::string& path, const std::string& fname)
         if (pos < region_start || pos > region_end) {
             bad_range++;
             if (printed_err < MAX_PRINT_ERR) {
-                std::fprintf(stderr,
-                             "  [ERR-RANGE] %s: RNAME=%s POS=%lld not in [%lld,%lld]\n",
-                             fname.c_str(), rname.c_str(), pos,
-                             region_start, region_end);
+                report_printf(report,
+                              "  [ERR-RANGE] %s: RNAME=%.*s POS=%lld not in [%lld,%lld]\n",
+                              fname.c_str(), (int)rname_l, rname_s, pos,
+                              region_start, region_end);
                 printed_err++;
             }
         }
     }
 
-    if (line) std::free(line);
-    std::fclose(fp);
+    unmap_sam_file(data, file_size);
+
+    stats.bytes   = (long long)file_size;
+    stats.records = total_records;
+    stats.mapped  = checked_records;
 
     // 如果没有 chr/范围错误，就认为该文件通过，啥也不打印
     if (bad_chr == 0 && bad_range == 0) {
@@ -263,45 +289,542 @@ static bool check_one_sam(const std::string& path, const std::string& fname)
     }
 
     // 有问题的文件，打印一份总览
-    std::fprintf(stderr,
-                 "[FAIL] %s (chr=%s [%lld,%lld]):\n"
-                 "  total_records     = %lld\n"
-                 "  checked_records   = %lld (mapped, parsed OK)\n"
-                 "  bad_chr           = %lld\n"
-                 "  bad_range         = %lld\n"
-                 "  unmapped_or_zero  = %lld\n",
-                 fname.c_str(),
-                 chrName.c_str(), region_start, region_end,
-                 total_records,
-                 checked_records,
-                 bad_chr,
-                 bad_range,
-                 unmapped_or_zero);
+    report_printf(report,
+                  "[FAIL] %s (chr=%s [%lld,%lld]):\n"
+                  "  total_records     = %lld\n"
+                  "  checked_records   = %lld (mapped, parsed OK)\n"
+                  "  bad_chr           = %lld\n"
+                  "  bad_range         = %lld\n"
+                  "  unmapped_or_zero  = %lld\n",
+                  fname.c_str(),
+                  chrName.c_str(), region_start, region_end,
+                  total_records,
+                  checked_records,
+                  bad_chr,
+                  bad_range,
+                  unmapped_or_zero);
 
     return false;
 }
 
+// 一个待检查的文件及其结果
+struct CheckJob {
+    std::string  path;
+    std::string  fname;
+    std::string  report;
+    bool         ok;
+    SamFileStats stats;
+};
+
+// 线程池：各线程从共享下标里领任务（文件大小不一，动态领取负载更均衡）
+static void run_parallel(size_t n_jobs, int n_threads, const std::function<void(size_t)>& fn)
+{
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (;;) {
+            size_t k = next.fetch_add(1);
+            if (k >= n_jobs) break;
+            fn(k);
+        }
+    };
+
+    if ((size_t)n_threads > n_jobs) n_threads = (int)n_jobs;
+    std::vector<std::thread> threads;
+    for (int t = 1; t < n_threads; ++t) threads.push_back(std::thread(worker));
+    worker();
+    for (size_t t = 0; t < threads.size(); ++t) threads[t].join();
+}
+
+static void check_all_sams(std::vector<CheckJob>& jobs, int n_threads)
+{
+    run_parallel(jobs.size(), n_threads, [&](size_t k) {
+        jobs[k].ok = check_one_sam(jobs[k].path, jobs[k].fname, jobs[k].report, jobs[k].stats);
+    });
+}
+
+// ---------------- --validate：校验 sw_sam_process 的输出 ----------------
+//
+// 每个文件算一份 SamDigest（记录数 + 与顺序无关的内容摘要 + 重复标记计数）：
+//   - 摘要是每条记录 64-bit 哈希的和（mod 2^64），与记录顺序无关；
+//     哈希时 FLAG 按数值计入并去掉 0x400，这样排序 / 去重前后的同一条记录哈希相同；
+//   - 输入侧的摘要写成 manifest（region_manifest.txt），之后可以直接拿 manifest 校验，
+//     不必再扫一遍输入。
+// 输出文件 xxx.sorted[.markdup].sam / xxx.markdup.sam 对应输入 xxx.sam，逐个校验：
+//   - 记录数、摘要与输入一致（没有丢记录、改内容）；
+//   - 按 RNAME（字典序）+ POS 非降序（与从核排序的比较函数一致，解析失败的行排在最前）；
+//   - RNAME/POS 落在文件名给出的 region 内（与普通检查模式相同）；
+//   - 重复标记：--sort 的输出与输入相同；markdup 输出只会增加，且 unmapped / secondary /
+//     supplementary 记录上的 0x400 与输入相同（去重跳过这些记录）。
+// unmapped.sam（catch-all）只校验记录数和摘要。
+
+static const int      FLAG_DUP        = 0x400;
+static const int      FLAG_DUP_SKIP   = 0x4 | 0x100 | 0x800;  // unmapped | secondary | supplementary
+static const char*    MANIFEST_NAME   = "region_manifest.txt";
+static const char*    MANIFEST_MAGIC  = "# check_sam manifest v1";
+
+struct SamDigest {
+    long long records;
+    uint64_t  digest;
+    long long dups;           // FLAG 带 0x400 的记录数
+    long long skipped_dups;   // 其中 unmapped / secondary / supplementary 的记录数
+
+    SamDigest() : records(0), digest(0), dups(0), skipped_dups(0) {}
+};
+
+// 8 字节一组的简单乘法哈希，只用于摘要（不需要抗碰撞）
+static inline uint64_t hash_bytes(const char* p, size_t n, uint64_t h)
+{
+    const uint64_t K = 0x9E3779B97F4A7C15ULL;
+    while (n >= 8) {
+        uint64_t w;
+        std::memcpy(&w, p, 8);
+        h = (h ^ w) * K;
+        h = (h << 31) | (h >> 33);
+        p += 8;
+        n -= 8;
+    }
+    uint64_t w = 0;
+    std::memcpy(&w, p, n);
+    h = (h ^ w ^ ((uint64_t)n << 56)) * K;
+    return h;
+}
+
+static inline uint64_t mix64(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// 一条记录（不含换行）的哈希，FLAG 去掉 0x400 后按数值计入；返回 FLAG 原值（没有 FLAG 列时为 0）
+static uint64_t record_hash(const char* line, size_t len, const SamFields& f, int& flag)
+{
+    flag = 0;
+    if (f.n_tabs < 1) return mix64(hash_bytes(line, len, 0));
+
+    const char* end = line + len;
+    const char* t1  = line + f.tab[0];
+    const char* fs  = t1 + 1;
+    const char* fe  = (f.n_tabs >= 2) ? line + f.tab[1] : end;
+    for (const char* q = fs; q < fe && *q >= '0' && *q <= '9'; ++q) flag = flag * 10 + (*q - '0');
+
+    uint64_t h = hash_bytes(line, (size_t)(t1 - line), 0);
+    h = (h ^ (uint64_t)(flag & ~FLAG_DUP)) * 0x9E3779B97F4A7C15ULL;
+    return mix64(hash_bytes(fe, (size_t)(end - fe), h));
+}
+
+// 输出文件名 -> 对应的输入文件名（去掉 sw_sam_process 加的后缀，见 src/main.c 的
+// generate_output_filename）；unmapped.sam 原样输出，名字不变
+static std::string output_to_input_name(const std::string& fname)
+{
+    static const char* suffixes[] = {
+        ".sorted.markdup.sam", ".sorted.sam", ".markdup.sam", ".processed.sam"
+    };
+    for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); ++i) {
+        size_t n = std::strlen(suffixes[i]);
+        if (fname.size() > n && fname.compare(fname.size() - n, n, suffixes[i]) == 0)
+            return fname.substr(0, fname.size() - n) + ".sam";
+    }
+    return fname;
+}
+
+// 扫描一个文件：算 SamDigest；is_output 时再检查排序和 region 范围。
+// 返回 false 表示文件读不了或排序 / 范围有问题（信息写进 report）。
+static bool validate_scan(const std::string& path, const std::string& fname,
+                          bool is_output, SamDigest& d, std::string& report)
+{
+    const char* data      = nullptr;
+    size_t      file_size = 0;
+    if (!map_sam_file(path, data, file_size, report)) {
+        return false;
+    }
+
+    bool check_order = is_output && fname != SAM_CATCH_ALL_NAME;
+    std::string chrName;
+    long long   region_start = 0, region_end = 0;
+    bool check_range = check_order &&
+                       parse_filename_region(output_to_input_name(fname), chrName, region_start, region_end);
+
+    const int MAX_PRINT_ERR = 10;
+    int       printed_err   = 0;
+    long long bad_order     = 0;
+    long long bad_range     = 0;
+
+    // 上一条记录的排序键
+    bool        prev_valid  = false;
+    const char* prev_rname  = nullptr;
+    size_t      prev_rlen   = 0;
+    long long   prev_pos    = 0;
+
+    size_t off = 0;
+    while (off < file_size) {
+        const char* line = data + off;
+        SamFields   f;                  // 行尾和前 4 列的 tab 一次扫出来
+        sam_fields_scan(line, file_size - off, 4, f);
+        size_t text_len  = f.len;
+        off += f.next;
+
+        while (text_len > 0 && line[text_len-1] == '\r') --text_len;
+        if (text_len == 0 || line[0] == '@') continue;
+
+        int flag = 0;
+        d.records++;
+        d.digest += record_hash(line, text_len, f, flag);
+        if (flag & FLAG_DUP) {
+            d.dups++;
+            if (flag & FLAG_DUP_SKIP) d.skipped_dups++;
+        }
+        if (!check_order) continue;
+
+        const char* rname_s = nullptr;
+        size_t      rname_l = 0;
+        long long   pos     = 0;
+        bool valid = sam_fields_rname_pos(line, text_len, f, rname_s, rname_l, pos);
+
+        // 从核排序：解析失败的行在最前，其余按 RNAME 字典序、POS 升序
+        bool in_order = true;
+        if (!valid) {
+            in_order = !prev_valid;
+        } else if (prev_valid) {
+            size_t n = prev_rlen < rname_l ? prev_rlen : rname_l;
+            int c = n ? std::memcmp(prev_rname, rname_s, n) : 0;
+            if (c == 0) c = (prev_rlen < rname_l) ? -1 : (prev_rlen > rname_l ? 1 : 0);
+            in_order = c < 0 || (c == 0 && prev_pos <= pos);
+        }
+        if (!in_order) {
+            bad_order++;
+            if (printed_err < MAX_PRINT_ERR) {
+                report_printf(report, "  [ERR-ORDER] %s: record %lld (%.*s:%lld) after %.*s:%lld\n",
+                              fname.c_str(), d.records,
+                              (int)rname_l, rname_s ? rname_s : "", pos,
+                              (int)prev_rlen, prev_rname ? prev_rname : "", prev_pos);
+                printed_err++;
+            }
+        }
+        if (valid) {
+            prev_valid = true;
+            prev_rname = rname_s;
+            prev_rlen  = rname_l;
+            prev_pos   = pos;
+        }
+
+        if (check_range && valid && !(rname_l == 1 && rname_s[0] == '*') && pos > 0) {
+            bool same_chr = rname_l == chrName.size() &&
+                            std::memcmp(rname_s, chrName.data(), rname_l) == 0;
+            if (!same_chr || pos < region_start || pos > region_end) {
+                bad_range++;
+                if (printed_err < MAX_PRINT_ERR) {
+                    report_printf(report, "  [ERR-RANGE] %s: RNAME=%.*s POS=%lld not in %s:[%lld,%lld]\n",
+                                  fname.c_str(), (int)rname_l, rname_s, pos,
+                                  chrName.c_str(), region_start, region_end);
+                    printed_err++;
+                }
+            }
+        }
+    }
+
+    unmap_sam_file(data, file_size);
+
+    if (bad_order == 0 && bad_range == 0) return true;
+    report_printf(report, "[FAIL] %s: records=%lld bad_order=%lld bad_range=%lld\n",
+                  fname.c_str(), d.records, bad_order, bad_range);
+    return false;
+}
+
+// 列出目录中名字含 ".sam" 的普通文件（按文件名排序，保证输出顺序确定）
+static bool list_sam_files(const std::string& dir_path, std::vector<CheckJob>& jobs)
+{
+    DIR* dp = opendir(dir_path.c_str());
+    if (!dp) {
+        std::fprintf(stderr, "Failed to open directory %s (%s)\n",
+                     dir_path.c_str(), std::strerror(errno));
+        return false;
+    }
+    std::vector<std::string> names;
+    struct dirent* ent;
+    while ((ent = readdir(dp)) != nullptr) {
+        std::string fname(ent->d_name);
+        if (fname.find(".sam") == std::string::npos) continue;
+
+        std::string full_path = dir_path;
+        if (!full_path.empty() && full_path.back() != '/') full_path.push_back('/');
+        full_path += fname;
+        struct stat st;
+        if (stat(full_path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) continue;
+        names.push_back(fname);
+    }
+    closedir(dp);
+
+    std::sort(names.begin(), names.end());
+    for (size_t i = 0; i < names.size(); ++i) {
+        CheckJob job;
+        job.path  = dir_path;
+        if (!job.path.empty() && job.path.back() != '/') job.path.push_back('/');
+        job.path += names[i];
+        job.fname = names[i];
+        job.ok    = true;
+        jobs.push_back(job);
+    }
+    return true;
+}
+
+static bool write_manifest(const std::string& path, const std::vector<std::string>& names,
+                           const std::vector<SamDigest>& digests)
+{
+    FILE* fp = std::fopen(path.c_str(), "wb");
+    if (!fp) {
+        std::fprintf(stderr, "Failed to write manifest %s (%s)\n", path.c_str(), std::strerror(errno));
+        return false;
+    }
+    std::fprintf(fp, "%s\n", MANIFEST_MAGIC);
+    for (size_t i = 0; i < names.size(); ++i) {
+        std::fprintf(fp, "%s\t%lld\t%016llx\t%lld\t%lld\n",
+                     names[i].c_str(), digests[i].records,
+                     (unsigned long long)digests[i].digest,
+                     digests[i].dups, digests[i].skipped_dups);
+    }
+    bool ok = std::fclose(fp) == 0;
+    if (ok) std::fprintf(stderr, "Manifest written: %s (files=%zu)\n", path.c_str(), names.size());
+    return ok;
+}
+
+static bool read_manifest(const std::string& path, std::vector<std::string>& names,
+                          std::vector<SamDigest>& digests)
+{
+    FILE* fp = std::fopen(path.c_str(), "rb");
+    if (!fp) {
+        std::fprintf(stderr, "Failed to open manifest %s (%s)\n", path.c_str(), std::strerror(errno));
+        return false;
+    }
+    char line[4096];
+    bool ok = std::fgets(line, sizeof(line), fp) &&
+              std::strncmp(line, MANIFEST_MAGIC, std::strlen(MANIFEST_MAGIC)) == 0;
+    while (ok && std::fgets(line, sizeof(line), fp)) {
+        char name[4096];
+        unsigned long long digest = 0;
+        SamDigest d;
+        if (std::sscanf(line, "%4095[^\t]\t%lld\t%llx\t%lld\t%lld",
+                        name, &d.records, &digest, &d.dups, &d.skipped_dups) != 5) {
+            ok = false;
+            break;
+        }
+        d.digest = digest;
+        names.push_back(name);
+        digests.push_back(d);
+    }
+    std::fclose(fp);
+    if (!ok) std::fprintf(stderr, "Malformed manifest: %s\n", path.c_str());
+    return ok;
+}
+
+static double now_ms()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (double)tv.tv_sec * 1000.0 + (double)tv.tv_usec / 1000.0;
+}
+
+// in_src 为目录时先扫描输入并写 manifest，为文件时直接读 manifest。
+// 返回进程退出码：全部通过为 0，否则为 1（可以直接用来卡生产流程）。
+static int validate_outputs(const std::string& in_src, const std::string& out_dir, int n_threads)
+{
+    double t0 = now_ms();
+    double in_bytes = 0.0, out_bytes = 0.0;
+
+    // 1. 输入侧 manifest
+    std::vector<std::string> in_names;
+    std::vector<SamDigest>   in_digests;
+    struct stat st;
+    if (stat(in_src.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+        std::vector<CheckJob> in_jobs;
+        if (!list_sam_files(in_src, in_jobs)) return 1;
+        in_digests.resize(in_jobs.size());
+        run_parallel(in_jobs.size(), n_threads, [&](size_t k) {
+            in_jobs[k].ok = validate_scan(in_jobs[k].path, in_jobs[k].fname, false,
+                                          in_digests[k], in_jobs[k].report);
+        });
+        for (size_t k = 0; k < in_jobs.size(); ++k) {
+            if (!in_jobs[k].ok) {
+                std::fputs(in_jobs[k].report.c_str(), stderr);
+                return 1;
+            }
+            in_names.push_back(in_jobs[k].fname);
+            if (stat(in_jobs[k].path.c_str(), &st) == 0) in_bytes += (double)st.st_size;
+        }
+        write_manifest(MANIFEST_NAME, in_names, in_digests);
+    } else if (!read_manifest(in_src, in_names, in_digests)) {
+        return 1;
+    }
+
+    // 2. 并发扫描全部输出
+    std::vector<CheckJob> jobs;
+    if (!list_sam_files(out_dir, jobs)) return 1;
+    std::vector<SamDigest> out_digests(jobs.size());
+    run_parallel(jobs.size(), n_threads, [&](size_t k) {
+        jobs[k].ok = validate_scan(jobs[k].path, jobs[k].fname, true, out_digests[k], jobs[k].report);
+    });
+
+    // 3. 与 manifest 逐个比对（按输出文件名顺序报告）
+    std::unordered_map<std::string, size_t> in_index;
+    for (size_t i = 0; i < in_names.size(); ++i) in_index[in_names[i]] = i;
+    std::vector<int> matched(in_names.size(), 0);
+
+    int       fail_count = 0;
+    long long total_in = 0, total_out = 0, total_dups = 0, in_dups = 0;
+    for (size_t k = 0; k < jobs.size(); ++k) {
+        CheckJob&        job = jobs[k];
+        const SamDigest& od  = out_digests[k];
+        std::string in_name = output_to_input_name(job.fname);
+        auto it = in_index.find(in_name);
+        if (it == in_index.end()) {
+            report_printf(job.report, "[FAIL] %s: no input %s in manifest\n", job.fname.c_str(), in_name.c_str());
+            job.ok = false;
+        } else {
+            const SamDigest& id = in_digests[it->second];
+            matched[it->second]++;
+            bool markdup = job.fname.find(".markdup.") != std::string::npos;
+            if (od.records != id.records || od.digest != id.digest) {
+                report_printf(job.report, "[FAIL] %s: records=%lld digest=%016llx, input %s records=%lld digest=%016llx\n",
+                              job.fname.c_str(), od.records, (unsigned long long)od.digest,
+                              in_name.c_str(), id.records, (unsigned long long)id.digest);
+                job.ok = false;
+            }
+            bool dup_ok = markdup ? (od.dups >= id.dups && od.skipped_dups == id.skipped_dups)
+                                  : (od.dups == id.dups);
+            if (!dup_ok) {
+                report_printf(job.report, "[FAIL] %s: duplicate flags inconsistent (dups=%lld skipped_dups=%lld, input dups=%lld skipped_dups=%lld)\n",
+                              job.fname.c_str(), od.dups, od.skipped_dups, id.dups, id.skipped_dups);
+                job.ok = false;
+            }
+            total_in  += id.records;
+            in_dups   += id.dups;
+        }
+        total_out  += od.records;
+        total_dups += od.dups;
+        if (stat(job.path.c_str(), &st) == 0) out_bytes += (double)st.st_size;
+
+        if (!job.report.empty()) std::fputs(job.report.c_str(), stderr);
+        if (!job.ok) fail_count++;
+    }
+    int missing = 0;
+    for (size_t i = 0; i < in_names.size(); ++i) {
+        if (matched[i] == 1) continue;
+        std::fprintf(stderr, "[FAIL] %s: %s\n", in_names[i].c_str(),
+                     matched[i] == 0 ? "no output file" : "more than one output file");
+        missing++;
+    }
+
+    double secs = (now_ms() - t0) / 1000.0;
+    std::fprintf(stderr,
+                 "Validated %zu output files in %s against %zu inputs\n"
+                 "  records in/out   = %lld / %lld\n"
+                 "  duplicates       = %lld (%.3f%%, %lld already flagged in input)\n"
+                 "  failed files     = %d, unmatched inputs = %d\n"
+                 "  scanned %.2f MB in %.3f s (%.1f MB/s)\n",
+                 jobs.size(), out_dir.c_str(), in_names.size(),
+                 total_in, total_out,
+                 total_dups, total_out ? 100.0 * (double)total_dups / (double)total_out : 0.0, in_dups,
+                 fail_count, missing,
+                 (in_bytes + out_bytes) / 1048576.0, secs,
+                 secs > 0 ? (in_bytes + out_bytes) / 1048576.0 / secs : 0.0);
+
+    return (fail_count == 0 && missing == 0) ? 0 : 1;
+}
+
 // 用于 region_auto.txt 的结构体
 struct RegionInfo {
     std::string chr;
     long long   start;
     long long   end;
+    size_t      job;     // 统计信息取自 jobs[job]
 };
 
+// contig 名的自然序："chr2" < "chr10"（数字段按数值比较），header 里没有 @SQ 时使用
+static bool contig_natural_less(const std::string& a, const std::string& b)
+{
+    size_t i = 0, j = 0;
+    while (i < a.size() && j < b.size()) {
+        bool da = a[i] >= '0' && a[i] <= '9';
+        bool db = b[j] >= '0' && b[j] <= '9';
+        if (da && db) {
+            size_t ie = i, je = j;
+            while (ie < a.size() && a[ie] >= '0' && a[ie] <= '9') ++ie;
+            while (je < b.size() && b[je] >= '0' && b[je] <= '9') ++je;
+            unsigned long long va = std::strtoull(a.substr(i, ie - i).c_str(), nullptr, 10);
+            unsigned long long vb = std::strtoull(b.substr(j, je - j).c_str(), nullptr, 10);
+            if (va != vb) return va < vb;
+            i = ie;
+            j = je;
+            continue;
+        }
+        if (a[i] != b[j]) return (unsigned char)a[i] < (unsigned char)b[j];
+        ++i;
+        ++j;
+    }
+    return (a.size() - i) < (b.size() - j);
+}
+
+// region 按 contig 顺序（第一个带 @SQ 的文件的 header 顺序，不在其中的按自然序排在后面）再按 start 排序
+static void sort_regions_by_contig(std::vector<RegionInfo>& regions, const std::vector<CheckJob>& jobs)
+{
+    std::unordered_map<std::string, int> rank;
+    for (size_t k = 0; k < jobs.size() && rank.empty(); ++k) {
+        const std::vector<std::string>& c = jobs[k].stats.contigs;
+        for (size_t i = 0; i < c.size(); ++i) rank.insert(std::make_pair(c[i], (int)i));
+    }
+    std::sort(regions.begin(), regions.end(), [&](const RegionInfo& x, const RegionInfo& y) {
+        if (x.chr != y.chr) {
+            auto ix = rank.find(x.chr), iy = rank.find(y.chr);
+            int rx = (ix == rank.end()) ? INT_MAX : ix->second;
+            int ry = (iy == rank.end()) ? INT_MAX : iy->second;
+            if (rx != ry) return rx < ry;
+            return contig_natural_less(x.chr, y.chr);
+        }
+        if (x.start != y.start) return x.start < y.start;
+        return x.end < y.end;
+    });
+}
+
 // ---------------- main ----------------
 
 int main(int argc, char** argv)
 {
-    if (argc < 2) {
+    int n_threads = (int)std::thread::hardware_concurrency();
+    if (n_threads <= 0) n_threads = 1;
+    bool validate = false;
+    int  argi = 1;
+    for (; argi < argc; ++argi) {
+        if (std::strcmp(argv[argi], "--threads") == 0 && argi + 1 < argc) {
+            n_threads = std::atoi(argv[++argi]);
+            if (n_threads <= 0) {
+                std::fprintf(stderr, "Invalid --threads value: %s\n", argv[argi]);
+                return 1;
+            }
+        } else if (std::strcmp(argv[argi], "--validate") == 0) {
+            validate = true;
+        } else {
+            break;
+        }
+    }
+    if (argc - argi < (validate ? 2 : 1)) {
         std::fprintf(stderr,
-                     "Usage: %s <sam_dir>\n"
+                     "Usage: %s [--threads N] <sam_dir>\n"
+                     "       %s [--threads N] --validate <in_dir|region_manifest.txt> <out_dir>\n"
                      "Example:\n"
-                     "  %s out_regions\n",
-                     argv[0], argv[0]);
+                     "  %s out_regions\n"
+                     "  %s --validate out_regions_sam out_regions_processed\n",
+                     argv[0], argv[0], argv[0], argv[0]);
         return 1;
     }
 
-    std::string dir_path = argv[1];
+    if (validate) {
+        return validate_outputs(argv[argi], argv[argi + 1], n_threads);
+    }
+
+    std::string dir_path = argv[argi];
 
     DIR* dp = opendir(dir_path.c_str());
     if (!dp) {
@@ -318,6 +841,7 @@ int main(int argc, char** argv)
     // 为生成 region_auto.txt 准备：去重用 set，顺序用 vector
     std::vector<RegionInfo> region_list;
     std::unordered_set<std::string> region_set; // key = "chr\tstart\tend"
+    std::vector<CheckJob>           jobs;
 
     while ((ent = readdir(dp)) != nullptr) {
         const char* name = ent->d_name;
@@ -359,20 +883,33 @@ int main(int argc, char** argv)
                 info.chr   = chrName;
                 info.start = rstart;
                 info.end   = rend;
+                info.job   = jobs.size();
                 region_list.push_back(info);
             }
         }
 
         file_count++;
-        bool ok = check_one_sam(full_path, fname);
-        if (!ok) {
-            fail_count++;
-        }
+        CheckJob job;
+        job.path  = full_path;
+        job.fname = fname;
+        job.ok    = true;
+        jobs.push_back(job);
     }
 
     closedir(dp);
 
-    // 生成 region_auto.txt
+    check_all_sams(jobs, n_threads);
+    for (size_t k = 0; k < jobs.size(); ++k) {
+        if (!jobs[k].report.empty())
+            std::fputs(jobs[k].report.c_str(), stderr);
+        if (!jobs[k].ok) {
+            fail_count++;
+        }
+    }
+
+    // 生成 region_auto.txt：按 contig 顺序，每行 chr start end bytes records mapped，
+    // split_from_region / sw_sam_process 直接用这些大小，不必再 stat 或扫描文件
+    sort_regions_by_contig(region_list, jobs);
     std::string region_auto_path = "region_auto.txt";
 
     FILE* fp_out = std::fopen(region_auto_path.c_str(), "wb");
@@ -382,10 +919,12 @@ int main(int argc, char** argv)
                      region_auto_path.c_str(), std::strerror(errno));
         // 不影响检查结果，只是提示一下
     } else {
+        std::fprintf(fp_out, "#chr\tstart\tend\tbytes\trecords\tmapped\n");
         for (size_t i = 0; i < region_list.size(); ++i) {
-            const RegionInfo& r = region_list[i];
-            std::fprintf(fp_out, "%s\t%lld\t%lld\n",
-                         r.chr.c_str(), r.start, r.end);
+            const RegionInfo&   r  = region_list[i];
+            const SamFileStats& st = jobs[r.job].stats;
+            std::fprintf(fp_out, "%s\t%lld\t%lld\t%lld\t%lld\t%lld\n",
+                         r.chr.c_str(), r.start, r.end, st.bytes, st.records, st.mapped);
         }
         std::fclose(fp_out);
         std::fprintf(stderr,
@@ -0,0 +1,170 @@
+// page_pool.h
+// static_region / split_from_region 共用的 region buffer 页池和 --buffer-mem 解析，header-only。
+//
+// 所有 region 共享一个固定大小的页池（--buffer-mem），region 按需取页；页池用完时把持有页
+// 最多的 region 整个 flush 掉（pwritev 一次写出它的全部页），热点 region 因此能攒下大块数据，
+// 冷 region 不再各自占着一块固定的 buffer。
+// region 类型只要求有 pages（持有的页号，按写入顺序）和 used（已缓存的字节数）两个成员；
+// 选中的 region 怎么 flush（打开描述符、顺带写 sidecar 等）由调用方传入。
+
+#ifndef PAGE_POOL_H
+#define PAGE_POOL_H
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+#include <vector>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+
+static const size_t BUF_PAGE_SIZE      = 64u * 1024u;           // buffer 页大小
+static const size_t DEFAULT_BUFFER_MEM = 1024u * 1024u * 1024u; // --buffer-mem 默认 1GB
+
+struct PagePool {
+    size_t           page_size;
+    size_t           n_pages;
+    char            *mem;          // n_pages * page_size，不做零初始化，用到才真正占物理页
+    std::vector<int> free_pages;
+
+    // 按持有页数的惰性最大堆：(页数, region)；region 每取一页压入一次，
+    // 弹出时页数与 region 当前不符的条目即已过期
+    std::vector<std::pair<size_t, int> > heap;
+
+    long long n_flushes;           // 统计：flush 次数
+    long long n_pressure;          // 统计：因页池用完而触发的 flush
+
+    PagePool() : page_size(BUF_PAGE_SIZE), n_pages(0), mem(nullptr),
+                 n_flushes(0), n_pressure(0) {}
+    ~PagePool() { delete[] mem; }
+
+    char *page(int k) { return mem + (size_t)k * page_size; }
+};
+
+static void page_pool_init(PagePool &pp, size_t budget)
+{
+    pp.n_pages = std::max<size_t>(2, budget / pp.page_size);
+    pp.mem     = new char[pp.n_pages * pp.page_size];
+    pp.free_pages.resize(pp.n_pages);
+    for (size_t k = 0; k < pp.n_pages; ++k) pp.free_pages[k] = (int)(pp.n_pages - 1 - k);
+}
+
+static bool pwritev_all(int fd, std::vector<struct iovec> &iov, unsigned long long off)
+{
+    size_t k = 0;
+    while (k < iov.size()) {
+        int cnt = (int)std::min<size_t>(iov.size() - k, IOV_MAX);
+        ssize_t n = pwritev(fd, &iov[k], cnt, (off_t)off);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        off += (unsigned long long)n;
+        size_t left = (size_t)n;
+        while (k < iov.size() && left >= iov[k].iov_len) left -= iov[k++].iov_len;
+        if (left > 0) {
+            iov[k].iov_base = (char *)iov[k].iov_base + left;
+            iov[k].iov_len -= left;
+        }
+    }
+    return true;
+}
+
+// 把 region 缓存的数据写到 fd 的 *off 处，*off 前移，页还回页池。写失败返回 false（errno 保留）
+template <class R>
+static bool page_pool_write(PagePool &pp, R &r, int fd, unsigned long long *off)
+{
+    if (r.used == 0) return true;
+
+    std::vector<struct iovec> iov(r.pages.size());
+    size_t left = r.used;
+    for (size_t k = 0; k < r.pages.size(); ++k) {
+        iov[k].iov_base = pp.page(r.pages[k]);
+        iov[k].iov_len  = std::min(left, pp.page_size);
+        left -= iov[k].iov_len;
+    }
+    if (!pwritev_all(fd, iov, *off)) return false;
+    *off += r.used;
+    pp.n_flushes++;
+
+    for (size_t k = 0; k < r.pages.size(); ++k) pp.free_pages.push_back(r.pages[k]);
+    r.pages.clear();
+    r.used = 0;
+    return true;
+}
+
+// 给 region i 取一页；页池用完时先 flush(j) 写出持有页最多的 region j
+template <class R, class Flush>
+static bool page_pool_take(PagePool &pp, std::vector<R> &regions, int i, Flush flush)
+{
+    typedef std::pair<size_t, int> HeapEntry;
+    while (pp.free_pages.empty()) {
+        HeapEntry top = pp.heap.front();
+        std::pop_heap(pp.heap.begin(), pp.heap.end());
+        pp.heap.pop_back();
+        if (regions[top.second].pages.size() != top.first) continue;   // 过期条目
+        pp.n_pressure++;
+        if (!flush(top.second)) return false;
+    }
+
+    R &r = regions[i];
+    r.pages.push_back(pp.free_pages.back());
+    pp.free_pages.pop_back();
+    pp.heap.push_back(HeapEntry(r.pages.size(), i));
+    std::push_heap(pp.heap.begin(), pp.heap.end());
+
+    // 过期条目太多时压缩一次
+    if (pp.heap.size() > 4 * pp.n_pages + 1024) {
+        size_t n = 0;
+        for (size_t k = 0; k < pp.heap.size(); ++k) {
+            if (regions[pp.heap[k].second].pages.size() == pp.heap[k].first) pp.heap[n++] = pp.heap[k];
+        }
+        pp.heap.resize(n);
+        std::make_heap(pp.heap.begin(), pp.heap.end());
+    }
+    return true;
+}
+
+// 把 len 字节追加到 region i 的 buffer 页（按需取页，可跨页）
+template <class R, class Flush>
+static bool page_pool_append(PagePool &pp, std::vector<R> &regions, int i,
+                             const char *data, size_t len, Flush flush)
+{
+    R &r = regions[i];
+    while (len > 0) {
+        size_t in_page = r.used % pp.page_size;
+        if (in_page == 0 && r.used == r.pages.size() * pp.page_size) {
+            if (!page_pool_take(pp, regions, i, flush)) return false;
+            in_page = 0;   // region 可能刚被 flush，r.used 已归零
+        }
+        size_t n = std::min(len, pp.page_size - in_page);
+        std::memcpy(pp.page(r.pages.back()) + in_page, data, n);
+        r.used += n;
+        data   += n;
+        len    -= n;
+    }
+    return true;
+}
+
+// 解析 "512M" / "2G" / "65536" 这样的大小
+static bool parse_mem_size(const char *s, size_t &out)
+{
+    char *endp = nullptr;
+    double v = std::strtod(s, &endp);
+    if (endp == s || v <= 0) return false;
+    double mul = 1;
+    switch (*endp) {
+    case 'k': case 'K': mul = 1024.0;                   endp++; break;
+    case 'm': case 'M': mul = 1024.0 * 1024;            endp++; break;
+    case 'g': case 'G': mul = 1024.0 * 1024 * 1024;     endp++; break;
+    default: break;
+    }
+    if (*endp != '\0') return false;
+    out = (size_t)(v * mul);
+    return true;
+}
+
+#endif // PAGE_POOL_H
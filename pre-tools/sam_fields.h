@@ -0,0 +1,201 @@
+// sam_fields.h
+// pre-tools 共用的 SAM 行切分 / 字段解析，header-only。
+//
+// sam_fields_scan 一次扫描同时找出一行的前 N 个 '\t' 和行尾 '\n'：
+//   - 编译时开了 AVX2（-mavx2 / -march=native）每次比较 32 字节；
+//   - 否则在 x86-64 上用 SSE2（基线指令集）每次比较 16 字节；
+//   - 其它平台（如 Sunway）逐字节扫描。
+// 找够 N 个 tab 之后，行内剩下的部分直接交给 memchr 找 '\n'（glibc 的 memchr 本身是向量化的）。
+// POS 等整数字段用 SWAR 一次解析 8 位数字（小端平台），其它平台逐字节。
+//
+// 各工具按自己原来的语义使用：
+//   sam_parse_rname_pos 与原来各工具里的 parse_sam_rname_pos 完全一致；
+//   static_region / sidecar 的宽松整数解析（等价于 atoi）由调用方按 tab 位置自己取。
+
+#ifndef SAM_FIELDS_H
+#define SAM_FIELDS_H
+
+#include <cstddef>
+#include <cstring>
+#include <stdint.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SAM_FIELDS_SIMD 32
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define SAM_FIELDS_SIMD 16
+#endif
+
+static const int SAM_FIELDS_MAX_TABS = 16;
+
+// 一行的切分结果，偏移都相对行首
+struct SamFields {
+    size_t   len;        // 行长度，不含 '\n'（行尾的 '\r' 仍计在内，由调用方决定是否去掉）
+    size_t   next;       // 下一行的起点：有 '\n' 时为 len + 1，否则为 len
+    bool     newline;    // 是否以 '\n' 结束（false 表示到了缓冲区末尾，行可能不完整）
+    int      n_tabs;     // 找到的 tab 数（不超过要求的个数）
+    uint32_t tab[SAM_FIELDS_MAX_TABS];
+};
+
+static inline int sam_fields_ctz(uint32_t m)
+{
+    return __builtin_ctz(m);
+}
+
+// 从 line 开始（后面还有 avail 字节）切出一行：找最多 want_tabs 个 tab（<= SAM_FIELDS_MAX_TABS）
+// 和行尾 '\n'
+static inline void sam_fields_scan(const char* line, size_t avail, int want_tabs, SamFields& f)
+{
+    f.n_tabs = 0;
+    size_t i = 0;
+
+#ifdef SAM_FIELDS_SIMD
+#if SAM_FIELDS_SIMD == 32
+    const __m256i vt = _mm256_set1_epi8('\t');
+    const __m256i vn = _mm256_set1_epi8('\n');
+#else
+    const __m128i vt = _mm_set1_epi8('\t');
+    const __m128i vn = _mm_set1_epi8('\n');
+#endif
+    while (f.n_tabs < want_tabs && i + SAM_FIELDS_SIMD <= avail) {
+#if SAM_FIELDS_SIMD == 32
+        __m256i  x  = _mm256_loadu_si256((const __m256i*)(line + i));
+        uint32_t mt = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, vt));
+        uint32_t mn = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, vn));
+#else
+        __m128i  x  = _mm_loadu_si128((const __m128i*)(line + i));
+        uint32_t mt = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(x, vt));
+        uint32_t mn = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(x, vn));
+#endif
+        if (mn) mt &= (mn & (0u - mn)) - 1;     // 只要 '\n' 之前的 tab
+        while (mt && f.n_tabs < want_tabs) {
+            f.tab[f.n_tabs++] = (uint32_t)(i + sam_fields_ctz(mt));
+            mt &= mt - 1;
+        }
+        if (mn) {
+            f.len     = i + sam_fields_ctz(mn);
+            f.next    = f.len + 1;
+            f.newline = true;
+            return;
+        }
+        i += SAM_FIELDS_SIMD;
+    }
+#endif
+
+    // 不足一个向量宽度的尾部（或无 SIMD 时的全部）：逐字节找 tab
+    for (; f.n_tabs < want_tabs && i < avail; ++i) {
+        char c = line[i];
+        if (c == '\n') {
+            f.len     = i;
+            f.next    = i + 1;
+            f.newline = true;
+            return;
+        }
+        if (c == '\t') f.tab[f.n_tabs++] = (uint32_t)i;
+    }
+
+    // tab 已经找够，剩下的交给 memchr
+    const char* nl = (i < avail) ? (const char*)std::memchr(line + i, '\n', avail - i) : nullptr;
+    if (nl) {
+        f.len     = (size_t)(nl - line);
+        f.next    = f.len + 1;
+        f.newline = true;
+    } else {
+        f.len     = avail;
+        f.next    = avail;
+        f.newline = false;
+    }
+}
+
+// 第 k 列（0-based）的范围 [b, e)，text_len 为去掉行尾 '\r' 后的长度；
+// 第 k 列之前的 tab 没找到时返回 false
+static inline bool sam_fields_get(const SamFields& f, size_t text_len, int k, size_t& b, size_t& e)
+{
+    if (k > f.n_tabs) return false;
+    b = (k == 0) ? 0 : (size_t)f.tab[k - 1] + 1;
+    e = (k < f.n_tabs) ? (size_t)f.tab[k] : text_len;
+    if (b > text_len) return false;
+    if (e > text_len) e = text_len;
+    return true;
+}
+
+// ---------------- 整数解析 ----------------
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define SAM_FIELDS_SWAR 1
+#endif
+
+// 严格解析：可选 '-' 加至少一位数字，整段都必须是数字
+static inline bool sam_parse_int(const char* s, size_t n, long long& out)
+{
+    bool neg = false;
+    if (n > 0 && s[0] == '-') {
+        neg = true;
+        ++s;
+        --n;
+    }
+    if (n == 0) return false;
+
+    long long v = 0;
+#ifdef SAM_FIELDS_SWAR
+    static const long long pow10[9] = {
+        1LL, 10LL, 100LL, 1000LL, 10000LL, 100000LL, 1000000LL, 10000000LL, 100000000LL
+    };
+    while (n > 0) {
+        size_t   k = n < 8 ? n : 8;
+        uint64_t w = 0x3030303030303030ULL;          // 高位补 '0'
+        std::memcpy((char*)&w + (8 - k), s, k);
+        // 8 个字节都在 '0'..'9'：高半字节为 3，且加 6 后不进位到 4
+        if ((w & 0xF0F0F0F0F0F0F0F0ULL) != 0x3030303030303030ULL ||
+            ((w + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) != 0x3030303030303030ULL)
+            return false;
+        w -= 0x3030303030303030ULL;
+        w = (w * 10 + (w >> 8)) & 0x00FF00FF00FF00FFULL;
+        w = (w * 100 + (w >> 16)) & 0x0000FFFF0000FFFFULL;
+        w = (w * 10000 + (w >> 32)) & 0x00000000FFFFFFFFULL;
+        v = v * pow10[k] + (long long)w;
+        s += k;
+        n -= k;
+    }
+#else
+    for (size_t i = 0; i < n; ++i) {
+        char c = s[i];
+        if (c < '0' || c > '9') return false;
+        v = v * 10 + (c - '0');
+    }
+#endif
+    out = neg ? -v : v;
+    return true;
+}
+
+// ---------------- RNAME + POS ----------------
+
+// 已经切好的一行里取 RNAME / POS（需要 f 至少找了 4 个 tab）。
+// 语义与原来各工具的 parse_sam_rname_pos 相同：header 行、不足 4 列或 POS 非法时返回 false。
+static inline bool sam_fields_rname_pos(const char* line, size_t text_len, const SamFields& f,
+                                        const char*& rname_start, size_t& rname_len,
+                                        long long& pos_out)
+{
+    if (text_len == 0 || line[0] == '@') return false;
+    size_t rb, re, pb, pe;
+    if (f.n_tabs < 3 || !sam_fields_get(f, text_len, 2, rb, re) || !sam_fields_get(f, text_len, 3, pb, pe))
+        return false;
+    if (!sam_parse_int(line + pb, pe - pb, pos_out)) return false;
+    rname_start = line + rb;
+    rname_len   = re - rb;
+    return true;
+}
+
+// 只有一行（text_len 不含 '\n'）时的便捷接口
+static inline bool sam_parse_rname_pos(const char* line, size_t text_len,
+                                       const char*& rname_start, size_t& rname_len,
+                                       long long& pos_out)
+{
+    if (text_len == 0 || line[0] == '@') return false;
+    SamFields f;
+    sam_fields_scan(line, text_len, 4, f);
+    return sam_fields_rname_pos(line, text_len, f, rname_start, rname_len, pos_out);
+}
+
+#endif // SAM_FIELDS_H
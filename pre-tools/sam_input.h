@@ -0,0 +1,413 @@
+// sam_input.h
+// pre-tools 共用的 SAM 输入层，header-only（需要链接 -lz -pthread）。
+//
+// sam_input_open(path) 返回一个可以直接 fread / getline 的 FILE*：
+//   - 普通文本：直接 fopen；
+//   - BGZF（samtools / bgzip 输出）：后台线程顺序读入一批压缩块，
+//     多个线程并行 inflate，解压好的大块放进有界队列；
+//   - 普通 gzip（含多 member 拼接）：无法并行解压，后台线程单独 inflate，
+//     与调用方的解析流水并行。
+// 这样各工具原来的解析代码不用改，也不再需要在前面接单线程的 zcat 管道。
+//
+// path 为 "-" 时读 stdin；stdin / FIFO 等不能 seek 的输入，格式探测读掉的开头字节
+// 由后台源先吐出来（普通文本也走后台源，按块读入有界队列）。队列满时后台线程
+// 不再读管道，上游（比如比对程序）的 write 就会阻塞，形成反压。
+
+#ifndef SAM_INPUT_H
+#define SAM_INPUT_H
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <errno.h>
+#include <zlib.h>
+
+static const size_t SAM_INPUT_GZ_CHUNK    = 4 * 1024 * 1024;  // gzip 每次产出的解压块大小
+static const size_t SAM_INPUT_BGZF_BATCH  = 512;              // BGZF 每批块数（约 32MB 解压后）
+static const size_t SAM_INPUT_QUEUE_DEPTH = 4;                // 解压结果队列深度
+
+enum SamInputFormat {
+    SAM_INPUT_PLAIN = 0,
+    SAM_INPUT_GZIP  = 1,
+    SAM_INPUT_BGZF  = 2
+};
+
+// 根据前 18 字节判断格式：gzip 魔数 1f 8b 08；FEXTRA 中有 "BC" 子字段即为 BGZF
+static inline SamInputFormat sam_input_detect(const unsigned char* h, size_t n)
+{
+    if (n < 2 || h[0] != 0x1f || h[1] != 0x8b) return SAM_INPUT_PLAIN;
+    if (n >= 18 && h[2] == 8 && (h[3] & 4) &&
+        h[10] == 6 && h[11] == 0 && h[12] == 'B' && h[13] == 'C' &&
+        h[14] == 2 && h[15] == 0) {
+        return SAM_INPUT_BGZF;
+    }
+    return SAM_INPUT_GZIP;
+}
+
+static inline SamInputFormat sam_input_format(const std::string& path)
+{
+    unsigned char h[18];
+    FILE* fp = std::fopen(path.c_str(), "rb");
+    if (!fp) return SAM_INPUT_PLAIN;
+    size_t n = std::fread(h, 1, sizeof(h), fp);
+    std::fclose(fp);
+    return sam_input_detect(h, n);
+}
+
+// ---------------- 后台解压源 ----------------
+struct SamInputSource {
+    FILE*          fp;
+    SamInputFormat fmt;
+    unsigned       n_threads;
+
+    std::mutex              mu;
+    std::condition_variable cv_put;
+    std::condition_variable cv_get;
+    std::deque< std::vector<char> > queue;
+    bool done;
+    bool failed;
+    bool stop;
+    std::thread producer;
+
+    std::vector<char> cur;        // 调用方正在消费的块
+    size_t            cur_pos;
+
+    // 不能 seek 的输入：格式探测时已经读掉的开头字节，生产者先读这部分
+    std::vector<unsigned char> prefix;
+    size_t                     prefix_pos;
+
+    SamInputSource() : fp(NULL), fmt(SAM_INPUT_PLAIN), n_threads(1),
+                       done(false), failed(false), stop(false), cur_pos(0),
+                       prefix_pos(0) {}
+
+    // 生产者放入一块；调用方已关闭时返回 false
+    bool push(std::vector<char>& chunk)
+    {
+        std::unique_lock<std::mutex> lk(mu);
+        cv_put.wait(lk, [this] { return stop || queue.size() < SAM_INPUT_QUEUE_DEPTH; });
+        if (stop) return false;
+        queue.push_back(std::vector<char>());
+        queue.back().swap(chunk);
+        cv_get.notify_one();
+        return true;
+    }
+
+    void finish(bool ok)
+    {
+        std::lock_guard<std::mutex> lk(mu);
+        done = true;
+        if (!ok) failed = true;
+        cv_get.notify_all();
+    }
+
+    // 取下一块；没有更多数据时返回 false
+    bool pop()
+    {
+        std::unique_lock<std::mutex> lk(mu);
+        cv_get.wait(lk, [this] { return !queue.empty() || done; });
+        if (queue.empty()) return false;
+        cur.swap(queue.front());
+        queue.pop_front();
+        cur_pos = 0;
+        cv_put.notify_one();
+        return true;
+    }
+};
+
+// 生产者读原始（压缩）字节：先读 prefix，再读 fp
+static inline size_t sam_input_raw_read(SamInputSource* src, void* buf, size_t n)
+{
+    size_t got = 0;
+    if (src->prefix_pos < src->prefix.size()) {
+        got = std::min(n, src->prefix.size() - src->prefix_pos);
+        std::memcpy(buf, &src->prefix[src->prefix_pos], got);
+        src->prefix_pos += got;
+    }
+    if (got < n) got += std::fread((char*)buf + got, 1, n - got, src->fp);
+    return got;
+}
+
+// 不能 seek 的普通文本（管道 / FIFO）：按块读入队列
+static inline void sam_input_plain_producer(SamInputSource* src)
+{
+    bool ok = true;
+    while (true) {
+        std::vector<char> out(SAM_INPUT_GZ_CHUNK);
+        size_t n = sam_input_raw_read(src, out.data(), out.size());
+        if (n == 0) {
+            if (std::ferror(src->fp)) ok = false;
+            break;
+        }
+        out.resize(n);
+        if (!src->push(out)) break;
+    }
+    src->finish(ok);
+}
+
+// 普通 gzip：单线程 inflate，支持多个 member 拼接
+static inline void sam_input_gzip_producer(SamInputSource* src)
+{
+    z_stream zs;
+    std::memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK) {
+        src->finish(false);
+        return;
+    }
+
+    std::vector<unsigned char> in(1 << 20);
+    std::vector<char> out(SAM_INPUT_GZ_CHUNK);
+    size_t out_len = 0;
+    bool   ok      = true;
+    bool   eof     = false;
+    bool   mid     = false;    // 当前 member 还没结束
+    bool   pad     = false;    // 已进入末尾的 0 填充
+
+    while (ok) {
+        if (zs.avail_in == 0 && !eof) {
+            size_t n = sam_input_raw_read(src, in.data(), in.size());
+            if (n == 0) {
+                if (std::ferror(src->fp)) ok = false;
+                eof = true;
+            }
+            zs.next_in  = in.data();
+            zs.avail_in = (uInt)n;
+        }
+        if (zs.avail_in == 0 && eof) {
+            if (mid) ok = false;               // 截断
+            break;
+        }
+        if (!mid && (pad || zs.next_in[0] == 0)) {
+            // 最后一个 member 之后的全 0 填充（zcat 也接受）：跳过；填充之后再出现非 0 字节算损坏
+            while (zs.avail_in > 0 && zs.next_in[0] == 0) {
+                ++zs.next_in;
+                --zs.avail_in;
+            }
+            if (zs.avail_in > 0) {
+                ok = false;
+                break;
+            }
+            pad = true;
+            continue;
+        }
+
+        zs.next_out  = (Bytef*)&out[out_len];
+        zs.avail_out = (uInt)(out.size() - out_len);
+        int ret = inflate(&zs, Z_NO_FLUSH);
+        out_len = out.size() - zs.avail_out;
+
+        if (ret == Z_STREAM_END) {
+            inflateReset(&zs);                 // 下一个 member
+            mid = false;
+        } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            ok = false;
+        } else {
+            mid = true;
+        }
+
+        if (out_len == out.size()) {
+            if (!src->push(out)) break;
+            out.assign(SAM_INPUT_GZ_CHUNK, 0);
+            out_len = 0;
+        }
+    }
+    if (ok && out_len > 0) {
+        out.resize(out_len);
+        src->push(out);
+    }
+    inflateEnd(&zs);
+    src->finish(ok);
+}
+
+// 解一个 BGZF 块（完整的 gzip member）到 out，校验长度和 CRC
+static inline bool sam_input_inflate_bgzf_block(const unsigned char* blk, size_t blk_len,
+                                                char* out, size_t out_len)
+{
+    if (blk_len < 26) return false;
+    size_t xlen   = (size_t)blk[10] | ((size_t)blk[11] << 8);
+    size_t cdata  = 12 + xlen;
+    if (cdata + 8 > blk_len) return false;
+
+    z_stream zs;
+    std::memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, -MAX_WBITS) != Z_OK) return false;
+    // ISIZE 为 0 的块（如 EOF 标记块）out 可能是空指针，zlib 不接受 next_out 为 NULL
+    unsigned char empty[1];
+    zs.next_in   = (Bytef*)(blk + cdata);
+    zs.avail_in  = (uInt)(blk_len - cdata - 8);
+    zs.next_out  = out_len ? (Bytef*)out : empty;
+    zs.avail_out = out_len ? (uInt)out_len : (uInt)sizeof(empty);
+    int ret = inflate(&zs, Z_FINISH);
+    bool ok = (ret == Z_STREAM_END) && zs.total_out == out_len;
+    inflateEnd(&zs);
+    if (!ok) return false;
+
+    const unsigned char* t = blk + blk_len - 8;
+    uint32_t crc = (uint32_t)t[0] | ((uint32_t)t[1] << 8) |
+                   ((uint32_t)t[2] << 16) | ((uint32_t)t[3] << 24);
+    return crc32(0L, (const Bytef*)out, (uInt)out_len) == crc;
+}
+
+// BGZF：顺序读一批块，按 ISIZE 算出各块输出位置后多线程并行 inflate
+static inline void sam_input_bgzf_producer(SamInputSource* src)
+{
+    std::vector<unsigned char> comp;          // 本批压缩数据
+    std::vector<size_t>        blk_off, blk_len, out_off;
+    bool ok = true;
+
+    while (ok) {
+        comp.clear();
+        blk_off.clear();
+        blk_len.clear();
+        out_off.assign(1, 0);
+
+        for (size_t b = 0; b < SAM_INPUT_BGZF_BATCH; ++b) {
+            unsigned char hdr[18];
+            size_t n = sam_input_raw_read(src, hdr, sizeof(hdr));
+            if (n == 0) break;
+            if (n != sizeof(hdr) || sam_input_detect(hdr, n) != SAM_INPUT_BGZF) {
+                ok = false;
+                break;
+            }
+            size_t bsize = ((size_t)hdr[16] | ((size_t)hdr[17] << 8)) + 1;
+            if (bsize < 26) {
+                ok = false;
+                break;
+            }
+            size_t off = comp.size();
+            comp.resize(off + bsize);
+            std::memcpy(&comp[off], hdr, sizeof(hdr));
+            if (sam_input_raw_read(src, &comp[off + sizeof(hdr)], bsize - sizeof(hdr)) !=
+                bsize - sizeof(hdr)) {
+                ok = false;
+                break;
+            }
+            const unsigned char* t = &comp[off + bsize - 4];
+            size_t isize = (size_t)t[0] | ((size_t)t[1] << 8) |
+                           ((size_t)t[2] << 16) | ((size_t)t[3] << 24);
+            blk_off.push_back(off);
+            blk_len.push_back(bsize);
+            out_off.push_back(out_off.back() + isize);
+        }
+        if (!ok || blk_off.empty()) break;
+
+        std::vector<char> out(out_off.back());
+        size_t   n_blk = blk_off.size();
+        unsigned n_th  = (unsigned)std::min<size_t>(src->n_threads, n_blk);
+        std::vector<char> blk_ok(n_blk, 0);
+
+        auto work = [&](unsigned t) {
+            for (size_t b = t; b < n_blk; b += n_th) {
+                blk_ok[b] = sam_input_inflate_bgzf_block(&comp[blk_off[b]], blk_len[b],
+                                                         out.data() + out_off[b],
+                                                         out_off[b + 1] - out_off[b]) ? 1 : 0;
+            }
+        };
+        std::vector<std::thread> workers;
+        for (unsigned t = 1; t < n_th; ++t) workers.push_back(std::thread(work, t));
+        work(0);
+        for (size_t t = 0; t < workers.size(); ++t) workers[t].join();
+
+        for (size_t b = 0; b < n_blk; ++b) {
+            if (!blk_ok[b]) ok = false;
+        }
+        if (!ok) break;
+        if (!out.empty() && !src->push(out)) break;
+    }
+    src->finish(ok);
+}
+
+// ---------------- fopencookie 包装 ----------------
+static inline ssize_t sam_input_cookie_read(void* cookie, char* buf, size_t size)
+{
+    SamInputSource* src = (SamInputSource*)cookie;
+    size_t got = 0;
+    while (got < size) {
+        if (src->cur_pos >= src->cur.size()) {
+            if (!src->pop()) break;
+            continue;
+        }
+        size_t n = std::min(size - got, src->cur.size() - src->cur_pos);
+        std::memcpy(buf + got, &src->cur[src->cur_pos], n);
+        src->cur_pos += n;
+        got += n;
+    }
+    if (got == 0) {
+        std::lock_guard<std::mutex> lk(src->mu);
+        if (src->failed) {
+            errno = EIO;
+            return -1;
+        }
+    }
+    return (ssize_t)got;
+}
+
+static inline int sam_input_cookie_close(void* cookie)
+{
+    SamInputSource* src = (SamInputSource*)cookie;
+    {
+        std::lock_guard<std::mutex> lk(src->mu);
+        src->stop = true;
+        src->cv_put.notify_all();
+    }
+    if (src->producer.joinable()) src->producer.join();
+    bool failed = src->failed;
+    std::fclose(src->fp);
+    delete src;
+    return failed ? -1 : 0;
+}
+
+// 打开 SAM 输入（自动识别 plain / gzip / BGZF）。失败返回 NULL 并设置 errno。
+// path 为 "-" 时读 stdin。n_threads 为 0 时使用全部硬件线程（只对 BGZF 有意义）。
+static inline FILE* sam_input_open(const std::string& path, unsigned n_threads = 0)
+{
+    bool  is_stdin = (path == "-");
+    FILE* fp = is_stdin ? stdin : std::fopen(path.c_str(), "rb");
+    if (!fp) return NULL;
+
+    unsigned char h[18];
+    size_t n = std::fread(h, 1, sizeof(h), fp);
+    SamInputFormat fmt = sam_input_detect(h, n);
+    bool seekable = (std::fseek(fp, 0, SEEK_SET) == 0);
+    if (!seekable && errno != ESPIPE) {
+        std::fclose(fp);
+        return NULL;
+    }
+    if (fmt == SAM_INPUT_PLAIN && seekable) return fp;
+
+    SamInputSource* src = new SamInputSource();
+    src->fp  = fp;
+    src->fmt = fmt;
+    if (!seekable) src->prefix.assign(h, h + n);
+    src->n_threads = n_threads ? n_threads : std::max(1u, std::thread::hardware_concurrency());
+    src->producer = std::thread(fmt == SAM_INPUT_BGZF ? sam_input_bgzf_producer :
+                                fmt == SAM_INPUT_GZIP ? sam_input_gzip_producer
+                                                      : sam_input_plain_producer, src);
+
+    cookie_io_functions_t io;
+    std::memset(&io, 0, sizeof(io));
+    io.read  = sam_input_cookie_read;
+    io.close = sam_input_cookie_close;
+    FILE* wrapped = fopencookie(src, "r", io);
+    if (!wrapped) {
+        sam_input_cookie_close(src);
+        return NULL;
+    }
+    if (fmt == SAM_INPUT_PLAIN) {
+        std::fprintf(stderr, "Input %s: streaming (not seekable)\n", path.c_str());
+    } else {
+        std::fprintf(stderr, "Input %s: %s%s, decompressing with %u thread(s)\n",
+                     path.c_str(), fmt == SAM_INPUT_BGZF ? "BGZF" : "gzip",
+                     seekable ? "" : " (streaming)",
+                     fmt == SAM_INPUT_BGZF ? src->n_threads : 1u);
+    }
+    return wrapped;
+}
+
+#endif // SAM_INPUT_H
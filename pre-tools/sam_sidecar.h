@@ -0,0 +1,323 @@
+// sam_sidecar.h
+// splitter（auto_region / split_from_region）共用的 sidecar 索引辅助函数，header-only。
+//
+// 每个 region 文件 xxx.sam 对应一个 xxx.sidx：
+//   SamIdxHeader + n_records 个 SamIdxEntry（定义见 ../slave/sam_process_para.h）+ RNAME 名表，
+//   记录顺序与 region SAM 中的行顺序一致。
+// splitter 切分时本来就要解析 RNAME/POS，这里顺带把去重需要的字段也解析出来，
+// sw_sam_process 的从核拿到 sidecar 后就不必再逐字节解析文本。
+
+#ifndef SAM_SIDECAR_H
+#define SAM_SIDECAR_H
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <errno.h>
+#include "../slave/sam_process_para.h"
+#include "sam_fields.h"
+
+// contig 名 -> id，id 按 header 中 @SQ 的顺序编号
+struct SidecarContigs {
+    std::unordered_map<std::string,int> ids;
+    int n_sq;
+
+    SidecarContigs() : n_sq(0) {}
+};
+
+// 从 header 行中收集 @SQ SN:xxx
+static inline void sidecar_contigs_from_header(const std::vector<std::string>& header_lines,
+                                               SidecarContigs& sc)
+{
+    sc.ids.clear();
+    sc.n_sq = 0;
+    for (size_t i = 0; i < header_lines.size(); ++i) {
+        const std::string& h = header_lines[i];
+        if (h.compare(0, 3, "@SQ") != 0) continue;
+
+        size_t p = h.find("\tSN:");
+        if (p == std::string::npos) continue;
+        p += 4;
+        size_t q = p;
+        while (q < h.size() && h[q] != '\t' && h[q] != '\n' && h[q] != '\r') ++q;
+
+        std::string name(h, p, q - p);
+        if (sc.ids.find(name) == sc.ids.end()) {
+            sc.ids[name] = sc.n_sq++;
+        }
+    }
+}
+
+// 查 contig id：'*' 为 -1；header 里没有的名字用名字的哈希映射到 n_sq 之后，
+// 保证跨文件一致且查表过程只读（可以在多线程里直接调用）。
+static inline int sidecar_contig_id(const SidecarContigs& sc, const char* name, size_t len)
+{
+    if (len == 1 && name[0] == '*') return -1;
+
+    auto it = sc.ids.find(std::string(name, len));
+    if (it != sc.ids.end()) return it->second;
+
+    uint32_t h = 2166136261u;   // FNV-1a
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (uint8_t)name[i];
+        h *= 16777619u;
+    }
+    return sc.n_sq + (int)(h & 0x3fffffffu);
+}
+
+static inline int32_t sidecar_atoi(const char* s, size_t len)
+{
+    int32_t v   = 0;
+    size_t  i   = 0;
+    int     neg = 0;
+    if (len > 0 && s[0] == '-') {
+        neg = 1;
+        i = 1;
+    }
+    for (; i < len; ++i) {
+        char c = s[i];
+        if (c < '0' || c > '9') break;
+        v = v * 10 + (c - '0');
+    }
+    return neg ? -v : v;
+}
+
+// 解析一行为 SamIdxEntry：text_len 不含行尾的 '\r' / '\n'，raw_len 是这一行在文件中的
+// 全部字节数（含行尾）。
+// 不足 11 列时 valid=0（从核去重时会跳过它，与文本路径一致）。
+// 排序键按从核文本路径的规则取：至少 4 列，POS 是整数；POS 是最后一列时行尾的 '\r'
+// 也算在 POS 里（于是解析失败）。sort_rname 先置 0 占位，由 sidecar_assign_name 填名表下标。
+static inline void sidecar_parse_line(const char* line,
+                                      size_t text_len,
+                                      size_t raw_len,
+                                      uint64_t line_offset,
+                                      const SidecarContigs& sc,
+                                      SamIdxEntry& e)
+{
+    std::memset(&e, 0, sizeof(e));
+    e.line_offset = line_offset;
+    e.line_len    = (uint32_t)text_len;
+    e.line_tail   = (uint32_t)(raw_len - text_len);
+    e.tid         = -1;
+    e.mate_tid    = -1;
+    e.sort_rname  = -1;
+    e.sort_pos    = -1;
+
+    // 前 11 列的 tab 一次扫出来（第 11 个 tab 是 QUAL 的结尾）
+    SamFields f;
+    sam_fields_scan(line, text_len, 11, f);
+    int n_fields = (f.n_tabs < 10) ? f.n_tabs + 1 : 11;
+
+    for (int field = 0; field < n_fields; ++field) {
+        size_t start = 0, end = 0;
+        sam_fields_get(f, text_len, field, start, end);
+
+        const char* fs = line + start;
+        size_t      fl = end - start;
+        switch (field) {
+            case 1: // FLAG
+                e.flag_off = (uint32_t)start;
+                e.flag_len = (uint16_t)fl;
+                e.flag     = (uint16_t)sidecar_atoi(fs, fl);
+                break;
+            case 2: // RNAME
+                e.tid = sidecar_contig_id(sc, fs, fl);
+                break;
+            case 3: // POS
+                e.pos = sidecar_atoi(fs, fl);
+                break;
+            case 6: // RNEXT
+                if (fl == 1 && fs[0] == '=') e.mate_tid = e.tid;
+                else                         e.mate_tid = sidecar_contig_id(sc, fs, fl);
+                break;
+            case 7: // PNEXT
+                e.mate_pos = sidecar_atoi(fs, fl);
+                break;
+            case 10: // QUAL
+                e.qual_off = (uint32_t)start;
+                e.qual_len = (uint32_t)fl;
+                break;
+        }
+    }
+    e.valid = (n_fields >= 11) ? 1u : 0u;
+
+    if (f.n_tabs >= 3) {
+        size_t sort_len = raw_len;
+        if (sort_len > 0 && line[sort_len - 1] == '\n') --sort_len;
+        size_t pb = (size_t)f.tab[2] + 1;
+        size_t pe = (f.n_tabs > 3) ? (size_t)f.tab[3] : sort_len;
+        long long v = 0;
+        if (sam_parse_int(line + pb, pe - pb, v)) {
+            e.sort_rname = 0;
+            e.sort_pos   = v;
+        }
+    }
+}
+
+// 一个 region 文件的 RNAME 名表：名字 -> 下标，下标按首次出现顺序编号
+struct SidecarNames {
+    std::vector<std::string>            names;
+    std::unordered_map<std::string,int> ids;
+    int                                 last;   // 上一次查到的下标（同一 region 里 RNAME 基本不变）
+
+    SidecarNames() : last(-1) {}
+
+    int id(const char* name, size_t len)
+    {
+        if (last >= 0 && names[last].size() == len &&
+            std::memcmp(names[last].data(), name, len) == 0)
+            return last;
+        std::string key(name, len);
+        auto it = ids.find(key);
+        if (it != ids.end()) return last = it->second;
+        ids[key] = (int)names.size();
+        names.push_back(key);
+        return last = (int)names.size() - 1;
+    }
+
+    size_t bytes() const
+    {
+        size_t n = 0;
+        for (size_t i = 0; i < names.size(); ++i) n += sizeof(uint32_t) + names[i].size();
+        return n;
+    }
+};
+
+// 把 sidecar_parse_line 得到的排序键里的 RNAME 登记到名表（line 为这一行的行首）
+static inline void sidecar_assign_name(SidecarNames& names, const char* line, SamIdxEntry& e)
+{
+    if (e.sort_rname < 0) return;
+    size_t rb = (size_t)e.flag_off + e.flag_len + 1;
+    const char* tab = (const char*)std::memchr(line + rb, '\t', e.line_len - rb);
+    size_t re = tab ? (size_t)(tab - line) : e.line_len;
+    e.sort_rname = names.id(line + rb, re - rb);
+}
+
+// xxx.sam -> xxx.sidx
+static inline std::string sidecar_path_for(const std::string& sam_path)
+{
+    size_t n = sam_path.size();
+    if (n >= 4 && sam_path.compare(n - 4, 4, ".sam") == 0)
+        return sam_path.substr(0, n - 4) + SAM_IDX_SUFFIX;
+    return sam_path + SAM_IDX_SUFFIX;
+}
+
+static inline SamIdxHeader sidecar_make_header(uint64_t n_records, uint64_t data_offset,
+                                               const SidecarNames* names = nullptr)
+{
+    SamIdxHeader h;
+    std::memset(&h, 0, sizeof(h));
+    h.magic       = SAM_IDX_MAGIC;
+    h.version     = SAM_IDX_VERSION;
+    h.n_records   = n_records;
+    h.data_offset = data_offset;
+    if (names) {
+        h.n_rnames     = (uint32_t)names->names.size();
+        h.rnames_bytes = (uint32_t)names->bytes();
+    }
+    return h;
+}
+
+static inline bool sidecar_write_header(FILE* fp, uint64_t n_records, uint64_t data_offset,
+                                        const SidecarNames& names)
+{
+    SamIdxHeader h = sidecar_make_header(n_records, data_offset, &names);
+    return std::fwrite(&h, sizeof(h), 1, fp) == 1;
+}
+
+// 名表：每个名字一个 uint32 长度加名字字节
+static inline bool sidecar_write_names(FILE* fp, const SidecarNames& names)
+{
+    for (size_t i = 0; i < names.names.size(); ++i) {
+        const std::string& s = names.names[i];
+        uint32_t len = (uint32_t)s.size();
+        if (std::fwrite(&len, sizeof(len), 1, fp) != 1) return false;
+        if (len && std::fwrite(s.data(), 1, len, fp) != len) return false;
+    }
+    return true;
+}
+
+// 一次性写出完整 sidecar
+static inline bool sidecar_write(const std::string& path,
+                                 uint64_t data_offset,
+                                 const SamIdxEntry* entries,
+                                 size_t n,
+                                 const SidecarNames& names)
+{
+    FILE* fp = std::fopen(path.c_str(), "wb");
+    if (!fp) {
+        std::fprintf(stderr, "Failed to open sidecar: %s (%s)\n",
+                     path.c_str(), std::strerror(errno));
+        return false;
+    }
+    bool ok = sidecar_write_header(fp, n, data_offset, names) &&
+              (n == 0 || std::fwrite(entries, sizeof(SamIdxEntry), n, fp) == n) &&
+              sidecar_write_names(fp, names);
+    if (std::fclose(fp) != 0) ok = false;
+    if (!ok) std::fprintf(stderr, "Failed to write sidecar: %s\n", path.c_str());
+    return ok;
+}
+
+// 增量写：先写一个占位 header（sidecar_make_header(0, 0)），之后追加 entries；
+// 全部写完后用 sidecar_finalize 在 entries 之后追加名表，并回填真实的 header。
+static inline bool sidecar_finalize(const std::string& path,
+                                    uint64_t n_records,
+                                    uint64_t data_offset,
+                                    const SidecarNames& names)
+{
+    FILE* fp = std::fopen(path.c_str(), "r+b");
+    if (!fp) {
+        std::fprintf(stderr, "Failed to reopen sidecar: %s (%s)\n",
+                     path.c_str(), std::strerror(errno));
+        return false;
+    }
+    bool ok = std::fseek(fp, (long)(sizeof(SamIdxHeader) + n_records * sizeof(SamIdxEntry)),
+                         SEEK_SET) == 0 &&
+              sidecar_write_names(fp, names) &&
+              std::fseek(fp, 0, SEEK_SET) == 0 &&
+              sidecar_write_header(fp, n_records, data_offset, names);
+    if (std::fclose(fp) != 0) ok = false;
+    return ok;
+}
+
+// 读整个 sidecar（合并片段时用）：entries 追加到 entries 末尾，排序键的名表下标
+// 换成 names 里的下标。失败时打印原因并返回 false
+static inline bool sidecar_read(const std::string& path, SamIdxHeader& h,
+                                std::vector<SamIdxEntry>& entries, SidecarNames& names)
+{
+    FILE* fp = std::fopen(path.c_str(), "rb");
+    if (!fp || std::fread(&h, sizeof(h), 1, fp) != 1 ||
+        h.magic != SAM_IDX_MAGIC || h.version != SAM_IDX_VERSION) {
+        std::fprintf(stderr, "Bad sidecar: %s\n", path.c_str());
+        if (fp) std::fclose(fp);
+        return false;
+    }
+    size_t base = entries.size();
+    entries.resize(base + (size_t)h.n_records);
+    bool ok = h.n_records == 0 ||
+              std::fread(&entries[base], sizeof(SamIdxEntry), (size_t)h.n_records, fp) == h.n_records;
+
+    std::vector<int> ids;
+    std::string      name;
+    for (uint32_t k = 0; ok && k < h.n_rnames; ++k) {
+        uint32_t len = 0;
+        ok = std::fread(&len, sizeof(len), 1, fp) == 1 && len <= h.rnames_bytes;
+        if (!ok) break;
+        name.resize(len);
+        ok = len == 0 || std::fread(&name[0], 1, len, fp) == len;
+        if (ok) ids.push_back(names.id(name.data(), name.size()));
+    }
+    std::fclose(fp);
+    for (size_t e = base; ok && e < entries.size(); ++e) {
+        int32_t r = entries[e].sort_rname;
+        if (r >= (int32_t)ids.size()) ok = false;
+        else if (r >= 0) entries[e].sort_rname = ids[r];
+    }
+    if (!ok) std::fprintf(stderr, "Truncated sidecar: %s\n", path.c_str());
+    return ok;
+}
+
+#endif // SAM_SIDECAR_H
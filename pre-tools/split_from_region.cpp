@@ -1,25 +1,44 @@
 // split_from_region.cpp
 //
 // 用法：
-//   g++ -O3 -std=gnu++11 split_from_region.cpp -o split_from_region
-//   ./split_from_region region.txt all.sam out_regions_sam
+//   g++ -O3 -std=gnu++11 split_from_region.cpp -o split_from_region -lz -pthread
+//   ./split_from_region [--sidecar] [--threads N] [--buffer-mem SIZE] region.txt all.sam [more.sam ...] out_regions_sam
 //
 // 功能：
 //   1. 从 region.txt 读取若干 region：每行格式为
-//        chr  start  end
+//        chr  start  end  [bytes  records  mapped]
 //      例如：
 //        chr1  1  1000000
 //        chr1  1000001  2000000
-//      支持空行和以 '#' 开头的注释行。
-//   2. 要求 region 总数 < 3000，否则退出。
-//   3. 为每个 region 分配一个 2MB 的内存 buffer。
+//      支持空行和以 '#' 开头的注释行。后三列（check_sam / auto_region --plan-only 写出的
+//      实际或预测大小）可选，有时用来预估页池和 sidecar buffer 的大小。
+//   2. region 数不设上限。
+//   3. 所有 region 共享 --buffer-mem 大小的 buffer 页池（64KB 一页，默认共 1GB），按需取页；
+//      页池用完时先 flush 持有页最多的 region。
 //   4. 扫描 all.sam：
 //        - 收集 header 行（以 '@' 开头）；
 //        - 解析每条对齐记录的 RNAME 和 POS；
 //        - 根据 (chr, pos) 找到所属 region，将该行放入对应 buffer；
-//        - buffer 满了则 flush 到文件，然后继续装；
+//        - 页池满了则把最大的 region buffer 一次性 flush 到文件，然后继续装；
+//          输出描述符放在有界 LRU 池里（大小取决于 RLIMIT_NOFILE），
+//          第一次打开时写 header，之后 pwrite 追加，不再每次 flush 都 open/close；
+//        - 读 / 解析 / 写分别在不同线程上流水进行（--threads，见“多线程流水线”），
+//          输出与单线程逐字节相同；
 //      输出文件命名为： out_dir/chr_start_end.sam
 //      每个 region 文件在第一次写入前会先写入完整 SAM header。
+//   5. --sidecar 时为每个 region 额外写 out_dir/chr_start_end.sidx（见 sam_sidecar.h），
+//      sw_sam_process 的从核直接使用其中预解析的字段，不再解析文本。
+//   all.sam 可以是 plain / gzip / BGZF（见 sam_input.h，BGZF 多线程并行解压）。
+//   6. unmapped（RNAME '*' / POS <= 0）以及不在任何 region 内的记录按输入顺序写进
+//      out_dir/unmapped.sam（catch-all，--drop-unmapped 时丢弃）。
+//   7. --shard i/N 只切输入的第 i 段字节范围，写不带 header 的片段；所有分片完成后
+//      --merge-shards N 按分片顺序拼接（见“--shard i/N：按字节范围分片”），可跨节点并行。
+//   8. 可以给多个输入（每个 lane 一个 SAM）：各自并发切分，header 检查兼容后合并，
+//      每个 region 文件只写一次（见“多个输入”）。
+//   all.sam 也可以是 "-"（stdin）或 FIFO，直接接在比对程序后面边比对边切分：
+//     bwa mem ref.fa r1.fq r2.fq | ./split_from_region region.txt - out_regions_sam
+//   header 收齐（读到第一条记录）之后才开始派发；各级队列都有界，
+//   切分跟不上时不再读管道，比对程序的输出自然被阻塞，中间 SAM 不落盘。
 
 #define _GNU_SOURCE
 #include <cstdio>
@@ -38,7 +57,20 @@
 #include <cstring>
 #include <algorithm>
 #include <sys/time.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <unistd.h>
 #include <iostream>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+#include "sam_fields.h"
+#include "sam_sidecar.h"
+#include "sam_input.h"
+#include "page_pool.h"
 
 
 static double now_ms()
@@ -48,8 +80,7 @@ static double now_ms()
     return (double)tv.tv_sec * 1000.0 + (double)tv.tv_usec / 1000.0;
 }
 
-static const size_t REGION_BUF_SIZE = 512u * 1024u;
-static const size_t MAX_REGION_NUM  = 3000;
+static const size_t IDX_RESERVE_MAX    = 64u * 1024u;           // sidecar buffer 最多预留的条目数
 
 // ------------- 简单结构体 -------------
 
@@ -59,12 +90,38 @@ struct Region {
     long long   end;     // inclusive
 
     std::string out_path;
+    bool        catch_all;   // unmapped / 不在任何 region 内的记录（out_dir/unmapped.sam）
+
+    // region.txt 第 4、5 列给出的预计字节数 / 记录数（has_expect=false 表示没有）
+    bool               has_expect;
+    unsigned long long expect_bytes;
+    unsigned long long expect_records;
 
-    std::vector<char> buffer;
-    size_t            used;
+    std::vector<int>  pages;    // 持有的 buffer 页（PagePool 中的页号），按写入顺序
+    size_t            used;     // 已缓存的字节数
     bool              header_written;
 
-    Region() : start(0), end(0), used(0), header_written(false) {}
+    // 输出描述符（由 FdPool 管理，-1 表示当前未打开）和下一次 pwrite 的偏移
+    int                fd;
+    unsigned long long file_off;
+    int                lru_prev;     // FdPool 的 LRU 链表
+    int                lru_next;
+
+    // --sidecar：与 buffer 同步 flush 的预解析字段
+    std::string              idx_path;
+    std::vector<SamIdxEntry> idx_buf;
+    SidecarNames             idx_names;    // 排序键的 RNAME 名表，结束时写在 entries 之后
+    unsigned long long       data_bytes;   // 已分配给该 region 的记录字节数（含未 flush 的）
+    unsigned long long       n_idx;        // 已生成的 sidecar 记录数
+    bool                     idx_started;
+    int                      idx_fd;
+    unsigned long long       idx_off;
+
+    Region() : start(0), end(0), catch_all(false),
+               has_expect(false), expect_bytes(0), expect_records(0),
+               used(0), header_written(false),
+               fd(-1), file_off(0), lru_prev(-1), lru_next(-1),
+               data_bytes(0), n_idx(0), idx_started(false), idx_fd(-1), idx_off(0) {}
 };
 
 void set_nofile_limit(rlim_t target_nofile) {
@@ -189,25 +246,29 @@ static bool load_regions(const std::string &region_file,
             return false;
         }
 
+        // 可选的 bytes / records 列（mapped 列目前不用）
+        if (tokens.size() >= 5) {
+            char *e1 = nullptr, *e2 = nullptr;
+            double b = std::strtod(tokens[3].c_str(), &e1);
+            double n = std::strtod(tokens[4].c_str(), &e2);
+            if (*e1 == '\0' && *e2 == '\0' && b >= 0 && n >= 0) {
+                r.has_expect     = true;
+                r.expect_bytes   = (unsigned long long)b;
+                r.expect_records = (unsigned long long)n;
+            }
+        }
+
         // 构造输出文件名： out_dir/chr_start_end.sam
         char path[4096];
         std::snprintf(path, sizeof(path), "%s/%s_%lld_%lld.sam",
                       out_dir.c_str(), r.chr.c_str(), r.start, r.end);
         r.out_path = path;
+        r.idx_path = sidecar_path_for(r.out_path);
 
-        r.buffer.resize(REGION_BUF_SIZE);
         r.used = 0;
         r.header_written = false;
 
         regions.push_back(r);
-        if (regions.size() >= MAX_REGION_NUM) {
-            std::fprintf(stderr,
-                         "Too many regions (>= %zu). Adjust MAX_REGION_NUM or region.txt\n",
-                         (size_t)MAX_REGION_NUM);
-            std::fclose(fp);
-            if (line) std::free(line);
-            return false;
-        }
     }
 
     std::fclose(fp);
@@ -218,298 +279,1324 @@ static bool load_regions(const std::string &region_file,
     return true;
 }
 
-// ------------- SAM RNAME+POS 解析 -------------
-
-static bool parse_sam_rname_pos(const char* line,
-                                size_t len,       // 不含换行
-                                const char*& rname_start,
-                                size_t& rname_len,
-                                long long& pos_out)
+// 追加 catch-all region：unmapped、POS 非法或不在任何 region 内的记录按输入顺序写到
+// out_dir/unmapped.sam，和普通 region 一样走页池大块写出，不再丢掉
+static void add_catch_all_region(std::vector<Region> &regions, const std::string &out_dir)
 {
-    if (len == 0) return false;
-    if (line[0] == '@') return false; // header
+    Region r;
+    r.chr       = "*";
+    r.catch_all = true;
+    r.out_path  = out_dir + "/" + SAM_CATCH_ALL_NAME;
+    r.idx_path  = sidecar_path_for(r.out_path);
+    regions.push_back(r);
+}
 
-    int    field = 0;
-    size_t i     = 0;
-    size_t start = 0;
-    size_t end   = 0;
+// ------------- record -> region 路由表 -------------
+//
+// region 文件中出现的 contig 名预先 intern 成小整数 id（开放寻址哈希表，哈希值预先算好），
+// 每个 contig 再按固定粒度（2^shift bp）建一张 bin -> region 的查找表：
+//   >= 0         整个 bin 只落在这一个 region 里
+//   ROUTE_NONE   bin 不与任何 region 相交
+//   ROUTE_MIXED  bin 内有 region 边界，退回该 contig 上的二分查找
+// 对每条记录只需要算一次名字哈希、查两次数组，不分配内存。
+
+static const int ROUTE_NONE       = -1;
+static const int ROUTE_MIXED      = -2;
+static const int ROUTE_BIN_SHIFT  = 12;         // 默认 4kbp 一个 bin
+static const long long ROUTE_MAX_BINS = 1LL << 22;   // 单个 contig 的 bin 数上限
+
+struct RouteContig {
+    std::string      name;
+    uint32_t         hash;
+    int              shift;
+    std::vector<int> bins;      // bin -> region 下标 / ROUTE_NONE / ROUTE_MIXED
+    std::vector<int> regs;      // 该 contig 上的 region 下标，按 start 升序
+};
 
-    const char* rname_s = nullptr;
-    size_t      rname_l = 0;
-    const char* pos_s   = nullptr;
-    size_t      pos_l   = 0;
+struct RegionRouter {
+    std::vector<RouteContig> contigs;
+    std::vector<int>         slots;   // 开放寻址表：contig id，-1 为空
+    uint32_t                 mask;
 
-    for (i = 0; i <= len; ++i) {
-        char c = (i == len) ? '\t' : line[i];
+    RegionRouter() : mask(0) {}
+};
 
-        if (c == '\t') {
-            end = i;
-            if (field == 2) {
-                rname_s = line + start;
-                rname_l = end - start;
-            } else if (field == 3) {
-                pos_s = line + start;
-                pos_l = end - start;
-                break;   // 后面字段不关心
-            }
-            field++;
-            start = i + 1;
-        }
+static inline uint32_t route_hash(const char *s, size_t len)
+{
+    uint32_t h = 2166136261u;   // FNV-1a
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (uint8_t)s[i];
+        h *= 16777619u;
     }
+    return h;
+}
 
-    if (!rname_s || !pos_s || pos_l == 0) return false;
-
-    // 解析 POS
-    long long value = 0;
-    int       neg   = 0;
-    size_t    idx   = 0;
-    if (pos_s[0] == '-') {
-        neg = 1;
-        idx++;
-        if (idx >= pos_l) return false;
-    }
-    for (; idx < pos_l; ++idx) {
-        char c = pos_s[idx];
-        if (c < '0' || c > '9') return false;
-        value = value * 10 + (c - '0');
+static inline int route_contig_id(const RegionRouter &rt, const char *name, size_t len)
+{
+    uint32_t h = route_hash(name, len);
+    for (uint32_t k = h & rt.mask; ; k = (k + 1) & rt.mask) {
+        int id = rt.slots[k];
+        if (id < 0) return -1;
+        const RouteContig &c = rt.contigs[id];
+        if (c.hash == h && c.name.size() == len && std::memcmp(c.name.data(), name, len) == 0)
+            return id;
     }
-    if (neg) value = -value;
-
-    rname_start = rname_s;
-    rname_len   = rname_l;
-    pos_out     = value;
-    return true;
 }
 
-// ------------- 用于 region 查找的 per-chr 索引 -------------
-
-// 构造： chr -> 对应 region 下标列表（按 start 升序）
-static void build_chr_region_index(const std::vector<Region> &regions,
-                                   std::unordered_map<std::string, std::vector<int> > &chr2regs)
+static void build_region_router(const std::vector<Region> &regions, RegionRouter &rt)
 {
+    // 1) intern contig 名（按 region 文件中第一次出现的顺序编号）
+    size_t n_slots = 16;
+    while (n_slots < regions.size() * 2) n_slots <<= 1;
+    rt.slots.assign(n_slots, -1);
+    rt.mask = (uint32_t)(n_slots - 1);
+    rt.contigs.clear();
+
     for (size_t i = 0; i < regions.size(); ++i) {
         const Region &r = regions[i];
-        chr2regs[r.chr].push_back((int)i);
+        if (r.catch_all) continue;
+        int id = route_contig_id(rt, r.chr.data(), r.chr.size());
+        if (id < 0) {
+            RouteContig c;
+            c.name  = r.chr;
+            c.hash  = route_hash(r.chr.data(), r.chr.size());
+            c.shift = ROUTE_BIN_SHIFT;
+            id = (int)rt.contigs.size();
+            rt.contigs.push_back(c);
+            uint32_t k = c.hash & rt.mask;
+            while (rt.slots[k] >= 0) k = (k + 1) & rt.mask;
+            rt.slots[k] = id;
+        }
+        rt.contigs[id].regs.push_back((int)i);
     }
 
-    // 每个 chr 对应 region 已在 region.txt 中按顺序给出的话，可以不排序；
-    // 为稳妥起见这里还是按 start 排一下。
-    for (auto &kv : chr2regs) {
-        std::vector<int> &idxs = kv.second;
-        std::sort(idxs.begin(), idxs.end(), [&](int a, int b) {
+    // 2) 每个 contig 的 bin 表
+    for (size_t ci = 0; ci < rt.contigs.size(); ++ci) {
+        RouteContig &c = rt.contigs[ci];
+        std::sort(c.regs.begin(), c.regs.end(), [&](int a, int b) {
             const Region &ra = regions[a];
             const Region &rb = regions[b];
             if (ra.start != rb.start) return ra.start < rb.start;
             return ra.end < rb.end;
         });
+
+        long long max_end = 0;
+        for (size_t k = 0; k < c.regs.size(); ++k)
+            max_end = std::max(max_end, regions[c.regs[k]].end);
+        while ((max_end >> c.shift) + 1 > ROUTE_MAX_BINS) c.shift++;
+
+        size_t n_bins = (size_t)(max_end >> c.shift) + 1;
+        std::vector<unsigned char> hits(n_bins, 0);
+        c.bins.assign(n_bins, ROUTE_NONE);
+        for (size_t k = 0; k < c.regs.size(); ++k) {
+            const Region &r = regions[c.regs[k]];
+            long long b0 = r.start >> c.shift;
+            long long b1 = r.end   >> c.shift;
+            for (long long b = b0; b <= b1; ++b) {
+                long long lo = b << c.shift;
+                long long hi = lo + (1LL << c.shift) - 1;
+                bool covers = (r.start <= lo && r.end >= hi);
+                if (hits[b] == 0 && covers) c.bins[b] = c.regs[k];
+                else                        c.bins[b] = ROUTE_MIXED;
+                if (hits[b] < 2) hits[b]++;
+            }
+        }
+    }
+}
+
+// 在一个 contig 的 region 上二分查找（bin 内有 region 边界时使用）
+static int route_search(const RouteContig &c, long long pos, const std::vector<Region> &regions)
+{
+    int left  = 0;
+    int right = (int)c.regs.size() - 1;
+    while (left <= right) {
+        int mid = (left + right) / 2;
+        const Region &r = regions[c.regs[mid]];
+        if (pos < r.start)    right = mid - 1;
+        else if (pos > r.end) left  = mid + 1;
+        else                  return c.regs[mid];
     }
+    return -1;
 }
 
-// 根据 chr + pos 找到对应 region 的下标（在 regions 向量中的 index）。
+// 根据 RNAME + POS 找到对应 region 的下标（在 regions 向量中的 index）。
 // 返回 -1 表示没找到。
-static int find_region_for_pos(const std::string &chr,
-                               long long pos,
-                               const std::vector<Region> &regions,
-                               const std::unordered_map<std::string, std::vector<int> > &chr2regs)
+static inline int route_record(const RegionRouter &rt, const char *rname, size_t rname_len,
+                               long long pos, const std::vector<Region> &regions)
 {
-    auto it = chr2regs.find(chr);
-    if (it == chr2regs.end()) return -1;
+    int id = route_contig_id(rt, rname, rname_len);
+    if (id < 0) return -1;
+    const RouteContig &c = rt.contigs[id];
+    unsigned long long b = (unsigned long long)pos >> c.shift;
+    if (b >= c.bins.size()) return -1;
+    int v = c.bins[b];
+    if (v != ROUTE_MIXED) return v;
+    return route_search(c, pos, regions);
+}
 
-    const std::vector<int> &idxs = it->second;
-    int left = 0;
-    int right = (int)idxs.size() - 1;
-    int found = -1;
+// ------------- 输出描述符池 -------------
+//
+// 以前每次 flush 都 fopen("ab") / fclose，region 多时共享文件系统上的
+// open/close 元数据操作非常多。这里保持一个有界的 LRU 描述符池：
+// region 文件第一次打开时写 header，之后用 pwrite 按记录的偏移追加；
+// 池满时关闭最久未用的 region（再打开时不截断，继续从 file_off 写）。
 
-    while (left <= right) {
-        int mid = (left + right) / 2;
-        const Region &r = regions[idxs[mid]];
-        if (pos < r.start) {
-            right = mid - 1;
-        } else if (pos > r.end) {
-            left = mid + 1;
-        } else {
-            found = idxs[mid];
-            break;
+static bool pwrite_all(int fd, const char *buf, size_t len, unsigned long long off)
+{
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, (off_t)off);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
         }
+        buf += n;
+        off += (unsigned long long)n;
+        len -= (size_t)n;
     }
-    return found;
+    return true;
 }
 
-// ------------- 把一个 region 的 buffer flush 到文件 -------------
+struct FdPool {
+    size_t    capacity;     // 最多同时打开的 region 数
+    size_t    n_open;
+    int       head;         // 最近使用
+    int       tail;         // 最久未用
+    long long n_opens;      // 统计：open 次数
+
+    FdPool() : capacity(1), n_open(0), head(-1), tail(-1), n_opens(0) {}
+};
 
-static bool flush_region_buffer(Region &r,
-                                const std::vector<std::string> &header_lines)
+static void lru_unlink(FdPool &pool, std::vector<Region> &regions, int i)
 {
-    if (r.used == 0) return true; // 没数据就不用写
+    Region &r = regions[i];
+    if (r.lru_prev >= 0) regions[r.lru_prev].lru_next = r.lru_next;
+    else                 pool.head = r.lru_next;
+    if (r.lru_next >= 0) regions[r.lru_next].lru_prev = r.lru_prev;
+    else                 pool.tail = r.lru_prev;
+    r.lru_prev = r.lru_next = -1;
+}
 
-    FILE *fp = std::fopen(r.out_path.c_str(), r.header_written ? "ab" : "wb");
-    if (!fp) {
+static void lru_push_front(FdPool &pool, std::vector<Region> &regions, int i)
+{
+    Region &r = regions[i];
+    r.lru_prev = -1;
+    r.lru_next = pool.head;
+    if (pool.head >= 0) regions[pool.head].lru_prev = i;
+    pool.head = i;
+    if (pool.tail < 0) pool.tail = i;
+}
+
+static void close_region_fds(FdPool &pool, std::vector<Region> &regions, int i)
+{
+    Region &r = regions[i];
+    if (r.fd < 0) return;
+    close(r.fd);
+    r.fd = -1;
+    if (r.idx_fd >= 0) {
+        close(r.idx_fd);
+        r.idx_fd = -1;
+    }
+    lru_unlink(pool, regions, i);
+    pool.n_open--;
+}
+
+// 确保 region i 的描述符已打开（必要时淘汰最久未用的 region）
+static bool acquire_region_fds(FdPool &pool, std::vector<Region> &regions, int i,
+                               const std::vector<std::string> &header_lines,
+                               bool write_sidecar)
+{
+    Region &r = regions[i];
+    if (r.fd >= 0) {
+        if (pool.head != i) {
+            lru_unlink(pool, regions, i);
+            lru_push_front(pool, regions, i);
+        }
+        return true;
+    }
+
+    while (pool.n_open >= pool.capacity && pool.tail >= 0) {
+        close_region_fds(pool, regions, pool.tail);
+    }
+
+    // 第一次打开：截断并写 header
+    int flags = O_WRONLY | O_CREAT | (r.header_written ? 0 : O_TRUNC);
+    r.fd = open(r.out_path.c_str(), flags, 0644);
+    if (r.fd < 0) {
         std::fprintf(stderr,
                      "Failed to open region file for writing: %s (%s)\n",
                      r.out_path.c_str(), std::strerror(errno));
         return false;
     }
-
-    // 第一次写入时需要 header
+    pool.n_opens++;
     if (!r.header_written) {
+        r.file_off = 0;
         for (const auto &h : header_lines) {
-            std::fwrite(h.data(), 1, h.size(), fp);
+            if (!pwrite_all(r.fd, h.data(), h.size(), r.file_off)) {
+                std::fprintf(stderr, "Failed to write header: %s (%s)\n",
+                             r.out_path.c_str(), std::strerror(errno));
+                close(r.fd);
+                r.fd = -1;
+                return false;
+            }
+            r.file_off += h.size();
         }
         r.header_written = true;
     }
 
-    std::fwrite(r.buffer.data(), 1, r.used, fp);
-    std::fclose(fp);
+    if (write_sidecar) {
+        flags = O_WRONLY | O_CREAT | (r.idx_started ? 0 : O_TRUNC);
+        r.idx_fd = open(r.idx_path.c_str(), flags, 0644);
+        if (r.idx_fd < 0) {
+            std::fprintf(stderr, "Failed to open sidecar: %s (%s)\n",
+                         r.idx_path.c_str(), std::strerror(errno));
+            close(r.fd);
+            r.fd = -1;
+            return false;
+        }
+        pool.n_opens++;
+        if (!r.idx_started) {
+            // 占位 header，结束时由 sidecar_finalize 回填
+            SamIdxHeader h = sidecar_make_header(0, 0);
+            if (!pwrite_all(r.idx_fd, (const char *)&h, sizeof(h), 0)) {
+                std::fprintf(stderr, "Failed to write sidecar: %s (%s)\n",
+                             r.idx_path.c_str(), std::strerror(errno));
+                close(r.idx_fd);
+                close(r.fd);
+                r.idx_fd = r.fd = -1;
+                return false;
+            }
+            r.idx_off = sizeof(h);
+            r.idx_started = true;
+        }
+    }
 
-    r.used = 0;
+    lru_push_front(pool, regions, i);
+    pool.n_open++;
     return true;
 }
 
-// ------------- 主逻辑：按 region.txt split SAM -------------
+// ------------- 把一个 region 缓存的 sidecar 记录追加到 .sidx -------------
 
-static bool split_by_regions(const std::string &sam_path,
-                             std::vector<Region> &regions,
-                             const std::string &out_dir)
+static bool flush_region_sidecar(Region &r)
 {
-    // 先构造 chr -> region 下标列表
-    std::unordered_map<std::string, std::vector<int> > chr2regs;
-    build_chr_region_index(regions, chr2regs);
+    if (r.idx_buf.empty()) return true;
+    size_t bytes = r.idx_buf.size() * sizeof(SamIdxEntry);
+    if (!pwrite_all(r.idx_fd, (const char *)r.idx_buf.data(), bytes, r.idx_off)) {
+        std::fprintf(stderr, "Failed to write sidecar: %s (%s)\n",
+                     r.idx_path.c_str(), std::strerror(errno));
+        return false;
+    }
+    r.idx_off += bytes;
+    r.idx_buf.clear();
+    return true;
+}
 
-    FILE *fp = std::fopen(sam_path.c_str(), "rb");
-    if (!fp) {
-        std::fprintf(stderr, "Failed to open SAM: %s (%s)\n",
-                     sam_path.c_str(), std::strerror(errno));
+// ------------- 把一个 region 的 buffer flush 到文件 -------------
+//
+// region buffer 用 page_pool.h 的页池（--buffer-mem 按 writer 平分，每个 writer 一个）；
+// 页池用完时被选中的 region 经这里先拿到描述符再写出，sidecar 同步 flush。
+
+static bool flush_region_buffer(FdPool &pool, PagePool &pp, std::vector<Region> &regions, int i,
+                                const std::vector<std::string> &header_lines,
+                                bool write_sidecar)
+{
+    Region &r = regions[i];
+    if (r.used == 0) return true; // 没数据就不用写
+
+    if (!acquire_region_fds(pool, regions, i, header_lines, write_sidecar)) return false;
+
+    if (!page_pool_write(pp, r, r.fd, &r.file_off)) {
+        std::fprintf(stderr, "Failed to write region file: %s (%s)\n",
+                     r.out_path.c_str(), std::strerror(errno));
         return false;
     }
+    return !write_sidecar || flush_region_sidecar(r);
+}
 
-    char  *line = nullptr;
-    size_t cap  = 0;
+// ------------- 多线程流水线 -------------
+//
+//   reader 线程 ──chunk──> parser[k % P] ──piece──> writer[0..W-1]
+//
+//   - reader：按 READ_BLOCK 大块读入，在最后一个 '\n' 处切开，chunk 按序号 k 轮流交给 parser；
+//     开头的 header 行在派发第一个 chunk 之前取出。
+//   - parser：逐行解析 RNAME/POS、查 region，把本 chunk 中的行按 region 所属 writer
+//     （region % W）拆成 W 个 piece（只记录行的位置，可能为空），发给各 writer。
+//   - writer：按 chunk 序号依次从 parser[k % P] 取 piece，直接从 chunk 把行复制进自己负责的
+//     region buffer，满了就通过自己的描述符池 pwrite 出去；最后一个用完 chunk 的 writer 回收它。
+//   相邻线程之间是有界的无锁 SPSC 环形队列；writer 严格按 chunk 序号消费，
+//   所以每个 region 内记录顺序与输入一致，输出与单线程版本逐字节相同。
+
+static const size_t READ_BLOCK = 8u * 1024u * 1024u;
+static const size_t RING_SLOTS = 4;
+
+template <typename T>
+class SpscRing {
+public:
+    explicit SpscRing(size_t cap) : slots_(cap), cap_(cap), head_(0), tail_(0) {}
+
+    void push(const T &v)
+    {
+        size_t t = tail_.load(std::memory_order_relaxed);
+        for (unsigned spin = 0; t - head_.load(std::memory_order_acquire) >= cap_; ++spin)
+            backoff(spin);
+        slots_[t % cap_] = v;
+        tail_.store(t + 1, std::memory_order_release);
+    }
 
-    std::vector<std::string> header_lines;
+    T pop()
+    {
+        size_t h = head_.load(std::memory_order_relaxed);
+        for (unsigned spin = 0; tail_.load(std::memory_order_acquire) == h; ++spin)
+            backoff(spin);
+        T v = slots_[h % cap_];
+        head_.store(h + 1, std::memory_order_release);
+        return v;
+    }
 
-    long long total_records   = 0;
-    long long assigned_records = 0;
+private:
+    static void backoff(unsigned spin)
+    {
+        if (spin < 64) std::this_thread::yield();
+        else           std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
 
-    while (true) {
-        ssize_t n = getline(&line, &cap, fp);
-        if (n < 0) break;
-        if (n == 0) continue;
+    std::vector<T>      slots_;
+    size_t              cap_;
+    char                pad0_[64];          // head_ / tail_ 分属不同 cache line
+    std::atomic<size_t> head_;
+    char                pad1_[64];
+    std::atomic<size_t> tail_;
+};
+
+struct Chunk {
+    char            *data;      // 若干完整的行（不做零初始化，反复复用）
+    size_t           size;
+    size_t           cap;
+    std::atomic<int> refs;      // 还没用完它的 writer 数
+    bool             end;       // 结束标记
+
+    Chunk() : data(nullptr), size(0), cap(0), refs(0), end(false) {}
+    ~Chunk() { delete[] data; }
+
+    void reserve(size_t n)
+    {
+        if (n <= cap) return;
+        char *p = new char[n];
+        if (size) std::memcpy(p, data, size);
+        delete[] data;
+        data = p;
+        cap  = n;
+    }
+};
+
+struct PieceLine {
+    int    region;
+    size_t off;          // 在 chunk 中的偏移
+    size_t len;          // 含换行
+};
+
+struct Piece {
+    Chunk                   *chunk;
+    std::vector<PieceLine>   lines;
+    std::vector<SamIdxEntry> idx;    // --sidecar：与 lines 一一对应，line_offset 由 writer 填
+    bool                     end;
+    Piece() : chunk(nullptr), end(false) {}
+};
 
-        size_t line_len = (size_t)n;
-        size_t text_len = line_len;
-        while (text_len > 0 &&
-              (line[text_len-1] == '\n' || line[text_len-1] == '\r')) {
-            --text_len;
+struct PipelineShared {
+    std::vector<Region>                        *regions;
+    const RegionRouter                         *router;
+    bool                                        write_sidecar;
+    int                                         n_parsers;
+    int                                         n_writers;
+
+    // reader 在派发第一个 chunk 之前填好（SPSC push 的 release 语义保证对下游可见）
+    std::vector<std::string> header_lines;
+    SidecarContigs           sidecar_contigs;
+    unsigned long long       header_bytes;
+    bool                     header_preloaded;   // --shard：header 已由调用方读好
+    const std::vector<std::string> *file_header; // 写进每个输出文件开头的 header（分片时为空）
+
+    unsigned long long       read_limit;         // 最多读这么多字节（--shard 的字节范围）
+
+    std::vector< SpscRing<Chunk*>* > to_parser;   // [P]
+    std::vector< SpscRing<Piece*>* > to_writer;   // [P * W]，下标 p * W + w
+
+    // writer 用完的 chunk 回到这里给 reader 复用（每 READ_BLOCK 一次，用锁即可）
+    std::mutex           free_mu;
+    std::vector<Chunk*>  free_chunks;
+
+    std::atomic<bool>      failed;
+    bool                   read_failed;          // 只由 reader 写
+    std::atomic<long long> total_records;
+    std::atomic<long long> assigned_records;
+    std::atomic<long long> unplaced_records;     // 写进 catch-all 的记录
+    int                    catch_all;            // catch-all region 的下标，-1 表示没有
+    std::atomic<long long> late_headers;         // 出现在记录之后的 header 行（忽略）
+
+    PipelineShared() : regions(nullptr), router(nullptr), write_sidecar(false),
+                       n_parsers(1), n_writers(1), header_bytes(0), header_preloaded(false),
+                       file_header(nullptr), read_limit(~0ULL), failed(false), read_failed(false),
+                       total_records(0), assigned_records(0), unplaced_records(0),
+                       catch_all(-1), late_headers(0) {}
+};
+
+static Chunk *get_free_chunk(PipelineShared *ps)
+{
+    {
+        std::lock_guard<std::mutex> lk(ps->free_mu);
+        if (!ps->free_chunks.empty()) {
+            Chunk *ck = ps->free_chunks.back();
+            ps->free_chunks.pop_back();
+            ck->size = 0;
+            return ck;
         }
+    }
+    return new Chunk();
+}
 
-        if (text_len == 0) continue;
+static void release_chunk(PipelineShared *ps, Chunk *ck)
+{
+    if (ck->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+    std::lock_guard<std::mutex> lk(ps->free_mu);
+    ps->free_chunks.push_back(ck);
+}
 
-        if (line[0] == '@') {
-            // header 直接缓存起来，后面每个 region 文件写一次
-            header_lines.emplace_back(line, line_len);
-            continue;
+// header 收齐后：统计 header 字节数，准备 sidecar 的 contig id
+static void pipeline_header_ready(PipelineShared *ps)
+{
+    for (const auto &h : ps->header_lines) ps->header_bytes += h.size();
+    if (ps->write_sidecar)
+        sidecar_contigs_from_header(ps->header_lines, ps->sidecar_contigs);
+}
+
+static void reader_thread(PipelineShared *ps, FILE *fp)
+{
+    Chunk    *carry = get_free_chunk(ps);   // 上一块末尾不完整的行
+    bool      header_done = ps->header_preloaded;
+    long long seq = 0;
+    unsigned long long left = ps->read_limit;
+
+    if (header_done) pipeline_header_ready(ps);
+
+    while (!ps->failed.load(std::memory_order_relaxed)) {
+        Chunk *ck = carry;
+        ck->reserve(ck->size + READ_BLOCK);
+        size_t want = (size_t)std::min<unsigned long long>(READ_BLOCK, left);
+        size_t n = want ? std::fread(ck->data + ck->size, 1, want, fp) : 0;
+        left -= n;
+        ck->size += n;
+        bool eof = (n == 0);
+
+        // 在最后一个 '\n' 处切开，剩余部分搬到下一块
+        carry = get_free_chunk(ps);
+        if (!eof) {
+            size_t cut = ck->size;
+            while (cut > 0 && ck->data[cut - 1] != '\n') --cut;
+            if (cut == 0) {                       // 一整块都没有换行：继续读
+                std::swap(carry, ck);
+                std::lock_guard<std::mutex> lk(ps->free_mu);
+                ps->free_chunks.push_back(ck);
+                continue;
+            }
+            carry->reserve(ck->size - cut + READ_BLOCK);
+            std::memcpy(carry->data, ck->data + cut, ck->size - cut);
+            carry->size = ck->size - cut;
+            ck->size    = cut;
         }
 
-        total_records++;
+        // 开头的 header 行
+        size_t body = 0;
+        if (!header_done) {
+            while (body < ck->size && ck->data[body] == '@') {
+                size_t s = body;
+                while (body < ck->size && ck->data[body] != '\n') ++body;
+                if (body < ck->size) ++body;
+                ps->header_lines.emplace_back(ck->data + s, body - s);
+            }
+            if (body < ck->size || eof) {
+                pipeline_header_ready(ps);
+                header_done = true;
+            }
+            if (body > 0) {
+                std::memmove(ck->data, ck->data + body, ck->size - body);
+                ck->size -= body;
+            }
+        }
 
-        const char *rname_s = nullptr;
-        size_t      rname_l = 0;
-        long long   pos     = 0;
-        if (!parse_sam_rname_pos(line, text_len, rname_s, rname_l, pos)) {
-            // 解析失败就丢掉
-            continue;
+        if (ck->size > 0 && header_done) {
+            ck->refs.store(ps->n_writers, std::memory_order_relaxed);
+            ps->to_parser[seq % ps->n_parsers]->push(ck);
+            seq++;
+        } else {
+            std::lock_guard<std::mutex> lk(ps->free_mu);
+            ps->free_chunks.push_back(ck);
         }
+        if (eof) break;
+    }
+    delete carry;
 
-        if (pos <= 0) {
-            // unmapped 或非法 POS，暂时不写
-            continue;
+    if (std::ferror(fp)) ps->read_failed = ps->failed = true;
+
+    // 结束标记：按轮转顺序补给每个 parser
+    for (int k = 0; k < ps->n_parsers; ++k) {
+        Chunk *end = new Chunk();
+        end->end = true;
+        ps->to_parser[(seq + k) % ps->n_parsers]->push(end);
+    }
+}
+
+static void parser_thread(PipelineShared *ps, int p)
+{
+    const int W = ps->n_writers;
+    const std::vector<Region> &regions = *ps->regions;
+
+    while (true) {
+        Chunk *ck = ps->to_parser[p]->pop();
+        if (ck->end) {
+            delete ck;
+            for (int w = 0; w < W; ++w) {
+                Piece *end = new Piece();
+                end->end = true;
+                ps->to_writer[p * W + w]->push(end);
+            }
+            break;
         }
 
-        std::string chr(rname_s, rname_l);
-        int ridx = find_region_for_pos(chr, pos, regions, chr2regs);
-        if (ridx < 0) {
-            // 说明这个 chr/pos 不在任何 region 里，略过
-            continue;
+        std::vector<Piece*> pieces(W);
+        for (int w = 0; w < W; ++w) {
+            pieces[w] = new Piece();
+            pieces[w]->chunk = ck;
         }
 
-        Region &r = regions[ridx];
+        long long total = 0, assigned = 0, unplaced = 0, late = 0;
+        const char *buf  = ck->data;
+        size_t      size = ck->size;
+        size_t      i    = 0;
+        while (i < size) {
+            size_t s = i;
+            SamFields f;            // 行尾和前 4 列的 tab 一次扫出来
+            sam_fields_scan(buf + s, size - s, 4, f);
+            i = s + f.next;
+            size_t line_len = f.next;
+            size_t text_len = f.len;
+            while (text_len > 0 && buf[s + text_len - 1] == '\r') --text_len;
+            if (text_len == 0) continue;
+            if (buf[s] == '@') {
+                late++;
+                continue;
+            }
+            total++;
+
+            const char *rname_s = nullptr;
+            size_t      rname_l = 0;
+            long long   pos     = 0;
+            if (!sam_fields_rname_pos(buf + s, text_len, f, rname_s, rname_l, pos)) continue;
+
+            // unmapped / 非法 POS / 不在任何 region 内的记录进 catch-all（--drop-unmapped 时丢弃）
+            int ridx = (pos > 0) ? route_record(*ps->router, rname_s, rname_l, pos, regions) : -1;
+            if (ridx < 0) {
+                ridx = ps->catch_all;
+                if (ridx < 0) continue;
+                unplaced++;
+            }
 
-        // 如果 buffer 放不下这一行，先 flush
-        if (r.used + line_len > r.buffer.size()) {
-            if (!flush_region_buffer(r, header_lines)) {
-                std::fprintf(stderr,
-                             "Flush failed for region file: %s\n",
-                             r.out_path.c_str());
-                std::fclose(fp);
-                if (line) std::free(line);
-                return false;
+            Piece *pc = pieces[ridx % W];
+            PieceLine pl = { ridx, s, line_len };
+            pc->lines.push_back(pl);
+            if (ps->write_sidecar) {
+                pc->idx.push_back(SamIdxEntry());
+                sidecar_parse_line(buf + s, text_len, line_len, 0, ps->sidecar_contigs, pc->idx.back());
             }
+            assigned++;
         }
+        ps->total_records    += total;
+        ps->assigned_records += assigned - unplaced;
+        ps->unplaced_records += unplaced;
+        if (late) ps->late_headers += late;
 
-        // 再把这一行放进去
-        if (line_len > r.buffer.size()) {
-            // 特殊情况：单行比 buffer 还大，直接写一次到文件中（附加 header）
-            if (!r.header_written) {
-                // 写 header + 这行
-                FILE *fp2 = std::fopen(r.out_path.c_str(), "wb");
-                if (!fp2) {
-                    std::fprintf(stderr,
-                                 "Failed to open region file (large line): %s (%s)\n",
-                                 r.out_path.c_str(), std::strerror(errno));
-                    std::fclose(fp);
-                    if (line) std::free(line);
-                    return false;
-                }
-                for (const auto &h : header_lines) {
-                    std::fwrite(h.data(), 1, h.size(), fp2);
-                }
-                std::fwrite(line, 1, line_len, fp2);
-                std::fclose(fp2);
-                r.header_written = true;
-            } else {
-                FILE *fp2 = std::fopen(r.out_path.c_str(), "ab");
-                if (!fp2) {
-                    std::fprintf(stderr,
-                                 "Failed to open region file (large line, append): %s (%s)\n",
-                                 r.out_path.c_str(), std::strerror(errno));
-                    std::fclose(fp);
-                    if (line) std::free(line);
-                    return false;
-                }
-                std::fwrite(line, 1, line_len, fp2);
-                std::fclose(fp2);
+        for (int w = 0; w < W; ++w) ps->to_writer[p * W + w]->push(pieces[w]);
+    }
+}
+
+// 把一行追加到 region 的 buffer 页（按需取页，可跨页）
+static bool writer_append_line(PipelineShared *ps, FdPool &pool, PagePool &pp, int ridx,
+                               const char *line, size_t line_len, const SamIdxEntry *e)
+{
+    std::vector<Region> &regions = *ps->regions;
+    Region &r = regions[ridx];
+
+    if (e) {
+        // 按 region.txt 里的记录数预留 sidecar buffer，省掉逐次倍增的拷贝
+        if (r.idx_buf.capacity() == 0 && r.has_expect)
+            r.idx_buf.reserve((size_t)std::min<unsigned long long>(r.expect_records + 1, IDX_RESERVE_MAX));
+        r.idx_buf.push_back(*e);
+        r.idx_buf.back().line_offset = ps->header_bytes + r.data_bytes;
+        sidecar_assign_name(r.idx_names, line, r.idx_buf.back());
+        r.n_idx++;
+    }
+    r.data_bytes += line_len;
+
+    return page_pool_append(pp, regions, ridx, line, line_len, [&](int j) {
+        return flush_region_buffer(pool, pp, regions, j, *ps->file_header, ps->write_sidecar);
+    });
+}
+
+static void writer_thread(PipelineShared *ps, int w, size_t max_open_files, size_t buffer_mem,
+                          char *ok_out)
+{
+    const int P = ps->n_parsers;
+    const int W = ps->n_writers;
+    std::vector<Region> &regions = *ps->regions;
+
+    // 每个打开的 region 占 1 个（--sidecar 时 2 个）描述符
+    FdPool pool;
+    pool.capacity = max_open_files / (ps->write_sidecar ? 2 : 1);
+    if (pool.capacity < 1) pool.capacity = 1;
+
+    // region.txt 带大小时，页池不超过本 writer 全部 region 的预计字节数（每个 region 向上取整到页，
+    // 再多留一页）；有一个 region 没有预计大小（如 catch-all）就按 --buffer-mem
+    size_t expect_mem = 0;
+    bool   all_expect = true;
+    for (size_t i = (size_t)w; i < regions.size() && all_expect; i += (size_t)W) {
+        if (!regions[i].has_expect) all_expect = false;
+        else expect_mem += ((size_t)regions[i].expect_bytes / BUF_PAGE_SIZE + 2) * BUF_PAGE_SIZE;
+    }
+    PagePool pp;
+    page_pool_init(pp, all_expect ? std::min(buffer_mem, expect_mem) : buffer_mem);
+
+    bool ok = true;
+    long long seq = 0;
+    for (;; ++seq) {
+        Piece *pc = ps->to_writer[(seq % P) * W + w]->pop();
+        if (pc->end) {
+            delete pc;
+            break;
+        }
+        if (ok && !ps->failed.load(std::memory_order_relaxed)) {
+            const char *buf = pc->chunk->data;
+            for (size_t k = 0; k < pc->lines.size() && ok; ++k) {
+                const PieceLine &pl = pc->lines[k];
+                ok = writer_append_line(ps, pool, pp, pl.region, buf + pl.off, pl.len,
+                                        ps->write_sidecar ? &pc->idx[k] : nullptr);
             }
-        } else {
-            // 正常情况：复制到 buffer
-            std::memcpy(r.buffer.data() + r.used, line, line_len);
-            r.used += line_len;
+            if (!ok) ps->failed = true;
         }
+        release_chunk(ps, pc->chunk);
+        delete pc;
+    }
 
-        assigned_records++;
+    // 第一个结束标记来自 parser (seq % P)，取走其余 parser 的结束标记
+    for (int k = 1; k < P; ++k) {
+        delete ps->to_writer[((seq + k) % P) * W + w]->pop();
     }
 
-    std::fclose(fp);
+    // 剩余数据 flush，关闭描述符，回填 sidecar header
+    for (size_t i = (size_t)w; ok && i < regions.size(); i += (size_t)W) {
+        if (regions[i].used > 0 &&
+            !flush_region_buffer(pool, pp, regions, (int)i, *ps->file_header, ps->write_sidecar)) {
+            std::fprintf(stderr, "Final flush failed for region file: %s\n",
+                         regions[i].out_path.c_str());
+            ok = false;
+        }
+    }
+    while (pool.tail >= 0) {
+        close_region_fds(pool, regions, pool.tail);
+    }
+    if (ok && ps->write_sidecar) {
+        for (size_t i = (size_t)w; ok && i < regions.size(); i += (size_t)W) {
+            Region &r = regions[i];
+            if (r.n_idx > 0 && !sidecar_finalize(r.idx_path, r.n_idx, ps->header_bytes, r.idx_names))
+                ok = false;
+        }
+    }
+    if (!ok) ps->failed = true;
+    std::fprintf(stderr,
+                 "  writer %d: flushes=%lld (%lld under pressure), file opens=%lld "
+                 "(fd pool=%zu, buffer pages=%zu x %zuKB)\n",
+                 w, pp.n_flushes, pp.n_pressure, pool.n_opens, pool.capacity,
+                 pp.n_pages, pp.page_size / 1024);
+    *ok_out = ok;
+}
+
+// ------------- --shard i/N：按字节范围分片 -------------
+//
+// 输入按字节均分成 N 段，每段从第一个完整行开始（行归属于行首所在的段）。
+// 每个分片进程只读自己那一段，写不带 header 的 region 片段
+//   out_dir/chr_start_end.sam.shard-i-of-N（--sidecar 时还有 .sidx.shard-i-of-N），
+// 成功后写 out_dir/shard-i-of-N.done。全部分片完成后用 --merge-shards N 按分片顺序拼接
+// （写 header，再 copy_file_range 各片段，sidecar 修正行偏移），结果与单进程切分逐字节相同。
+// 各分片可以放在不同节点上跑，共享文件系统的聚合带宽。
+
+struct ShardSpec {
+    int index;
+    int count;      // 0 表示不分片
+    ShardSpec() : index(0), count(0) {}
+};
+
+static std::string shard_suffix(int i, int n)
+{
+    char buf[64];
+    std::snprintf(buf, sizeof(buf), ".shard-%d-of-%d", i, n);
+    return buf;
+}
+
+static std::string shard_done_path(const std::string &out_dir, int i, int n)
+{
+    return out_dir + "/" + shard_suffix(i, n).substr(1) + ".done";
+}
+
+// 读开头的 header 行，返回第一条记录的偏移
+static unsigned long long read_leading_header(FILE *fp, std::vector<std::string> &header_lines)
+{
+    unsigned long long off = 0;
+    char  *line = nullptr;
+    size_t cap  = 0;
+    while (true) {
+        int c = std::fgetc(fp);
+        if (c == EOF) break;
+        std::ungetc(c, fp);
+        if (c != '@') break;
+        ssize_t n = getline(&line, &cap, fp);
+        if (n <= 0) break;
+        header_lines.emplace_back(line, (size_t)n);
+        off += (unsigned long long)n;
+    }
     if (line) std::free(line);
+    return off;
+}
+
+// off 处或之后的第一个行首
+static unsigned long long line_start_at_or_after(FILE *fp, unsigned long long off,
+                                                 unsigned long long size)
+{
+    if (off == 0) return 0;
+    if (off >= size) return size;
+    if (fseeko(fp, (off_t)(off - 1), SEEK_SET) != 0) return size;
+    unsigned long long pos = off - 1;
+    int c;
+    while ((c = std::fgetc(fp)) != EOF) {
+        ++pos;
+        if (c == '\n') return pos;
+    }
+    return size;
+}
 
-    // 把每个 region 剩余的数据 flush 一次
+// 打开输入并定位到本分片的字节范围；header 读进 header_lines
+static FILE *open_shard_input(const std::string &sam_path, const ShardSpec &shard,
+                              std::vector<std::string> &header_lines,
+                              unsigned long long &begin, unsigned long long &end)
+{
+    if (sam_path == "-" || sam_input_format(sam_path) != SAM_INPUT_PLAIN) {
+        std::fprintf(stderr, "--shard needs an uncompressed, seekable SAM file: %s\n",
+                     sam_path.c_str());
+        return nullptr;
+    }
+    FILE *fp = std::fopen(sam_path.c_str(), "rb");
+    struct stat st;
+    if (!fp || fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode)) {
+        std::fprintf(stderr, "Failed to open SAM: %s (%s)\n",
+                     sam_path.c_str(), std::strerror(errno));
+        if (fp) std::fclose(fp);
+        return nullptr;
+    }
+    unsigned long long size = (unsigned long long)st.st_size;
+
+    unsigned long long header_end = read_leading_header(fp, header_lines);
+    unsigned long long lo = size / shard.count * shard.index +
+                            size % shard.count * shard.index / shard.count;
+    unsigned long long hi = size / shard.count * (shard.index + 1) +
+                            size % shard.count * (shard.index + 1) / shard.count;
+    begin = std::max(header_end, line_start_at_or_after(fp, lo, size));
+    end   = std::max(begin, line_start_at_or_after(fp, hi, size));
+
+    if (fseeko(fp, (off_t)begin, SEEK_SET) != 0) {
+        std::fclose(fp);
+        return nullptr;
+    }
+    std::fprintf(stderr, "Shard %d/%d: bytes [%llu, %llu) of %llu\n",
+                 shard.index, shard.count, begin, end, size);
+    return fp;
+}
+
+// ------------- 主逻辑：按 region.txt split SAM -------------
+
+static bool split_by_regions(const std::string &sam_path,
+                             std::vector<Region> &regions,
+                             const std::string &out_dir,
+                             bool write_sidecar,
+                             size_t max_open_files,
+                             size_t buffer_mem,
+                             int n_threads,
+                             const ShardSpec &shard,
+                             bool fragments,
+                             std::vector<std::string> *header_out)
+{
+    // 先构造 contig -> bin -> region 路由表
+    RegionRouter router;
+    build_region_router(regions, router);
+
+    PipelineShared ps;
+    std::vector<std::string> no_header;
+    ps.file_header = &ps.header_lines;
+
+    FILE *fp = nullptr;
+    if (shard.count > 0 || fragments) {
+        // 片段不带 header，合并时再写；先清掉上一次留下的同名片段，避免被合并进来
+        ps.file_header = &no_header;
+        if (shard.count > 0) unlink(shard_done_path(out_dir, shard.index, shard.count).c_str());
+        for (size_t i = 0; i < regions.size(); ++i) {
+            unlink(regions[i].out_path.c_str());
+            unlink(regions[i].idx_path.c_str());
+        }
+    }
+    if (shard.count > 0) {
+        unsigned long long begin = 0, end = 0;
+        fp = open_shard_input(sam_path, shard, ps.header_lines, begin, end);
+        if (!fp) return false;
+        ps.header_preloaded = true;
+        ps.read_limit       = end - begin;
+    } else {
+        fp = sam_input_open(sam_path);
+        if (!fp) {
+            std::fprintf(stderr, "Failed to open SAM: %s (%s)\n",
+                         sam_path.c_str(), std::strerror(errno));
+            return false;
+        }
+    }
+
+    // 线程分配：1 个 reader，W 个 writer（各管 region % W == w 的 region 和一份描述符池），
+    // 其余为 parser
+    if (n_threads < 3) n_threads = 3;
+    int W = std::max(1, n_threads / 4);
+    if ((size_t)W > regions.size()) W = (int)regions.size();
+    int P = std::max(1, n_threads - 1 - W);
+
+    ps.regions       = &regions;
+    for (size_t i = 0; i < regions.size(); ++i) {
+        if (regions[i].catch_all) ps.catch_all = (int)i;
+    }
+    ps.router        = &router;
+    ps.write_sidecar = write_sidecar;
+    ps.n_parsers     = P;
+    ps.n_writers     = W;
+    for (int p = 0; p < P; ++p) ps.to_parser.push_back(new SpscRing<Chunk*>(RING_SLOTS));
+    for (int k = 0; k < P * W; ++k) ps.to_writer.push_back(new SpscRing<Piece*>(RING_SLOTS));
+
+    std::fprintf(stderr, "Pipeline: 1 reader, %d parsers, %d writers (%zu regions, buffer %zu MB)\n",
+                 P, W, regions.size(), buffer_mem >> 20);
+
+    std::vector<char> writer_ok(W, 0);
+    std::vector<std::thread> threads;
+    for (int w = 0; w < W; ++w)
+        threads.push_back(std::thread(writer_thread, &ps, w, max_open_files / W,
+                                      buffer_mem / W, &writer_ok[w]));
+    for (int p = 0; p < P; ++p)
+        threads.push_back(std::thread(parser_thread, &ps, p));
+    reader_thread(&ps, fp);
+    for (size_t t = 0; t < threads.size(); ++t) threads[t].join();
+
+    // 压缩输入解压失败（损坏 / 截断）时 ferror / fclose 会报错
+    bool ok = !ps.failed.load();
+    if (std::fclose(fp) != 0 || ps.read_failed) {
+        std::fprintf(stderr, "Failed to read SAM: %s\n", sam_path.c_str());
+        ok = false;
+    }
+    for (int w = 0; w < W; ++w) if (!writer_ok[w]) ok = false;
+
+    for (size_t k = 0; k < ps.to_parser.size(); ++k) delete ps.to_parser[k];
+    for (size_t k = 0; k < ps.to_writer.size(); ++k) delete ps.to_writer[k];
+    for (size_t k = 0; k < ps.free_chunks.size(); ++k) delete ps.free_chunks[k];
+
+    if (!ok) return false;
+    if (header_out) *header_out = ps.header_lines;
+    if (ps.late_headers > 0) {
+        std::fprintf(stderr, "[WARN] ignored %lld header lines after the first record\n",
+                     (long long)ps.late_headers);
+    }
+
+    std::fprintf(stderr,
+                 "Split done. total_records=%lld, assigned_records=%lld, unplaced_records=%lld\n",
+                 (long long)ps.total_records, (long long)ps.assigned_records,
+                 (long long)ps.unplaced_records);
+
+    if (shard.count > 0) {
+        std::string done = shard_done_path(out_dir, shard.index, shard.count);
+        FILE *dp = std::fopen(done.c_str(), "w");
+        if (!dp) {
+            std::fprintf(stderr, "Failed to write %s (%s)\n", done.c_str(), std::strerror(errno));
+            return false;
+        }
+        std::fprintf(dp, "total_records=%lld assigned_records=%lld\n",
+                     (long long)ps.total_records, (long long)ps.assigned_records);
+        if (std::fclose(dp) != 0) return false;
+    }
+    return true;
+}
+
+// ------------- --merge-shards N：按分片顺序拼接片段 -------------
+
+// 把 src 整个追加到 dst 的 dst_off 处；优先 copy_file_range（同一文件系统上不经过用户态）
+static bool append_file(int dst, unsigned long long &dst_off, const std::string &src_path)
+{
+    int src = open(src_path.c_str(), O_RDONLY);
+    if (src < 0) return false;
+    struct stat st;
+    if (fstat(src, &st) != 0) {
+        close(src);
+        return false;
+    }
+    unsigned long long left = (unsigned long long)st.st_size;
+    loff_t in_off = 0;
+    bool use_cfr = true;
+    std::vector<char> buf;
+    while (left > 0) {
+        if (use_cfr) {
+            loff_t out_off = (loff_t)dst_off;
+            ssize_t n = copy_file_range(src, &in_off, dst, &out_off, (size_t)left, 0);
+            if (n > 0) {
+                dst_off += (unsigned long long)n;
+                left    -= (unsigned long long)n;
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n == 0 || errno == ENOSYS || errno == EXDEV || errno == EINVAL ||
+                errno == EOPNOTSUPP) {
+                use_cfr = false;            // 退回普通读写
+                continue;
+            }
+            close(src);
+            return false;
+        }
+        if (buf.empty()) buf.resize(4u << 20);
+        ssize_t n = pread(src, buf.data(), std::min<size_t>(buf.size(), left), in_off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0 || !pwrite_all(dst, buf.data(), (size_t)n, dst_off)) {
+            close(src);
+            return false;
+        }
+        in_off  += n;
+        dst_off += (unsigned long long)n;
+        left    -= (unsigned long long)n;
+    }
+    close(src);
+    return true;
+}
+
+static bool file_exists(const std::string &path, unsigned long long *size = nullptr)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) return false;
+    if (size) *size = (unsigned long long)st.st_size;
+    return true;
+}
+
+// 按 suffixes 的顺序把每个 region 的片段 <out_path><suffix> 拼成 <out_path>：
+// 先写 header_lines，再依次追加片段；sidecar 片段的行偏移改成相对合并后的文件。
+static bool merge_fragments(std::vector<Region> &regions,
+                            const std::vector<std::string> &header_lines,
+                            const std::vector<std::string> &suffixes)
+{
+    unsigned long long header_bytes = 0;
+    for (const auto &h : header_lines) header_bytes += h.size();
+
+    long long n_merged = 0, n_frags = 0;
     for (size_t i = 0; i < regions.size(); ++i) {
         Region &r = regions[i];
-        if (r.used > 0) {
-            if (!flush_region_buffer(r, header_lines)) {
-                std::fprintf(stderr,
-                             "Final flush failed for region file: %s\n",
-                             r.out_path.c_str());
+
+        std::vector<size_t>             frags;
+        std::vector<unsigned long long> frag_bytes;
+        size_t n_sidx = 0;
+        for (size_t k = 0; k < suffixes.size(); ++k) {
+            unsigned long long sz = 0;
+            if (!file_exists(r.out_path + suffixes[k], &sz)) continue;
+            frags.push_back(k);
+            frag_bytes.push_back(sz);
+            if (file_exists(r.idx_path + suffixes[k])) n_sidx++;
+        }
+        if (frags.empty()) continue;
+        if (n_sidx != 0 && n_sidx != frags.size()) {
+            std::fprintf(stderr, "Some fragments of %s have no sidecar; split every part "
+                         "with the same options\n", r.out_path.c_str());
+            return false;
+        }
+
+        // SAM：header + 各片段
+        int fd = open(r.out_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            std::fprintf(stderr, "Failed to open region file for writing: %s (%s)\n",
+                         r.out_path.c_str(), std::strerror(errno));
+            return false;
+        }
+        unsigned long long off = 0;
+        bool ok = true;
+        for (const auto &h : header_lines) {
+            ok = ok && pwrite_all(fd, h.data(), h.size(), off);
+            off += h.size();
+        }
+        for (size_t k = 0; ok && k < frags.size(); ++k)
+            ok = append_file(fd, off, r.out_path + suffixes[frags[k]]);
+        if (close(fd) != 0) ok = false;
+        if (!ok) {
+            std::fprintf(stderr, "Failed to merge fragments into %s (%s)\n",
+                         r.out_path.c_str(), std::strerror(errno));
+            return false;
+        }
+
+        // sidecar：片段内的行偏移（相对片段所属输入的 header）换成相对合并后的文件
+        if (n_sidx) {
+            // 各片段的名表合并成一个，排序键的下标随之换算
+            std::vector<SamIdxEntry> merged;
+            SidecarNames             names;
+            unsigned long long delta = 0;
+            for (size_t k = 0; k < frags.size(); ++k) {
+                SamIdxHeader h;
+                size_t base = merged.size();
+                if (!sidecar_read(r.idx_path + suffixes[frags[k]], h, merged, names))
+                    return false;
+                for (size_t e = base; e < merged.size(); ++e)
+                    merged[e].line_offset += header_bytes + delta - h.data_offset;
+                delta += frag_bytes[k];
+            }
+            if (!sidecar_write(r.idx_path, header_bytes, merged.data(), merged.size(), names))
                 return false;
+        }
+
+        for (size_t k = 0; k < frags.size(); ++k) {
+            unlink((r.out_path + suffixes[frags[k]]).c_str());
+            if (n_sidx) unlink((r.idx_path + suffixes[frags[k]]).c_str());
+        }
+        n_merged++;
+        n_frags += (long long)frags.size();
+    }
+
+    std::fprintf(stderr, "Merged %lld fragments into %lld region files\n", n_frags, n_merged);
+    return true;
+}
+
+static bool merge_shards(const std::string &sam_path,
+                         std::vector<Region> &regions,
+                         const std::string &out_dir,
+                         int n_shards)
+{
+    for (int k = 0; k < n_shards; ++k) {
+        if (!file_exists(shard_done_path(out_dir, k, n_shards))) {
+            std::fprintf(stderr, "Shard %d/%d has not finished (no %s)\n", k, n_shards,
+                         shard_done_path(out_dir, k, n_shards).c_str());
+            return false;
+        }
+    }
+
+    FILE *fp = sam_input_open(sam_path);
+    if (!fp) {
+        std::fprintf(stderr, "Failed to open SAM: %s (%s)\n",
+                     sam_path.c_str(), std::strerror(errno));
+        return false;
+    }
+    std::vector<std::string> header_lines;
+    read_leading_header(fp, header_lines);
+    std::fclose(fp);
+
+    std::vector<std::string> suffixes;
+    for (int k = 0; k < n_shards; ++k) suffixes.push_back(shard_suffix(k, n_shards));
+    if (!merge_fragments(regions, header_lines, suffixes)) return false;
+
+    for (int k = 0; k < n_shards; ++k) unlink(shard_done_path(out_dir, k, n_shards).c_str());
+    return true;
+}
+
+// ------------- 多个输入（每个 lane 一个 SAM） -------------
+//
+// 各输入各跑一条流水线，写不带 header 的片段 <region>.sam.input-k-of-M。每条流水线至少要
+// 3 个线程（reader / parser / writer），所以同时只跑 n_threads/3 条，线程、打开文件数和
+// buffer 内存在同时运行的流水线之间平分，一条跑完再开始下一个输入；
+// 全部完成后检查 header 兼容（@SQ 必须完全一致，包括顺序和 LN）并合并，再按输入顺序拼接片段。
+// 每个 region 文件只写一次，同一 lane 的记录在文件里连续，与把各 lane 依次 cat 起来再切分的结果一致。
+
+static std::string input_suffix(size_t k, size_t n)
+{
+    char buf[64];
+    std::snprintf(buf, sizeof(buf), ".input-%zu-of-%zu", k, n);
+    return buf;
+}
+
+// header 行中 TAG:value 的值（没有时返回空串）
+static std::string header_tag(const std::string &line, const char *tag)
+{
+    std::string key = std::string("\t") + tag + ":";
+    size_t p = line.find(key);
+    if (p == std::string::npos) return std::string();
+    p += key.size();
+    size_t q = p;
+    while (q < line.size() && line[q] != '\t' && line[q] != '\n' && line[q] != '\r') ++q;
+    return line.substr(p, q - p);
+}
+
+// 把 @HD 行的 SO 改成 unsorted（没有 SO 时不动）
+static std::string header_hd_unsorted(const std::string &hd)
+{
+    size_t p = hd.find("\tSO:");
+    if (p == std::string::npos) return hd;
+    p += 4;
+    size_t q = p;
+    while (q < hd.size() && hd[q] != '\t' && hd[q] != '\n' && hd[q] != '\r') ++q;
+    return hd.substr(0, p) + "unsorted" + hd.substr(q);
+}
+
+// 合并各输入的 header：@HD 取第一个输入的（多个输入时 SO 改为 unsorted）；@SQ 必须完全一致；
+// @RG 按 ID 合并（同 ID 内容不同则报错）；@PG / @CO / 其他行按整行去重，保持首次出现的顺序。
+static bool merge_input_headers(const std::vector<std::vector<std::string> > &headers,
+                                const std::vector<std::string> &names,
+                                std::vector<std::string> &merged)
+{
+    merged.clear();
+    std::vector<std::string> sq0;
+    for (const auto &h : headers[0]) {
+        if (h.compare(0, 3, "@SQ") == 0)
+            sq0.push_back(header_tag(h, "SN") + "\t" + header_tag(h, "LN"));
+    }
+    for (size_t k = 1; k < headers.size(); ++k) {
+        std::vector<std::string> sq;
+        for (const auto &h : headers[k]) {
+            if (h.compare(0, 3, "@SQ") == 0)
+                sq.push_back(header_tag(h, "SN") + "\t" + header_tag(h, "LN"));
+        }
+        if (sq != sq0) {
+            std::fprintf(stderr, "Incompatible headers: @SQ of %s differs from %s\n",
+                         names[k].c_str(), names[0].c_str());
+            return false;
+        }
+    }
+
+    const char *order[] = { "@HD", "@SQ", "@RG", "@PG", "@CO", nullptr };
+    std::unordered_map<std::string, std::string> rg_by_id;
+    std::unordered_map<std::string, int>         seen;
+    for (int t = 0; t <= 5; ++t) {
+        for (size_t k = 0; k < headers.size(); ++k) {
+            if ((t == 0 || t == 1) && k > 0) continue;        // @HD / @SQ 只取第一个输入
+            for (const auto &h : headers[k]) {
+                bool known = false;
+                for (int u = 0; order[u]; ++u) {
+                    if (h.compare(0, 3, order[u]) == 0) known = true;
+                }
+                if (order[t] ? h.compare(0, 3, order[t]) != 0 : known) continue;
+
+                if (t == 2) {
+                    std::string id = header_tag(h, "ID");
+                    auto it = rg_by_id.find(id);
+                    if (it != rg_by_id.end()) {
+                        if (it->second != h) {
+                            std::fprintf(stderr, "Incompatible headers: @RG ID:%s differs in %s\n",
+                                         id.c_str(), names[k].c_str());
+                            return false;
+                        }
+                        continue;
+                    }
+                    rg_by_id[id] = h;
+                } else if (t != 1) {
+                    if (seen.count(h)) continue;
+                    seen[h] = 1;
+                }
+                if (t == 0 && headers.size() > 1) {
+                    // 各 lane 依次拼接，即使每个输入都已排序，合并后也不再有序
+                    merged.push_back(header_hd_unsorted(h));
+                    continue;
+                }
+                merged.push_back(h);
             }
         }
     }
+    return true;
+}
 
-    std::fprintf(stderr,
-                 "Split done. total_records=%lld, assigned_records=%lld\n",
-                 total_records, assigned_records);
+// 读一个输入开头的 header（用于在切分前尽早发现不兼容的输入；stdin 跳过）
+static bool read_input_header(const std::string &path, std::vector<std::string> &header_lines)
+{
+    FILE *fp = sam_input_open(path);
+    if (!fp) {
+        std::fprintf(stderr, "Failed to open SAM: %s (%s)\n", path.c_str(), std::strerror(errno));
+        return false;
+    }
+    read_leading_header(fp, header_lines);
+    std::fclose(fp);
     return true;
 }
 
+static bool split_multi_inputs(const std::vector<std::string> &inputs,
+                               std::vector<Region> &regions,
+                               const std::string &out_dir,
+                               bool write_sidecar,
+                               size_t max_open_files,
+                               size_t buffer_mem,
+                               int n_threads)
+{
+    size_t M = inputs.size();
+    std::vector<std::vector<std::string> > headers(M);
+    std::vector<std::string>               merged_header;
+
+    // 1) 切分前先比对 header（stdin 只能在读完后检查）
+    bool has_stdin = false;
+    for (size_t k = 0; k < M; ++k) {
+        if (inputs[k] == "-") {
+            has_stdin = true;
+            continue;
+        }
+        if (!read_input_header(inputs[k], headers[k])) return false;
+    }
+    if (!has_stdin && !merge_input_headers(headers, inputs, merged_header)) return false;
+
+    // 2) 各输入切分成片段：最多 L 条流水线同时运行，不超订 n_threads
+    std::vector<std::string>          suffixes(M);
+    std::vector<std::vector<Region> > lane_regions(M, regions);
+    std::vector<char>                 lane_ok(M, 0);
+    for (size_t k = 0; k < M; ++k) {
+        suffixes[k] = input_suffix(k, M);
+        for (size_t i = 0; i < regions.size(); ++i) {
+            lane_regions[k][i].out_path += suffixes[k];
+            lane_regions[k][i].idx_path += suffixes[k];
+        }
+    }
+
+    size_t L = std::min(M, (size_t)std::max(1, n_threads / 3));
+    int    lane_threads = std::max(3, n_threads / (int)L);
+    std::fprintf(stderr, "Splitting %zu inputs, %zu at a time, %d threads each\n",
+                 M, L, lane_threads);
+
+    std::atomic<size_t>      next_lane(0);
+    std::vector<std::thread> lanes;
+    for (size_t t = 0; t < L; ++t) {
+        lanes.push_back(std::thread([&]() {
+            for (size_t k = next_lane++; k < M; k = next_lane++) {
+                lane_ok[k] = split_by_regions(inputs[k], lane_regions[k], out_dir, write_sidecar,
+                                              std::max<size_t>(1, max_open_files / L),
+                                              buffer_mem / L, lane_threads,
+                                              ShardSpec(), true, &headers[k]) ? 1 : 0;
+            }
+        }));
+    }
+    for (size_t t = 0; t < L; ++t) lanes[t].join();
+
+    // 3) 合并 header，按输入顺序拼接片段
+    bool ok = true;
+    for (size_t k = 0; k < M; ++k) {
+        if (!lane_ok[k]) {
+            std::fprintf(stderr, "Failed to split input %s\n", inputs[k].c_str());
+            ok = false;
+        }
+    }
+    ok = ok && merge_input_headers(headers, inputs, merged_header) &&
+         merge_fragments(regions, merged_header, suffixes);
+    if (!ok) {
+        for (size_t k = 0; k < M; ++k) {
+            for (size_t i = 0; i < regions.size(); ++i) {
+                unlink(lane_regions[k][i].out_path.c_str());
+                unlink(lane_regions[k][i].idx_path.c_str());
+            }
+        }
+    }
+    return ok;
+}
+
 // ------------- main -------------
 
 int main(int argc, char **argv)
@@ -522,18 +1609,73 @@ int main(int argc, char **argv)
     //fprintf(stderr, "aa %d\n", aa);
 
     
-    if (argc < 4) {
+    bool write_sidecar = false;
+    int  n_threads     = (int)std::thread::hardware_concurrency();
+    size_t buffer_mem  = DEFAULT_BUFFER_MEM;
+    ShardSpec shard;
+    int  merge_n       = 0;
+    bool drop_unmapped = false;
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--sidecar") == 0) {
+            write_sidecar = true;
+        } else if (std::strcmp(argv[i], "--drop-unmapped") == 0) {
+            drop_unmapped = true;
+        } else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            n_threads = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--buffer-mem") == 0 && i + 1 < argc) {
+            if (!parse_mem_size(argv[++i], buffer_mem)) {
+                std::fprintf(stderr, "Bad --buffer-mem: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (std::strcmp(argv[i], "--shard") == 0 && i + 1 < argc) {
+            if (std::sscanf(argv[++i], "%d/%d", &shard.index, &shard.count) != 2 ||
+                shard.count < 1 || shard.index < 0 || shard.index >= shard.count) {
+                std::fprintf(stderr, "Bad --shard (expect i/N with 0 <= i < N): %s\n", argv[i]);
+                return 1;
+            }
+        } else if (std::strcmp(argv[i], "--merge-shards") == 0 && i + 1 < argc) {
+            merge_n = std::atoi(argv[++i]);
+            if (merge_n < 1) {
+                std::fprintf(stderr, "Bad --merge-shards: %s\n", argv[i]);
+                return 1;
+            }
+        } else {
+            positional.push_back(argv[i]);
+        }
+    }
+
+    if (positional.size() < 3 || (merge_n > 0 && shard.count > 0) ||
+        (positional.size() > 3 && (merge_n > 0 || shard.count > 0))) {
         std::fprintf(stderr,
-                     "Usage: %s <region.txt> <all.sam> <out_dir>\n"
+                     "Usage: %s [--sidecar] [--threads N] [--buffer-mem SIZE] <region.txt> <all.sam> [more.sam ...] <out_dir>\n"
+                     "Options:\n"
+                     "  --sidecar   : also write a binary field index <region>.sidx per region\n"
+                     "  --drop-unmapped : do not write unmapped / unplaced records to out_dir/" SAM_CATCH_ALL_NAME "\n"
+                     "  --threads N : pipeline threads (1 reader, N/4 writers, rest parsers;\n"
+                     "                default: all hardware threads, minimum 3)\n"
+                     "  --buffer-mem SIZE : total region buffer memory, e.g. 512M, 4G (default 1G)\n"
+                     "  --shard i/N : split only the i-th of N newline-aligned byte ranges (0-based),\n"
+                     "                writing header-less fragments <region>.sam.shard-i-of-N\n"
+                     "  --merge-shards N : after all N shards finished, concatenate the fragments\n"
+                     "                     in shard order into the final region files\n"
+                     "  <all.sam> may be '-' (stdin) or a FIFO to split while the aligner runs\n"
+                     "  several inputs (e.g. one SAM per lane) are split concurrently, at most N/3 at\n"
+                     "  a time; their headers must have identical @SQ and are merged, each region\n"
+                     "  file holds the records of input 1, then input 2, ...\n"
+                     "  (not with --shard / --merge-shards)\n"
                      "Example:\n"
-                     "  %s region.txt all.sam out_regions_sam\n",
-                     argv[0], argv[0]);
+                     "  %s region.txt all.sam out_regions_sam\n"
+                     "  for i in 0 1 2 3; do ssh node$i %s --shard $i/4 region.txt all.sam out & done; wait\n"
+                     "  %s --merge-shards 4 region.txt all.sam out\n",
+                     argv[0], argv[0], argv[0], argv[0]);
         return 1;
     }
 
-    std::string region_file = argv[1];
-    std::string sam_file    = argv[2];
-    std::string out_dir     = argv[3];
+    std::string region_file = positional[0];
+    std::string sam_file    = positional[1];
+    std::string out_dir     = positional.back();
+    std::vector<std::string> sam_files(positional.begin() + 1, positional.end() - 1);
 
     // 创建输出目录（若不存在）
     struct stat st;
@@ -559,7 +1701,17 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    set_nofile_limit(regions.size() + 128);
+    // 每个 region 1 个描述符（--sidecar 时 2 个），再留一些余量
+    size_t fds_per_region = write_sidecar ? 2 : 1;
+    set_nofile_limit(regions.size() * fds_per_region + 128);
+
+    // 描述符池大小 = 软限制减去余量（软限制不够时只是更频繁地 LRU 淘汰）
+    size_t max_open_files = regions.size() * fds_per_region;
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+        size_t avail = (rl.rlim_cur > 64) ? (size_t)rl.rlim_cur - 64 : fds_per_region;
+        if (avail < max_open_files) max_open_files = avail;
+    }
     fprintf(stderr, "load_regions %.2f ms\n", now_ms() - t0);
 
     t0 = now_ms();
@@ -567,8 +1719,28 @@ int main(int argc, char **argv)
         std::fprintf(stderr, "No regions loaded from %s\n", region_file.c_str());
         return 1;
     }
+    if (!drop_unmapped) add_catch_all_region(regions, out_dir);
 
-    if (!split_by_regions(sam_file, regions, out_dir)) {
+    if (merge_n > 0) {
+        if (!merge_shards(sam_file, regions, out_dir, merge_n)) return 1;
+        fprintf(stderr, "merge_shards %.2f ms\n", now_ms() - t0);
+        return 0;
+    }
+    if (shard.count > 0) {
+        std::string suffix = shard_suffix(shard.index, shard.count);
+        for (size_t i = 0; i < regions.size(); ++i) {
+            regions[i].out_path += suffix;
+            regions[i].idx_path += suffix;
+        }
+    }
+
+    if (sam_files.size() > 1) {
+        if (!split_multi_inputs(sam_files, regions, out_dir, write_sidecar, max_open_files,
+                                buffer_mem, n_threads)) {
+            return 1;
+        }
+    } else if (!split_by_regions(sam_file, regions, out_dir, write_sidecar, max_open_files,
+                                 buffer_mem, n_threads, shard, false, nullptr)) {
         return 1;
     }
     fprintf(stderr, "split_by_regions %.2f ms\n", now_ms() - t0);
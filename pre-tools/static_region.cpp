@@ -3,16 +3,27 @@
 #include <string>
 #include <vector>
 #include <unordered_map>
+#include <algorithm>
 #include <cstdint>
 #include <cstdlib>
 #include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
 #include <errno.h>
 #include <cstring>
+#include <cstdio>
 
-static const int NUM_REGIONS = 384 * 16;             // 3072
-static const size_t BUF_SIZE = 4ULL * 1024 * 1024;  // 4MB
+#include "sam_input.h"
+#include "sam_fields.h"
+#include "page_pool.h"
+#include "../slave/sam_process_para.h"
+
+static const int NUM_REGIONS = 384 * 16;             // 6144
+static const size_t READ_BLOCK         = 8u * 1024u * 1024u;         // 输入按 8MB 大块读
 
 struct ChromInfo {
     std::string name;
@@ -165,17 +176,34 @@ bool global_to_chr_pos(const std::vector<ChromInfo> &chrom_order,
     return false;
 }
 
+// 按名字找 chrom（不分配内存）：chrom 只有 24 条，先看上一次命中的那条
+// （输入大多按坐标排好，同一条 chrom 的记录是连续的），再线性扫描
+static const ChromInfo *find_chrom(const std::vector<ChromInfo> &chrom_order,
+                                   const char *name, size_t len, int &cache)
+{
+    if (cache >= 0) {
+        const ChromInfo &ci = chrom_order[cache];
+        if (ci.name.size() == len && std::memcmp(ci.name.data(), name, len) == 0) return &ci;
+    }
+    for (size_t i = 0; i < chrom_order.size(); ++i) {
+        const ChromInfo &ci = chrom_order[i];
+        if (ci.name.size() == len && std::memcmp(ci.name.data(), name, len) == 0) {
+            cache = (int)i;
+            return &ci;
+        }
+    }
+    return nullptr;
+}
+
 // 根据 (chrom, pos) 计算全局坐标，再映射到 region id
 // pos 是 1-based SAM POS
-int coord_to_region(const std::unordered_map<std::string, ChromInfo> &chroms,
-                    const std::string &rname, int pos,
+int coord_to_region(const ChromInfo *ci, int pos,
                     uint64_t region_size, int num_regions)
 {
-    auto it = chroms.find(rname);
-    if (it == chroms.end()) return -1;
+    if (!ci) return -1;
     if (pos <= 0) return -1;
 
-    uint64_t global_pos = it->second.offset + static_cast<uint64_t>(pos - 1);
+    uint64_t global_pos = ci->offset + static_cast<uint64_t>(pos - 1);
     uint64_t rid = global_pos / region_size;
     if (rid >= static_cast<uint64_t>(num_regions)) {
         rid = num_regions - 1;
@@ -197,15 +225,68 @@ void make_dir(const std::string &dir) {
     }
 }
 
+// ---------------- region buffer 页池 ----------------
+//
+// 与 split_from_region 共用 page_pool.h：所有 region（含 catch-all）共享一个 --buffer-mem 大小的
+// 页池，region 按需取页；页池用完时把持有页最多的 region 整个写出去。
+// 以前每个 region 各 reserve 一个 4MB 的 std::string，6144 个 region 最坏要 24GB。
+
+struct RegionOut {
+    int                fd;
+    std::vector<int>   pages;    // 持有的页号，按写入顺序
+    size_t             used;     // 已缓存的字节数
+    unsigned long long file_off; // 下一次写出的文件偏移
+
+    RegionOut() : fd(-1), used(0), file_off(0) {}
+};
+
+static bool flush_region(PagePool &pp, std::vector<RegionOut> &outs, int i)
+{
+    RegionOut &r = outs[i];
+    if (!page_pool_write(pp, r, r.fd, &r.file_off)) {
+        std::cerr << "[ERROR] write failed for region " << i << ": " << strerror(errno) << "\n";
+        return false;
+    }
+    return true;
+}
+
+// 把一行（不含 '\n'）加上 '\n' 追加到 region i 的 buffer 页（按需取页，可跨页）
+static bool region_append_line(PagePool &pp, std::vector<RegionOut> &outs, int i,
+                               const char *line, size_t len)
+{
+    auto flush = [&](int j) { return flush_region(pp, outs, j); };
+    return page_pool_append(pp, outs, i, line, len, flush) &&
+           page_pool_append(pp, outs, i, "\n", 1, flush);
+}
+
 int main(int argc, char **argv) {
-    if (argc < 4) {
-        std::cerr << "Usage: " << argv[0] << " <ref.fa> <aln.sam> <out_dir>\n";
+    // --drop-unmapped：unmapped / 不在 chr1-22,X,Y 上的记录直接丢弃（旧行为），
+    // 默认写到 out_dir/unmapped.sam，sw_sam_process 最后原样输出
+    // --buffer-mem：所有 region 共享的 buffer 页池大小（默认 1GB）
+    bool   drop_unmapped = false;
+    size_t buffer_mem    = DEFAULT_BUFFER_MEM;
+    int    argi = 1;
+    for (; argi < argc; ++argi) {
+        if (std::strcmp(argv[argi], "--drop-unmapped") == 0) {
+            drop_unmapped = true;
+        } else if (std::strcmp(argv[argi], "--buffer-mem") == 0 && argi + 1 < argc) {
+            if (!parse_mem_size(argv[++argi], buffer_mem)) {
+                std::cerr << "[ERROR] Bad --buffer-mem: " << argv[argi] << "\n";
+                return 1;
+            }
+        } else {
+            break;
+        }
+    }
+    if (argc - argi < 3) {
+        std::cerr << "Usage: " << argv[0]
+                  << " [--drop-unmapped] [--buffer-mem SIZE] <ref.fa> <aln.sam> <out_dir>\n";
         return 1;
     }
 
-    std::string fa_path = argv[1];
-    std::string sam_path = argv[2];
-    std::string out_dir  = argv[3];
+    std::string fa_path = argv[argi];
+    std::string sam_path = argv[argi + 1];
+    std::string out_dir  = argv[argi + 2];
 
     // 1) 尝试将 NOFILE 软限制设到 ~NUM_REGIONS（留点余量）
     set_nofile_limit(NUM_REGIONS + 128);
@@ -284,106 +365,149 @@ int main(int argc, char **argv) {
         std::cout << "[INFO] Wrote region info to " << info_path << "\n";
     }
 
-    // 5) 准备输出目录及 per-region 文件和 buffer
+    // 5) 准备输出目录及 per-region 文件；buffer 统一从页池取
     make_dir(out_dir);
 
-    std::vector<std::ofstream> region_files(NUM_REGIONS);
-    std::vector<std::string>  buffers(NUM_REGIONS);
-    for (int i = 0; i < NUM_REGIONS; ++i) {
-        const auto &rm = regions[i];
-        // 文件名格式：chr5_1_10000_88.sam
-        // 若 chr == "unknown"，也照样写出来，方便调试
-        std::string fname = out_dir + "/" + rm.chr + "_" +
-                            std::to_string(rm.start_pos) + "_" +
-                            std::to_string(rm.end_pos) + "_" +
-                            std::to_string(i) + ".sam";
-
-        region_files[i].open(fname, std::ios::out | std::ios::binary);
-        if (!region_files[i]) {
-            std::cerr << "[ERROR] Failed to open " << fname << " for write.\n";
+    // outs[NUM_REGIONS] 是 catch-all（--drop-unmapped 时不用）
+    const int CATCH_ALL = NUM_REGIONS;
+    std::vector<RegionOut> outs(NUM_REGIONS + 1);
+    for (int i = 0; i <= NUM_REGIONS; ++i) {
+        std::string fname;
+        if (i == CATCH_ALL) {
+            if (drop_unmapped) break;
+            fname = out_dir + "/" + SAM_CATCH_ALL_NAME;
+        } else {
+            const auto &rm = regions[i];
+            // 文件名格式：chr5_1_10000_88.sam
+            // 若 chr == "unknown"，也照样写出来，方便调试
+            fname = out_dir + "/" + rm.chr + "_" +
+                    std::to_string(rm.start_pos) + "_" +
+                    std::to_string(rm.end_pos) + "_" +
+                    std::to_string(i) + ".sam";
+        }
+        outs[i].fd = ::open(fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (outs[i].fd < 0) {
+            std::cerr << "[ERROR] Failed to open " << fname << " for write: " << strerror(errno) << "\n";
             return 1;
         }
-        buffers[i].reserve(BUF_SIZE);
     }
     std::cout << "[INFO] Opened " << NUM_REGIONS << " region files.\n";
 
+    PagePool pp;
+    page_pool_init(pp, buffer_mem);
+    std::cout << "[INFO] Buffer pool: " << pp.n_pages << " pages x " << (pp.page_size >> 10)
+              << "KB (" << (buffer_mem >> 20) << "MB)\n";
+
     // 6) 读取 SAM，按 region 分发
-    std::ifstream sam_in(sam_path);
+    // 支持 plain / gzip / BGZF 输入（见 sam_input.h）；按大块 fread，
+    // 在块内用 sam_fields_scan 一次切出行尾和前 3 个 tab、直接在块里取 RNAME / POS，逐条记录不再分配内存
+    FILE *sam_in = sam_input_open(sam_path);
     if (!sam_in) {
         std::cerr << "[ERROR] Failed to open SAM: " << sam_path << "\n";
         return 1;
     }
 
-    std::string line;
+    std::vector<char> block(READ_BLOCK);
+    size_t   carry = 0;          // 上一块末尾不完整的行，已挪到 block 开头
+    bool     eof   = false;
+    bool     ok    = true;
+    int      chrom_cache = -1;
     uint64_t total_reads = 0;
     uint64_t mapped_reads = 0;
     uint64_t unmapped_reads = 0;
 
-    while (std::getline(sam_in, line)) {
-        if (line.empty()) continue;
+    while (ok && !eof) {
+        if (carry == block.size()) block.resize(block.size() * 2);   // 超长行
+        size_t n = std::fread(block.data() + carry, 1, block.size() - carry, sam_in);
+        if (n == 0) eof = true;
+        size_t avail = carry + n;
+
+        const char *base = block.data();
+        size_t off = 0;
+        while (off < avail) {
+            const char *line = base + off;
+            SamFields   f;
+            sam_fields_scan(line, avail - off, 3, f);
+            if (!f.newline && !eof) break;    // 不完整，留到下一块
+            size_t len = f.len;
+            off += f.next;
+
+            if (len == 0) continue;
+
+            // SAM header：这里直接跳过
+            if (line[0] == '@') {
+                continue;
+            }
 
-        // SAM header：这里直接跳过
-        if (line[0] == '@') {
-            continue;
-        }
+            ++total_reads;
+
+            // 解析 RNAME 和 POS
+            // col1: QNAME
+            // col2: FLAG
+            // col3: RNAME
+            // col4: POS
+            const char *end = line + len;
+            if (f.n_tabs < 3) { ++unmapped_reads; continue; }
+
+            const char *rname   = line + f.tab[1] + 1;
+            size_t      rname_l = (size_t)(f.tab[2] - f.tab[1] - 1);
+            // 与原来的 atoi 一致：可选符号后取连续数字
+            const char *q   = line + f.tab[2] + 1;
+            bool        neg = false;
+            if (q < end && (*q == '-' || *q == '+')) neg = (*q++ == '-');
+            int pos = 0;
+            while (q < end && *q >= '0' && *q <= '9') pos = pos * 10 + (*q++ - '0');
+            if (neg) pos = -pos;
+
+            int rid = -1;
+            if (!(rname_l == 1 && rname[0] == '*') && pos > 0) {
+                const ChromInfo *ci = find_chrom(chrom_order, rname, rname_l, chrom_cache);
+                rid = coord_to_region(ci, pos, region_size, NUM_REGIONS);
+            }
+            if (rid < 0) {
+                ++unmapped_reads;
+                if (!drop_unmapped && !region_append_line(pp, outs, CATCH_ALL, line, len)) {
+                    ok = false;
+                    break;
+                }
+                continue;
+            }
+            ++mapped_reads;
 
-        ++total_reads;
-
-        // 解析 RNAME 和 POS
-        // col1: QNAME
-        // col2: FLAG
-        // col3: RNAME
-        // col4: POS
-        size_t t1 = line.find('\t');
-        if (t1 == std::string::npos) { ++unmapped_reads; continue; }
-        size_t t2 = line.find('\t', t1 + 1);
-        if (t2 == std::string::npos) { ++unmapped_reads; continue; }
-        size_t t3 = line.find('\t', t2 + 1);
-        if (t3 == std::string::npos) { ++unmapped_reads; continue; }
-        size_t t4 = line.find('\t', t3 + 1);
-        if (t4 == std::string::npos) t4 = line.size();
-
-        std::string rname = line.substr(t2 + 1, t3 - (t2 + 1));
-        std::string pos_str = line.substr(t3 + 1, t4 - (t3 + 1));
-        int pos = std::atoi(pos_str.c_str());
-        if (rname == "*" || pos <= 0) {
-            ++unmapped_reads;
-            continue;
+            // 往对应 region buffer 写一行（加 '\n'）
+            if (!region_append_line(pp, outs, rid, line, len)) {
+                ok = false;
+                break;
+            }
         }
 
-        int rid = coord_to_region(chroms, rname, pos, region_size, NUM_REGIONS);
-        if (rid < 0) {
-            ++unmapped_reads;
-            continue;
-        }
-        ++mapped_reads;
-
-        // 往对应 region buffer 写一行（加 '\n'）
-        std::string &buf = buffers[rid];
-        size_t need = line.size() + 1; // +1 for '\n'
-        if (buf.size() + need > BUF_SIZE) {
-            // flush
-            region_files[rid].write(buf.data(), buf.size());
-            buf.clear();
-        }
-        buf.append(line);
-        buf.push_back('\n');
+        carry = avail - off;
+        if (carry > 0 && off > 0) std::memmove(block.data(), block.data() + off, carry);
     }
 
-    sam_in.close();
+    bool read_ok = !std::ferror(sam_in);
+    if (std::fclose(sam_in) != 0) read_ok = false;
+    if (!read_ok) {
+        std::cerr << "[ERROR] Failed to read SAM: " << sam_path << "\n";
+        return 1;
+    }
 
     // flush 所有剩余 buffer
-    for (int i = 0; i < NUM_REGIONS; ++i) {
-        if (!buffers[i].empty()) {
-            region_files[i].write(buffers[i].data(), buffers[i].size());
-        }
-        region_files[i].close();
+    for (int i = 0; i <= NUM_REGIONS; ++i) {
+        if (outs[i].fd < 0) continue;
+        if (ok && !flush_region(pp, outs, i)) ok = false;
+        if (::close(outs[i].fd) != 0) ok = false;
+    }
+    if (!ok) {
+        std::cerr << "[ERROR] Failed to write region files under " << out_dir << "\n";
+        return 1;
     }
 
     std::cout << "[INFO] Done.\n";
     std::cout << "  total_reads    = " << total_reads << "\n";
     std::cout << "  mapped_reads   = " << mapped_reads << "\n";
     std::cout << "  unmapped_reads = " << unmapped_reads << "\n";
+    std::cout << "  flushes        = " << pp.n_flushes << " (pool full: " << pp.n_pressure << ")\n";
 
     return 0;
 }
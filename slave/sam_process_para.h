@@ -4,11 +4,65 @@
 #ifndef SAM_PROCESS_PARA_H
 #define SAM_PROCESS_PARA_H
 
+#include <stdint.h>
+
 // 处理模式
 #define MODE_SORT_ONLY      1
 #define MODE_MARKDUP_ONLY   2
 #define MODE_ALL            3  // sort + markdup
 
+// splitter 把 unmapped（RNAME 为 '*' 或 POS <= 0）以及不在任何 region 内的记录
+// 按输入顺序写进这个文件；sw_sam_process 不排序不去重，原样放到输出目录，且最后处理。
+#define SAM_CATCH_ALL_NAME  "unmapped.sam"
+
+// ---------------- region 文件的二进制 sidecar 索引 ----------------
+// pre-tools 的 splitter（auto_region / split_from_region 加 --sidecar）为每个
+// region 文件 xxx.sam 额外写一个 xxx.sidx：一个 SamIdxHeader 加 n_records 个定长
+// SamIdxEntry（顺序与 SAM 文件中的记录顺序一致），最后是本文件的 RNAME 名表
+// （n_rnames 个 uint32 长度 + 名字字节，共 rnames_bytes 字节）。
+// sw_sam_process 读到 sidecar 时，从核直接用这些字段排序/去重，不再解析文本：
+// 主核把 sort_rname 从名表下标换成名字的字节序名次，从核按 (名次, sort_pos) 排序。
+#define SAM_IDX_MAGIC    0x58444953u   // "SIDX"
+#define SAM_IDX_VERSION  2
+#define SAM_IDX_SUFFIX   ".sidx"
+
+typedef struct {
+    uint32_t magic;          // SAM_IDX_MAGIC
+    uint32_t version;        // SAM_IDX_VERSION
+    uint64_t n_records;      // 记录条数
+    uint64_t data_offset;    // 第一条记录在 SAM 文件中的偏移（即 header 字节数）
+    uint32_t n_rnames;       // 名表中的名字数
+    uint32_t rnames_bytes;   // 名表字节数
+} SamIdxHeader;
+
+typedef struct {
+    uint64_t line_offset;    // 行首在 region SAM 文件中的偏移
+    uint32_t line_len;       // 行长度（不含 '\n'）
+    uint32_t flag_off;       // FLAG 字段相对行首的偏移
+    uint32_t qual_off;       // QUAL 字段相对行首的偏移
+    uint32_t qual_len;       // QUAL 字段长度
+    int32_t  tid;            // RNAME 的 contig id（@SQ 顺序），'*' 为 -1
+    int32_t  pos;            // POS
+    int32_t  mate_tid;       // RNEXT 的 contig id（'=' 已展开）
+    int32_t  mate_pos;       // PNEXT
+    uint16_t flag;           // FLAG
+    uint16_t flag_len;       // FLAG 字段长度
+    uint32_t valid;          // 1: 至少 11 列（可参与去重）；0: 列数不足
+    // 排序键，与文本路径的 RNAME+POS 解析（含行尾 '\r'，POS 必须是整数）一致
+    int32_t  sort_rname;     // RNAME 在名表中的下标；-1: 解析不出 RNAME+POS（排在最前）
+    uint32_t line_tail;      // line_len 之后到下一行之前的字节数（行尾的 '\r' 和 '\n'）
+    int64_t  sort_pos;       // 排序用的 POS
+} SamIdxEntry;               // 64 字节
+
+// 从核按解析时的统计为每个文件选用的排序方式（写回 SamProcessPara.sort_algo）
+#define SORT_ALGO_NONE      0  // 没有排序（仅去重 / SO:coordinate / 行数不足 2）
+#define SORT_ALGO_SORTED    1  // 解析时发现已经有序，不用排序
+#define SORT_ALGO_MERGE     2  // 少数几个有序段：自然归并
+#define SORT_ALGO_COUNTING  3  // 单 contig 且 POS 跨度不大于行数的常数倍：计数排序
+#define SORT_ALGO_RADIX     4  // 单 contig：按 POS 做 LSD 基数排序
+#define SORT_ALGO_INTRO     5  // 多 contig 等其它情况：introsort
+#define SORT_ALGO_NUM       6
+
 typedef struct {
     char   *in_buf;       // 输入 SAM buffer
     char   *out_buf;      // 输出 SAM buffer（处理后的结果）
@@ -16,6 +70,15 @@ typedef struct {
     unsigned long out_buf_capacity; // 输出 buffer 容量（可能大于 size）
     unsigned long *out_size; // CPE 处理完后写回输出长度
     int     mode;         // 处理模式：MODE_SORT_ONLY, MODE_MARKDUP_ONLY, MODE_ALL
+    int     presorted;    // 1: 输入 header 为 SO:coordinate；从核确认确实有序后才跳过排序
+    SamIdxEntry  *idx;    // 可选：该文件的 sidecar 记录（为空则解析文本）
+    unsigned long idx_count;       // sidecar 记录条数
+    unsigned long idx_data_offset; // header 字节数（sidecar 中的 data_offset）
+    // 以下由从核写回，主核打印到运行统计里
+    int     sort_algo;            // SORT_ALGO_*
+    unsigned long sort_runs;      // 输入中按排序键非降序的段数
+    unsigned long sort_distinct;  // 不同 POS 数的估计（相邻记录 POS 变化次数 + 1，乱序时偏大）
+    long    sort_span;            // 单 contig 时 POS 的跨度（max - min），否则为 -1
 } SamProcessPara;
 
 #endif // SAM_PROCESS_PARA_H
@@ -21,33 +21,36 @@
 typedef struct {
     unsigned long start;      // 在 in_buf 中的起始偏移
     unsigned long len;        // 这一行长度（包含 '\n' 如果有）
-    const char   *rname;      // RNAME 指针（指向 in_buf 内部）
+    const char   *rname;      // RNAME 指针（指向 in_buf 内部）；sidecar 路径下为空
     int           rname_len;  // RNAME 长度
+    int           rname_rank; // sidecar 路径下 RNAME 在本文件里的字节序名次（文本路径为 -1）
+    int           rec_id;     // sidecar 路径下对应的 SamIdxEntry 下标
     long          pos;        // POS
     int           valid;      // 是否成功解析出 RNAME+POS
 } LineInfo;
 
 // 解析一行（不含 '\n'）的 RNAME + POS
-static void parse_rname_pos(char *line_start, unsigned long text_len, LineInfo *info)
+static void parse_rname_pos(const char *line_start, unsigned long text_len, LineInfo *info)
 {
-    info->rname     = 0;
-    info->rname_len = 0;
-    info->pos       = -1;
-    info->valid     = 0;
+    info->rname      = 0;
+    info->rname_len  = 0;
+    info->rname_rank = -1;
+    info->pos        = -1;
+    info->valid      = 0;
 
     if (text_len == 0) return;
 
-    char *p   = line_start;
-    char *end = line_start + text_len;
+    const char *p   = line_start;
+    const char *end = line_start + text_len;
 
     // SAM: 0:QNAME, 1:FLAG, 2:RNAME, 3:POS, ...
     int   field = 0;
-    char *field_start = p;
+    const char *field_start = p;
 
-    char *rname_start = 0;
-    char *rname_end   = 0;
-    char *pos_start   = 0;
-    char *pos_end     = 0;
+    const char *rname_start = 0;
+    const char *rname_end   = 0;
+    const char *pos_start   = 0;
+    const char *pos_end     = 0;
 
     while (p <= end) {
         if (p == end || *p == '\t') {
@@ -76,7 +79,7 @@ static void parse_rname_pos(char *line_start, unsigned long text_len, LineInfo *
 
     // 解析 POS
     long value = 0;
-    char *q    = pos_start;
+    const char *q    = pos_start;
     int   neg  = 0;
     if (q < pos_end && *q == '-') {
         neg = 1;
@@ -99,9 +102,14 @@ static void parse_rname_pos(char *line_start, unsigned long text_len, LineInfo *
     info->valid = 1;
 }
 
-// 比较 RNAME（字典序）
+// 比较 RNAME（字典序）；sidecar 路径下名次与字节序一致，直接比名次
 static int cmp_rname(const LineInfo *a, const LineInfo *b)
 {
+    if (!a->rname && !b->rname) {
+        if (a->rname_rank < b->rname_rank) return -1;
+        if (a->rname_rank > b->rname_rank) return 1;
+        return 0;
+    }
     int len = (a->rname_len < b->rname_len) ? a->rname_len : b->rname_len;
     int r = 0;
     if (len > 0) r = memcmp(a->rname, b->rname, (unsigned long)len);
@@ -136,31 +144,319 @@ static int cmp_line(const LineInfo *a, const LineInfo *b)
     return 0;
 }
 
-// 快速排序（原地）
-static void quicksort_lineinfo(LineInfo *arr, int left, int right)
+// ==================== 排序方式的自动选择 ====================
+//
+// 排序键 (valid, RNAME, POS, start) 是全序，不同排序方式的结果完全相同，
+// 所以按每个文件的数据形态挑最省的一种：
+//   - 已经有序（常见于按坐标比对输出后再切分的 region）：不排序；
+//   - 少数几个有序段：自然归并；
+//   - 单 contig、POS 跨度不大于行数的常数倍（扩增子等大量记录同一 POS）：计数排序；
+//   - 单 contig：按 POS 做 LSD 基数排序；
+//   - 其它（多 contig、行数很少等）：introsort。
+// 统计在解析时顺带完成，每行只多一次 cmp_line。
+// 计数 / 基数排序按 POS 稳定排序，依赖输入顺序就是 start 递增顺序（统计时检查）。
+// 需要的临时内存分配失败时退回原地的 introsort。
+
+#define SORT_MERGE_MAX_RUNS  16   // 有序段不超过这么多时用自然归并
+#define SORT_COUNT_SPAN_MUL  4    // POS 跨度 <= 4 * 行数时用计数排序
+#define SORT_INSERTION_MAX   16   // introsort 中不超过这么长的区间用插入排序
+#define SORT_SMALL_MAX       64   // 行数不超过这么多时直接 introsort（基本就是插入排序），不分配临时内存
+
+typedef struct {
+    int           n;               // 已统计的行数
+    int           n_invalid;       // 解析失败的行数
+    unsigned long runs;            // 按 cmp_line 非降序的段数
+    unsigned long distinct;        // 相邻 valid 行 POS 变化次数 + 1（乱序时偏大）
+    int           single_rname;    // 所有 valid 行 RNAME 相同
+    int           start_in_order;  // start 严格递增
+    LineInfo      first;           // 第一条 valid 行（n > n_invalid 时有效）
+    long          pos_min;
+    long          pos_max;
+    long          last_pos;
+    int           algo;            // sort_lines 选用的 SORT_ALGO_*
+} SortStats;
+
+static void sort_stats_init(SortStats *st)
+{
+    memset(st, 0, sizeof(SortStats));
+    st->single_rname   = 1;
+    st->start_in_order = 1;
+    st->algo           = SORT_ALGO_NONE;
+}
+
+// 统计一行；prev 为上一行（第一行为 0）
+static void sort_stats_add(SortStats *st, const LineInfo *prev, const LineInfo *cur)
+{
+    if (!prev) {
+        st->runs = 1;
+    } else {
+        if (cmp_line(prev, cur) > 0) st->runs++;
+        if (cur->start <= prev->start) st->start_in_order = 0;
+    }
+    st->n++;
+
+    if (!cur->valid) {
+        st->n_invalid++;
+        return;
+    }
+    if (st->n - st->n_invalid == 1) {
+        st->first     = *cur;
+        st->pos_min   = cur->pos;
+        st->pos_max   = cur->pos;
+        st->last_pos  = cur->pos;
+        st->distinct  = 1;
+        return;
+    }
+    if (st->single_rname && cmp_rname(cur, &st->first) != 0) st->single_rname = 0;
+    if (cur->pos < st->pos_min) st->pos_min = cur->pos;
+    if (cur->pos > st->pos_max) st->pos_max = cur->pos;
+    if (cur->pos != st->last_pos) st->distinct++;
+    st->last_pos = cur->pos;
+}
+
+static void insertion_sort_lineinfo(LineInfo *arr, int left, int right)
+{
+    int i, j;
+    for (i = left + 1; i <= right; ++i) {
+        LineInfo x = arr[i];
+        for (j = i - 1; j >= left && cmp_line(&arr[j], &x) > 0; --j) arr[j + 1] = arr[j];
+        arr[j + 1] = x;
+    }
+}
+
+static void sift_down_lineinfo(LineInfo *arr, int root, int n)
+{
+    LineInfo x = arr[root];
+    for (;;) {
+        int c = 2 * root + 1;
+        if (c >= n) break;
+        if (c + 1 < n && cmp_line(&arr[c], &arr[c + 1]) < 0) ++c;
+        if (cmp_line(&x, &arr[c]) >= 0) break;
+        arr[root] = arr[c];
+        root = c;
+    }
+    arr[root] = x;
+}
+
+static void heapsort_lineinfo(LineInfo *arr, int n)
+{
+    int i;
+    for (i = n / 2 - 1; i >= 0; --i) sift_down_lineinfo(arr, i, n);
+    for (i = n - 1; i > 0; --i) {
+        LineInfo tmp = arr[0];
+        arr[0] = arr[i];
+        arr[i] = tmp;
+        sift_down_lineinfo(arr, 0, i);
+    }
+}
+
+// introsort（原地）：中位 pivot 的快速排序，递归过深时改用堆排序，小区间插入排序；
+// 只对较短的一侧递归，栈深度不超过 log2(n)
+static void introsort_lineinfo(LineInfo *arr, int left, int right, int depth)
+{
+    while (right - left + 1 > SORT_INSERTION_MAX) {
+        if (depth-- <= 0) {
+            heapsort_lineinfo(arr + left, right - left + 1);
+            return;
+        }
+        int i = left;
+        int j = right;
+        LineInfo pivot = arr[(left + right) / 2];
+
+        while (i <= j) {
+            while (cmp_line(&arr[i], &pivot) < 0) ++i;
+            while (cmp_line(&arr[j], &pivot) > 0) --j;
+            if (i <= j) {
+                LineInfo tmp = arr[i];
+                arr[i] = arr[j];
+                arr[j] = tmp;
+                ++i;
+                --j;
+            }
+        }
+        if (j - left < right - i) {
+            introsort_lineinfo(arr, left, j, depth);
+            left = i;
+        } else {
+            introsort_lineinfo(arr, i, right, depth);
+            right = j;
+        }
+    }
+    insertion_sort_lineinfo(arr, left, right);
+}
+
+// 自然归并：找出有序段后两两归并（段数 <= SORT_MERGE_MAX_RUNS）；失败返回 -1
+static int natural_merge_lineinfo(LineInfo *arr, int n)
 {
-    int i = left;
-    int j = right;
-    LineInfo pivot = arr[(left + right) / 2];
-
-    while (i <= j) {
-        while (cmp_line(&arr[i], &pivot) < 0) ++i;
-        while (cmp_line(&arr[j], &pivot) > 0) --j;
-        if (i <= j) {
-            LineInfo tmp = arr[i];
-            arr[i] = arr[j];
-            arr[j] = tmp;
-            ++i;
-            --j;
+    int bounds[SORT_MERGE_MAX_RUNS + 1];
+    int n_runs = 0;
+    int i;
+
+    bounds[n_runs++] = 0;
+    for (i = 1; i < n; ++i) {
+        if (cmp_line(&arr[i - 1], &arr[i]) > 0) {
+            if (n_runs > SORT_MERGE_MAX_RUNS - 1) return -1;
+            bounds[n_runs++] = i;
         }
     }
-    if (left < j)  quicksort_lineinfo(arr, left, j);
-    if (i < right) quicksort_lineinfo(arr, i, right);
+    bounds[n_runs] = n;
+
+    LineInfo *tmp = (LineInfo*)malloc(sizeof(LineInfo) * (unsigned long)n);
+    if (!tmp) return -1;
+
+    LineInfo *src = arr;
+    LineInfo *dst = tmp;
+    while (n_runs > 1) {
+        int r, out_runs = 0;
+        for (r = 0; r < n_runs; r += 2) {
+            int lo  = bounds[r];
+            int mid = bounds[r + 1];
+            int hi  = (r + 2 <= n_runs) ? bounds[r + 2] : mid;   // 落单的最后一段原样拷过去
+            int a = lo, b = mid, k = lo;
+            while (a < mid && b < hi) {
+                if (cmp_line(&src[b], &src[a]) < 0) dst[k++] = src[b++];
+                else                                dst[k++] = src[a++];
+            }
+            while (a < mid) dst[k++] = src[a++];
+            while (b < hi)  dst[k++] = src[b++];
+            bounds[out_runs++] = lo;
+        }
+        bounds[out_runs] = n;
+        n_runs = out_runs;
+        LineInfo *t = src;
+        src = dst;
+        dst = t;
+    }
+    if (src != arr) memcpy(arr, src, sizeof(LineInfo) * (unsigned long)n);
+    free(tmp);
+    return 0;
 }
 
-// 解析一个 buffer 里的所有 SAM 行
-static int parse_sam_lines(char *buf, unsigned long size, LineInfo **lines_out)
+// 计数排序（单 contig，POS 跨度小）：解析失败的行在最前，其余按 POS 稳定分桶；失败返回 -1
+static int counting_sort_lineinfo(LineInfo *arr, int n, const SortStats *st)
 {
+    unsigned long span = (unsigned long)(st->pos_max - st->pos_min);
+    int *cnt = (int*)calloc(span + 2, sizeof(int));
+    LineInfo *tmp = (LineInfo*)malloc(sizeof(LineInfo) * (unsigned long)n);
+    if (!cnt || !tmp) {
+        if (cnt) free(cnt);
+        if (tmp) free(tmp);
+        return -1;
+    }
+
+    int i;
+    for (i = 0; i < n; ++i) {
+        if (arr[i].valid) cnt[arr[i].pos - st->pos_min + 1]++;
+    }
+    cnt[0] = st->n_invalid;
+    unsigned long b;
+    for (b = 1; b <= span + 1; ++b) cnt[b] += cnt[b - 1];
+
+    int n_inv = 0;
+    for (i = 0; i < n; ++i) {
+        if (!arr[i].valid) tmp[n_inv++] = arr[i];
+        else               tmp[cnt[arr[i].pos - st->pos_min]++] = arr[i];
+    }
+    memcpy(arr, tmp, sizeof(LineInfo) * (unsigned long)n);
+    free(cnt);
+    free(tmp);
+    return 0;
+}
+
+// LSD 基数排序（单 contig）：键为 (POS - pos_min) << 32 | 行下标，每趟 8 bit，
+// 只排 POS 跨度需要的位数，最后按下标搬一次 LineInfo；失败返回 -1
+static int radix_sort_lineinfo(LineInfo *arr, int n, const SortStats *st)
+{
+    unsigned long span = (unsigned long)(st->pos_max - st->pos_min);
+    if (span > 0xFFFFFFFFUL) return -1;
+
+    int n_valid = n - st->n_invalid;
+    uint64_t *keys = (uint64_t*)malloc(sizeof(uint64_t) * (unsigned long)n_valid * 2);
+    LineInfo *tmp  = (LineInfo*)malloc(sizeof(LineInfo) * (unsigned long)n);
+    if (!keys || !tmp) {
+        if (keys) free(keys);
+        if (tmp) free(tmp);
+        return -1;
+    }
+    uint64_t *src = keys;
+    uint64_t *dst = keys + n_valid;
+
+    int i, k = 0, n_inv = 0;
+    for (i = 0; i < n; ++i) {
+        if (!arr[i].valid) tmp[n_inv++] = arr[i];
+        else src[k++] = ((uint64_t)(arr[i].pos - st->pos_min) << 32) | (uint32_t)i;
+    }
+
+    int shift;
+    for (shift = 32; shift < 64 && (span >> (shift - 32)) != 0; shift += 8) {
+        int cnt[256];
+        memset(cnt, 0, sizeof(cnt));
+        for (i = 0; i < n_valid; ++i) cnt[(src[i] >> shift) & 0xFF]++;
+        int sum = 0, d;
+        for (d = 0; d < 256; ++d) {
+            int c = cnt[d];
+            cnt[d] = sum;
+            sum += c;
+        }
+        for (i = 0; i < n_valid; ++i) dst[cnt[(src[i] >> shift) & 0xFF]++] = src[i];
+        uint64_t *t = src;
+        src = dst;
+        dst = t;
+    }
+
+    for (i = 0; i < n_valid; ++i) tmp[n_inv + i] = arr[(uint32_t)src[i]];
+    memcpy(arr, tmp, sizeof(LineInfo) * (unsigned long)n);
+    free(keys);
+    free(tmp);
+    return 0;
+}
+
+// 按统计选排序方式，结果记到 st->algo
+static void sort_lines(LineInfo *arr, int n, SortStats *st)
+{
+    if (n < 2) {
+        st->algo = SORT_ALGO_NONE;
+        return;
+    }
+    if (st->runs <= 1) {
+        st->algo = SORT_ALGO_SORTED;
+        return;
+    }
+    if (n > SORT_SMALL_MAX && st->runs <= SORT_MERGE_MAX_RUNS && natural_merge_lineinfo(arr, n) == 0) {
+        st->algo = SORT_ALGO_MERGE;
+        return;
+    }
+    if (n > SORT_SMALL_MAX && st->n > st->n_invalid && st->single_rname && st->start_in_order) {
+        unsigned long span = (unsigned long)(st->pos_max - st->pos_min);
+        if (span <= (unsigned long)n * SORT_COUNT_SPAN_MUL &&
+            counting_sort_lineinfo(arr, n, st) == 0) {
+            st->algo = SORT_ALGO_COUNTING;
+            return;
+        }
+        if (radix_sort_lineinfo(arr, n, st) == 0) {
+            st->algo = SORT_ALGO_RADIX;
+            return;
+        }
+    }
+    int depth = 0, m;
+    for (m = n; m > 1; m >>= 1) depth += 2;
+    introsort_lineinfo(arr, 0, n - 1, depth);
+    st->algo = SORT_ALGO_INTRO;
+}
+
+// 把排序方式和统计写回 para，主核打印到运行统计里
+static void sort_report(SamProcessPara *para, const SortStats *st)
+{
+    para->sort_algo     = st->algo;
+    para->sort_runs     = st->runs;
+    para->sort_distinct = st->distinct;
+    para->sort_span     = (st->n > st->n_invalid && st->single_rname) ? st->pos_max - st->pos_min : -1;
+}
+
+// 解析一个 buffer 里的所有 SAM 行，顺带统计 st 供 sort_lines 选排序方式
+static int parse_sam_lines(char *buf, unsigned long size, LineInfo **lines_out, SortStats *st)
+{
+    sort_stats_init(st);
     *lines_out = 0;
     if (size == 0) return 0;
 
@@ -201,6 +497,7 @@ static int parse_sam_lines(char *buf, unsigned long size, LineInfo **lines_out)
         lines[idx].len   = len;
         lines[idx].rname = 0;
         lines[idx].rname_len = 0;
+        lines[idx].rname_rank = -1;
         lines[idx].pos   = -1;
         lines[idx].valid = 0;
 
@@ -208,6 +505,7 @@ static int parse_sam_lines(char *buf, unsigned long size, LineInfo **lines_out)
         if (text_len > 0) {
             parse_rname_pos(buf + start, text_len, &lines[idx]);
         }
+        sort_stats_add(st, idx > 0 ? &lines[idx - 1] : 0, &lines[idx]);
         idx++;
     }
 
@@ -215,6 +513,43 @@ static int parse_sam_lines(char *buf, unsigned long size, LineInfo **lines_out)
     return idx;
 }
 
+// 按排序结果把一行追加到 out_buf。输入最后一行没有 '\n' 时补一个，
+// 否则它排到中间后会和下一行连成一行。放不下返回 -1
+static int copy_sorted_line(char *out_buf, unsigned long *out_pos, unsigned long cap,
+                            const char *in_buf, const LineInfo *line)
+{
+    unsigned long len = line->len;
+    int add_nl = (in_buf[line->start + len - 1] != '\n');
+    if (*out_pos + len + (unsigned long)add_nl > cap) return -1;
+    memcpy(out_buf + *out_pos, in_buf + line->start, len);
+    *out_pos += len;
+    if (add_nl) out_buf[(*out_pos)++] = '\n';
+    return 0;
+}
+
+// header 标了 SO:coordinate 的输入：逐行确认确实按 cmp_line 有序（只解析 RNAME+POS，
+// 遇到第一处逆序就返回 0）。SO 可能是比对程序写的、或被切分 / 合并原样抄过来的，
+// 不能只凭 header 跳过排序
+static int lines_in_order(const char *buf, unsigned long size)
+{
+    LineInfo cur, prev;
+    int have_prev = 0;
+    unsigned long i = 0;
+    while (i < size) {
+        unsigned long start = i;
+        while (i < size && buf[i] != '\n') ++i;
+        cur.start = start;
+        cur.len   = i - start;
+        parse_rname_pos(buf + start, i - start, &cur);
+        if (i < size) ++i;
+
+        if (have_prev && cmp_line(&prev, &cur) > 0) return 0;
+        prev = cur;
+        have_prev = 1;
+    }
+    return 1;
+}
+
 // ==================== SAM 去重相关结构和函数 ====================
 
 /* SAM flags */
@@ -245,23 +580,72 @@ typedef struct {
     uint32_t flag_offset;   /* offset of FLAG field */
     int32_t  pos;           /* position */
     int32_t  mate_pos;      /* mate position */
-    uint16_t line_len;      /* line length */
+    uint16_t line_len;      /* line length (REC_LONG: see long_recs) */
     uint16_t flag_len;      /* FLAG field length */
     int16_t  tid;           /* reference ID */
     int16_t  mate_tid;      /* mate reference ID */
     uint16_t flag;          /* original FLAG */
-    uint16_t score;         /* quality score (truncated) */
+    uint16_t qual_off;      /* QUAL offset from line start (REC_LONG: index into long_recs) */
     uint8_t  orientation;   /* orientation for duplicate detection */
     uint8_t  is_duplicate;  /* 0/1: marked as duplicate */
 } sam_record_t;
 
+/* 长读长（ONT / PacBio）记录的行长度可以超过 64KB。
+   这类记录 line_len 记为 REC_LONG，真实长度和 QUAL 偏移放在旁表 long_recs[qual_off] 里，
+   常见的短读长记录仍是 32 字节。
+   质量分数不预先计算：只有去重扫描中遇到同 key 的多条记录时才按 QUAL 现算（见 rec_score）。 */
+#define REC_LONG 0xFFFFu
+
+typedef struct {
+    uint32_t line_len;      /* line length */
+    uint32_t qual_off;      /* QUAL offset from line start */
+} long_rec_t;
+
 typedef struct {
     sam_record_t *records;
     int count;
     int capacity;
     ref_map_t ref_map;
+    long_rec_t *long_recs;  /* side table for REC_LONG records */
+    int long_count;
+    int long_capacity;
 } record_list_t;
 
+static uint32_t rec_line_len(const record_list_t *list, const sam_record_t *rec) {
+    if (rec->line_len == REC_LONG) return list->long_recs[rec->qual_off].line_len;
+    return rec->line_len;
+}
+
+static uint32_t rec_qual_off(const record_list_t *list, const sam_record_t *rec) {
+    if (rec->line_len == REC_LONG) return list->long_recs[rec->qual_off].qual_off;
+    return rec->qual_off;
+}
+
+/* 记录行长度和 QUAL 偏移；行长放不进 16 位时登记到旁表。失败返回 -1 */
+static int rec_set_len_qual(record_list_t *list, sam_record_t *rec,
+                            unsigned long len, unsigned long qual_off) {
+    if (len < REC_LONG) {
+        rec->line_len = (uint16_t)len;
+        rec->qual_off = (uint16_t)qual_off;
+        return 0;
+    }
+    if (len > 0xFFFFFFFFUL) return -1;
+    if (list->long_count >= list->long_capacity) {
+        if (list->long_capacity >= (int)REC_LONG) return -1;
+        int new_cap = list->long_capacity ? list->long_capacity * 2 : 64;
+        if (new_cap > (int)REC_LONG) new_cap = (int)REC_LONG;
+        long_rec_t *p = realloc(list->long_recs, new_cap * sizeof(long_rec_t));
+        if (!p) return -1;
+        list->long_recs = p;
+        list->long_capacity = new_cap;
+    }
+    list->long_recs[list->long_count].line_len = (uint32_t)len;
+    list->long_recs[list->long_count].qual_off = (uint32_t)qual_off;
+    rec->line_len = (uint16_t)REC_LONG;
+    rec->qual_off = (uint16_t)list->long_count++;
+    return 0;
+}
+
 /* Get or create reference ID from name */
 static int get_ref_id(ref_map_t *map, const char *rname, int len) {
     /* Special cases */
@@ -299,6 +683,9 @@ static record_list_t *record_list_init(void) {
     }
     list->count = 0;
     list->ref_map.count = 0;
+    list->long_recs = NULL;
+    list->long_count = 0;
+    list->long_capacity = 0;
 
     return list;
 }
@@ -307,13 +694,14 @@ static record_list_t *record_list_init(void) {
 static void record_list_free(record_list_t *list) {
     if (!list) return;
     free(list->records);
+    free(list->long_recs);
     free(list);
 }
 
-/* Calculate quality score from quality string */
-static int64_t calc_score(const char *qual, int len) {
+/* Calculate quality score from quality string (per-base cap, so at most 15 * len) */
+static int64_t calc_score(const char *qual, unsigned long len) {
     int64_t score = 0;
-    for (int i = 0; i < len; i++) {
+    for (unsigned long i = 0; i < len; i++) {
         int q = qual[i] - 33;  /* Phred+33 */
         if (q > 15) q = 15;    /* Cap at 15 as per markdup spec */
         if (q > 0) score += q;
@@ -323,7 +711,8 @@ static int64_t calc_score(const char *qual, int len) {
 
 /* Parse one line of SAM - extract only fields needed for duplicate detection */
 static int parse_sam_line_markdup(const char *line, unsigned long line_offset, int len, 
-                   sam_record_t *rec, ref_map_t *ref_map) {
+                   sam_record_t *rec, record_list_t *list) {
+    ref_map_t *ref_map = &list->ref_map;
     const char *p = line;
     const char *end = line + len;
     int field = 0;
@@ -331,9 +720,10 @@ static int parse_sam_line_markdup(const char *line, unsigned long line_offset, i
     
     memset(rec, 0, sizeof(sam_record_t));
     rec->line_offset = (uint32_t)line_offset;
-    rec->line_len = (uint16_t)len;
     
-    while (p < end && field < 11) {
+    /* Stop at the start of QUAL: its length and score are only needed
+       for records in duplicate groups (see rec_score) */
+    while (p < end && field < 10) {
         if (*p == '\t' || p == end - 1) {
             int field_len = (p == end - 1 && *p != '\t') ? (end - field_start) : (p - field_start);
             
@@ -363,15 +753,6 @@ static int parse_sam_line_markdup(const char *line, unsigned long line_offset, i
                 case 7: /* PNEXT */
                     rec->mate_pos = (int32_t)atoi(field_start);
                     break;
-                    
-                case 10: /* QUAL */
-                    {
-                        int64_t s = calc_score(field_start, field_len);
-                        if (s < 0) s = 0;
-                        if (s > 65535) s = 65535;
-                        rec->score = (uint16_t)s;
-                    }
-                    break;
             }
             
             field++;
@@ -386,7 +767,21 @@ static int parse_sam_line_markdup(const char *line, unsigned long line_offset, i
         rec->orientation |= ((rec->flag & BAM_FMREVERSE) ? 1 : 0) << 1;
     }
     
-    return (field >= 11) ? 0 : -1;
+    /* At least 11 fields: something must follow the 10th tab */
+    if (field < 10 || field_start >= end) return -1;
+    if (rec_set_len_qual(list, rec, (unsigned long)len, (unsigned long)(field_start - line)) < 0)
+        return -2;  /* out of memory */
+    return 0;
+}
+
+/* Quality score of a record, computed on demand from its QUAL field
+   (QUAL ends at the next tab or at the end of the line) */
+static int64_t rec_score(const char *in_buf, const record_list_t *list, const sam_record_t *rec) {
+    uint32_t len = rec_line_len(list, rec);
+    uint32_t qo  = rec_qual_off(list, rec);
+    const char *qual = in_buf + rec->line_offset + qo;
+    const char *tab  = (const char *)memchr(qual, '\t', len - qo);
+    return calc_score(qual, tab ? (unsigned long)(tab - qual) : (unsigned long)(len - qo));
 }
 
 /* Comparison function for sorting records by position */
@@ -403,13 +798,19 @@ static int compare_records(const void *a, const void *b) {
     return 0;
 }
 
-/* Mark duplicates by sorting instead of hashing - saves memory! */
-static void mark_duplicates_sorted(record_list_t *list) {
-    if (list->count <= 1) return;
-    
-    /* Sort records by position */
-    qsort(list->records, list->count, sizeof(sam_record_t), compare_records);
-    
+/* Same key as compare_records, ties broken by input offset (deterministic) */
+static int compare_records_stable(const void *a, const void *b) {
+    int r = compare_records(a, b);
+    if (r != 0) return r;
+    const sam_record_t *ra = (const sam_record_t *)a;
+    const sam_record_t *rb = (const sam_record_t *)b;
+    if (ra->line_offset != rb->line_offset) return (ra->line_offset < rb->line_offset) ? -1 : 1;
+    return 0;
+}
+
+/* Scan records already sorted by compare_records and mark duplicates.
+   Scores are only computed for groups with more than one record. */
+static void mark_duplicates_scan(record_list_t *list, const char *in_buf) {
     /* Scan sorted array to find duplicates */
     int i = 0;
     while (i < list->count) {
@@ -421,13 +822,17 @@ static void mark_duplicates_sorted(record_list_t *list) {
         
         /* Find all records with same key */
         int best = i;
+        int64_t best_score = -1;
         int j = i + 1;
         
         while (j < list->count && compare_records(&list->records[i], &list->records[j]) == 0) {
             /* Same position - keep the one with highest score */
-            if (list->records[j].score > list->records[best].score) {
+            if (best_score < 0) best_score = rec_score(in_buf, list, &list->records[best]);
+            int64_t score = rec_score(in_buf, list, &list->records[j]);
+            if (score > best_score) {
                 list->records[best].is_duplicate = 1;
                 best = j;
+                best_score = score;
             } else {
                 list->records[j].is_duplicate = 1;
             }
@@ -438,10 +843,20 @@ static void mark_duplicates_sorted(record_list_t *list) {
     }
 }
 
+/* Mark duplicates by sorting instead of hashing - saves memory! */
+static void mark_duplicates_sorted(record_list_t *list, const char *in_buf) {
+    if (list->count <= 1) return;
+    
+    /* Sort records by position */
+    qsort(list->records, list->count, sizeof(sam_record_t), compare_records_stable);
+    
+    mark_duplicates_scan(list, in_buf);
+}
+
 /* Write SAM record with modified FLAG */
 static int write_sam_record(const char *in_buf, char *out_buf, 
                      unsigned long *out_pos, unsigned long out_capacity, 
-                     sam_record_t *rec) {
+                     const record_list_t *list, const sam_record_t *rec) {
     unsigned long needed;
     char flag_str[32];
     int flag_str_len;
@@ -454,8 +869,10 @@ static int write_sam_record(const char *in_buf, char *out_buf,
     
     flag_str_len = snprintf(flag_str, sizeof(flag_str), "%d", new_flag);
     
+    unsigned long line_len = rec_line_len(list, rec);
+
     /* Calculate space needed */
-    needed = rec->line_len - rec->flag_len + flag_str_len + 1;  /* +1 for newline */
+    needed = line_len - rec->flag_len + flag_str_len + 1;  /* +1 for newline */
     
     if (*out_pos + needed > out_capacity)
         return -1;
@@ -471,7 +888,7 @@ static int write_sam_record(const char *in_buf, char *out_buf,
     
     /* Copy part after FLAG */
     unsigned long after_flag_offset = rec->flag_offset + rec->flag_len;
-    unsigned long after_flag_len = rec->line_offset + rec->line_len - after_flag_offset;
+    unsigned long after_flag_len = rec->line_offset + line_len - after_flag_offset;
     memcpy(out_buf + *out_pos, in_buf + after_flag_offset, after_flag_len);
     *out_pos += after_flag_len;
     
@@ -537,15 +954,15 @@ static int markdup_core(const char *in_buf, char *out_buf,
         }
         
         sam_record_t *rec = &list->records[list->count];
-        if (parse_sam_line_markdup(in_buf + line_start, line_start, line_len, rec, &list->ref_map) < 0) {
-            continue;
-        }
+        int r = parse_sam_line_markdup(in_buf + line_start, line_start, line_len, rec, list);
+        if (r == -2) goto cleanup;
+        if (r < 0) continue;
         
         list->count++;
     }
 
     /* Mark duplicates using sort-based algorithm */
-    mark_duplicates_sorted(list);
+    mark_duplicates_sorted(list, in_buf);
     
     /* Second pass: write output */
     unsigned long out_pos = 0;
@@ -573,7 +990,7 @@ static int markdup_core(const char *in_buf, char *out_buf,
 
     /* Write records */
     for (int i = 0; i < list->count; i++) {
-        if (write_sam_record(in_buf, out_buf, &out_pos, out_buf_capacity, &list->records[i]) < 0) {
+        if (write_sam_record(in_buf, out_buf, &out_pos, out_buf_capacity, list, &list->records[i]) < 0) {
             goto cleanup;
         }
     }
@@ -588,6 +1005,161 @@ cleanup:
     return ret;
 }
 
+// ==================== sidecar 快速路径 ====================
+//
+// splitter 写出的 sidecar（SamIdxEntry）里已经有行偏移、contig id、POS、FLAG、
+// mate 信息和 FLAG/QUAL 偏移，这里直接构造 LineInfo / sam_record_t，跳过逐字节解析。
+// 输出顺序与文本路径一致：排序仍按 RNAME 字节序 + POS + 原始顺序；
+// 去重用的 tid 也按文本路径的“首次出现顺序”重新编号。
+// sidecar 由主核读入主存，从核与 in_buf 一样直接访问。
+
+/* sidecar contig id -> 按首次出现顺序编号（对应 get_ref_id） */
+typedef struct {
+    int32_t src[MAX_REFS];
+    int count;
+} tid_remap_t;
+
+static int remap_tid(tid_remap_t *m, int32_t tid) {
+    if (tid < 0) return -1;
+    for (int i = 0; i < m->count; i++) {
+        if (m->src[i] == tid) return i;
+    }
+    if (m->count >= MAX_REFS) return -1;
+    m->src[m->count] = tid;
+    return m->count++;
+}
+
+/* 只用 sidecar 记录填 LineInfo，不读文本。行长度（含行尾的 '\r' 和 '\n'，主核已核对过
+   line_tail）和排序键都由 splitter 按 parse_sam_lines 的规则算好；sort_rname 已由主核换成
+   RNAME 的字节序名次，排序结果与文本路径相同。sidecar 的 valid（至少 11 列）只用于去重 */
+static void lineinfo_from_index(const SamIdxEntry *e, int k, LineInfo *info) {
+    info->start      = (unsigned long)e->line_offset;
+    info->len        = (unsigned long)e->line_len + (unsigned long)e->line_tail;
+    info->rname      = 0;
+    info->rname_len  = 0;
+    info->rname_rank = e->sort_rname;
+    info->rec_id     = k;
+    info->valid      = (e->sort_rname >= 0);
+    info->pos        = info->valid ? (long)e->sort_pos : -1;
+}
+
+static int record_from_index(const SamIdxEntry *e, tid_remap_t *remap,
+                             record_list_t *list, sam_record_t *rec) {
+    memset(rec, 0, sizeof(sam_record_t));
+    rec->line_offset = (uint32_t)e->line_offset;
+    rec->flag_offset = (uint32_t)(e->line_offset + e->flag_off);
+    rec->flag_len    = (uint16_t)e->flag_len;
+    rec->pos         = e->pos;
+    rec->mate_pos    = e->mate_pos;
+    rec->flag        = e->flag;
+
+    // 与 parse_sam_line_markdup 相同：先 RNAME 后 RNEXT 登记 id
+    rec->tid = (int16_t)remap_tid(remap, e->tid);
+    if (e->mate_tid == e->tid) rec->mate_tid = rec->tid;
+    else                       rec->mate_tid = (int16_t)remap_tid(remap, e->mate_tid);
+
+    if (rec->flag & BAM_FPAIRED) {
+        rec->orientation = (rec->flag & BAM_FREVERSE) ? 1 : 0;
+        rec->orientation |= ((rec->flag & BAM_FMREVERSE) ? 1 : 0) << 1;
+    }
+
+    // 分数在去重扫描时按 QUAL 偏移现算（偏移已由主核检查在行内）
+    return rec_set_len_qual(list, rec, (unsigned long)e->line_len, (unsigned long)e->qual_off);
+}
+
+/* 排序和/或去重，全部基于 sidecar；失败返回 -1（调用方回退为 out_size=0） */
+static int process_with_index(const char *in_buf, char *out_buf,
+                              unsigned long size, unsigned long out_buf_capacity,
+                              const SamIdxEntry *idx, unsigned long n,
+                              unsigned long data_offset, int mode,
+                              unsigned long *out_size, SortStats *st) {
+    int ret = -1;
+    int i;
+    int n_lines = (int)n;
+    LineInfo *lines = 0;
+    sam_record_t *recs = 0;
+    tid_remap_t *remap = 0;
+    record_list_t list;
+
+    list.long_recs = 0;
+    list.long_count = 0;
+    list.long_capacity = 0;
+
+    sort_stats_init(st);
+    if (out_size) *out_size = 0;
+    if (data_offset > size || data_offset > out_buf_capacity) return -1;
+
+    // 1) 排序：得到记录的输出顺序
+    if (n_lines > 0) {
+        lines = (LineInfo*)malloc(sizeof(LineInfo) * (unsigned long)n_lines);
+        if (!lines) return -1;
+        for (i = 0; i < n_lines; ++i) {
+            lineinfo_from_index(&idx[i], i, &lines[i]);
+            sort_stats_add(st, i > 0 ? &lines[i - 1] : 0, &lines[i]);
+        }
+        if (mode != MODE_MARKDUP_ONLY) {
+            sort_lines(lines, n_lines, st);
+        }
+    }
+
+    memcpy(out_buf, in_buf, data_offset);
+    unsigned long out_pos = data_offset;
+
+    if (mode == MODE_SORT_ONLY) {
+        for (i = 0; i < n_lines; ++i) {
+            if (copy_sorted_line(out_buf, &out_pos, out_buf_capacity, in_buf, &lines[i]) < 0) goto cleanup;
+        }
+        if (out_size) *out_size = out_pos;
+        ret = 0;
+        goto cleanup;
+    }
+
+    // 2) 去重：按上面的顺序构造记录（与 markdup_core 一致，只取第 10 个 tab 后还有内容的行）
+    remap = (tid_remap_t*)malloc(sizeof(tid_remap_t));
+    if (!remap) goto cleanup;
+    remap->count = 0;
+
+    int count = 0;
+    if (n_lines > 0) {
+        recs = (sam_record_t*)malloc(sizeof(sam_record_t) * (unsigned long)n_lines);
+        if (!recs) goto cleanup;
+    }
+    for (i = 0; i < n_lines; ++i) {
+        const SamIdxEntry *e = &idx[lines[i].rec_id];
+        if (!e->valid || e->qual_off >= e->line_len) {
+            // parse_sam_line_markdup 对丢弃的行也登记了 RNAME / RNEXT 的 id
+            remap_tid(remap, e->tid);
+            remap_tid(remap, e->mate_tid);
+            continue;
+        }
+        if (record_from_index(e, remap, &list, &recs[count++]) < 0) goto cleanup;
+    }
+
+    list.records  = recs;
+    list.count    = count;
+    list.capacity = count;
+    if (count > 1) {
+        qsort(recs, count, sizeof(sam_record_t), compare_records_stable);
+    }
+    mark_duplicates_scan(&list, in_buf);
+
+    for (i = 0; i < count; i++) {
+        if (write_sam_record(in_buf, out_buf, &out_pos, out_buf_capacity, &list, &recs[i]) < 0) {
+            goto cleanup;
+        }
+    }
+
+    if (out_size) *out_size = out_pos;
+    ret = 0;
+
+cleanup:
+    if (lines) free(lines);
+    if (recs) free(recs);
+    if (remap) free(remap);
+    if (list.long_recs) free(list.long_recs);
+    return ret;
+}
+
 // ==================== 从核入口函数 ====================
 
 // 从核入口：每个 CPE 负责 paras[_PEN] 这一份
@@ -602,6 +1174,10 @@ void sam_process_cpe(SamProcessPara paras[64])
     unsigned long size    = para->size;
     unsigned long out_buf_capacity = para->out_buf_capacity;
     int           mode    = para->mode;
+    SortStats     st;
+
+    sort_stats_init(&st);
+    sort_report(para, &st);
 
     if (!in_buf || !out_buf || size == 0) {
         return;
@@ -612,14 +1188,44 @@ void sam_process_cpe(SamProcessPara paras[64])
         out_buf_capacity = size;
     }
 
+    // header 为 SO:coordinate 且从核确认确实有序时才跳过排序；有 sidecar 时
+    // sort_lines 按统计结果自己会跳过已经有序的输入，不需要再扫文本
+    int in_order = para->presorted && !para->idx && mode != MODE_MARKDUP_ONLY &&
+                   lines_in_order(in_buf, size);
+
     // 根据模式选择处理流程
-    if (mode == MODE_SORT_ONLY) {
+    if (in_order && mode == MODE_SORT_ONLY) {
+        // 输入已按坐标排序：直接复制（与排序路径一样，给没有结尾 '\n' 的最后一行补上）
+        memcpy(out_buf, in_buf, size);
+        unsigned long out_pos = size;
+        if (in_buf[size - 1] != '\n' && out_pos < out_buf_capacity) out_buf[out_pos++] = '\n';
+        *(para->out_size) = out_pos;
+
+    } else if (para->idx) {
+        // 有 sidecar：直接用预解析字段排序/去重，跳过文本解析
+        int ret = process_with_index(in_buf, out_buf, size, out_buf_capacity,
+                                     para->idx, para->idx_count, para->idx_data_offset,
+                                     mode, para->out_size, &st);
+        if (ret != 0) {
+            *(para->out_size) = 0;
+        }
+        sort_report(para, &st);
+
+    } else if (in_order) {
+        // MODE_ALL 且输入已按坐标排序：直接去重
+        int ret = markdup_core(in_buf, out_buf, size, out_buf_capacity, para->out_size);
+        if (ret != 0) {
+            *(para->out_size) = 0;
+        }
+
+    } else if (mode == MODE_SORT_ONLY) {
         // 仅排序
         LineInfo *lines = 0;
-        int n_lines = parse_sam_lines(in_buf, size, &lines);
+        int n_lines = parse_sam_lines(in_buf, size, &lines, &st);
 
-        if (n_lines > 1 && lines) {
-            quicksort_lineinfo(lines, 0, n_lines - 1);
+        if (lines) {
+            sort_lines(lines, n_lines, &st);
+            sort_report(para, &st);
         }
 
         // 按排序结果写入 out_buf
@@ -627,11 +1233,7 @@ void sam_process_cpe(SamProcessPara paras[64])
         int i;
         for (i = 0; i < n_lines; ++i) {
             if (lines[i].len == 0) continue;
-            if (out_pos + lines[i].len > size) break;
-            memcpy(out_buf + out_pos,
-                   in_buf  + lines[i].start,
-                   (unsigned long)lines[i].len);
-            out_pos += lines[i].len;
+            if (copy_sorted_line(out_buf, &out_pos, out_buf_capacity, in_buf, &lines[i]) < 0) break;
         }
 
         *(para->out_size) = out_pos;
@@ -649,21 +1251,18 @@ void sam_process_cpe(SamProcessPara paras[64])
         // 先排序再去重
         // 第一步：排序到 out_buf
         LineInfo *lines = 0;
-        int n_lines = parse_sam_lines(in_buf, size, &lines);
+        int n_lines = parse_sam_lines(in_buf, size, &lines, &st);
 
-        if (n_lines > 1 && lines) {
-            quicksort_lineinfo(lines, 0, n_lines - 1);
+        if (lines) {
+            sort_lines(lines, n_lines, &st);
+            sort_report(para, &st);
         }
 
         unsigned long out_pos = 0;
         int i;
         for (i = 0; i < n_lines; ++i) {
             if (lines[i].len == 0) continue;
-            if (out_pos + lines[i].len > size) break;
-            memcpy(out_buf + out_pos,
-                   in_buf  + lines[i].start,
-                   (unsigned long)lines[i].len);
-            out_pos += lines[i].len;
+            if (copy_sorted_line(out_buf, &out_pos, out_buf_capacity, in_buf, &lines[i]) < 0) break;
         }
         if (lines) free(lines);
         
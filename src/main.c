@@ -15,6 +15,7 @@
 //   ./sw_sam_process --all <input_dir> <output_dir>        # 排序 + 去重
 //   ./sw_sam_process --sort <input_dir> <output_dir>       # 仅排序
 //   ./sw_sam_process --markdup <input_dir> <output_dir>    # 仅去重
+//   ./sw_sam_process --all <input_dir> <output_dir> region_auto.txt   # 按 region 大小调度
 //
 // 说明：
 //   - input_dir: 输入 SAM 文件目录
@@ -23,6 +24,10 @@
 //   - --sort: 仅按 RNAME（染色体）+ POS（位置）排序
 //   - --markdup: 仅标记重复序列（需要输入已排序的文件）
 //   - 单个文件大小限制：100MB（可调整 MAX_BUF_SIZE）
+//   - 输入目录中的 unmapped.sam（splitter 的 catch-all）不排序不去重，
+//     所有 region 处理完后原样拷到输出目录（文件名不变）
+//   - 输入文件 xxx.sam 旁边有 xxx.sidx（splitter 的 --sidecar）时，从核直接使用
+//     sidecar 中预解析的字段，不再解析文本
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -43,6 +48,26 @@ extern void slave_sam_process_cpe(SamProcessPara paras[64]);
 #define MAX_BASENAME    128
 #define MAX_BUF_SIZE    (100UL * 1024UL * 1024UL)   // 100MB
 
+// 一个输入文件对应的 sidecar（xxx.sidx），没有时 entries 为 NULL
+typedef struct {
+    SamIdxEntry  *entries;
+    unsigned long count;
+    unsigned long data_offset;
+} SidecarInfo;
+
+// SORT_ALGO_* 在运行统计里的名字
+static const char *sort_algo_name(int algo)
+{
+    switch (algo) {
+    case SORT_ALGO_SORTED:   return "already-sorted";
+    case SORT_ALGO_MERGE:    return "natural-merge";
+    case SORT_ALGO_COUNTING: return "counting";
+    case SORT_ALGO_RADIX:    return "radix";
+    case SORT_ALGO_INTRO:    return "introsort";
+    default:                 return "none";
+    }
+}
+
 static double now_ms()
 {
     struct timeval tv;
@@ -115,6 +140,266 @@ static int prepare_output_directory(const char *path)
     return 0;
 }
 
+// 检查 buffer 开头的 header 中 @HD 行是否带 SO:coordinate
+// （auto_region --sorted 产生的 region 文件已经按 POS 排好序）。
+// 这只是提示：SO 也可能是从比对程序的 header 原样抄来的，从核会先确认确实有序再跳过排序
+static int is_coordinate_sorted(const char *buf, unsigned long size)
+{
+    unsigned long pos = 0;
+    while (pos < size && buf[pos] == '@') {
+        unsigned long line_start = pos;
+        while (pos < size && buf[pos] != '\n') pos++;
+        unsigned long line_end = pos;
+        if (pos < size) pos++;
+
+        if (line_end - line_start < 3 || strncmp(buf + line_start, "@HD", 3) != 0)
+            continue;
+
+        const char *tag = "\tSO:coordinate";
+        unsigned long tag_len = strlen(tag);
+        unsigned long i;
+        for (i = line_start; i + tag_len <= line_end; ++i) {
+            if (memcmp(buf + i, tag, tag_len) == 0 &&
+                (i + tag_len == line_end || buf[i + tag_len] == '\t' ||
+                 buf[i + tag_len] == '\r')) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+    return 0;
+}
+
+// 判断文件名是否以 suffix 结尾
+static int has_suffix(const char *name, const char *suffix)
+{
+    size_t n = strlen(name);
+    size_t m = strlen(suffix);
+    return n >= m && strcmp(name + n - m, suffix) == 0;
+}
+
+// 逐条检查 sidecar 记录与 SAM buffer 是否对得上：记录从 data_offset 开始首尾相接、
+// 覆盖全部数据行（行尾只能是若干 '\r' 加 '\n' 或文件结尾），字段偏移都落在行内。
+// 过期的 / 其它切分留下的 sidecar 在这里被拒绝，从核可以不再做边界检查。
+static int sidecar_matches_sam(const SamIdxEntry *e, unsigned long n,
+                               unsigned long data_offset,
+                               const char *buf, unsigned long size)
+{
+    unsigned long expect = data_offset;   // 下一条记录应当开始的位置
+    unsigned long i;
+    for (i = 0; i < n; ++i, ++e) {
+        if (e->line_offset != expect) return 0;
+        if (e->line_len == 0 || e->line_len > size - e->line_offset) return 0;
+        if (e->qual_off > e->line_len) return 0;
+        if (e->valid && (unsigned long)e->flag_off + e->flag_len >= e->line_len) return 0;
+
+        unsigned long end = e->line_offset + e->line_len;
+        while (end < size && buf[end] == '\r') ++end;
+        if (end < size) {
+            if (buf[end] != '\n') return 0;
+            ++end;
+        }
+        if (end - e->line_offset - e->line_len != e->line_tail) return 0;
+        expect = end;
+    }
+    return expect == size;
+}
+
+// sidecar 名表里的一个名字
+typedef struct {
+    const char *name;
+    uint32_t    len;
+    int32_t     id;
+} SidecarName;
+
+// 与从核 cmp_rname 相同：按字节比较，短的在前
+static int cmp_sidecar_name(const void *a, const void *b)
+{
+    const SidecarName *x = (const SidecarName*)a;
+    const SidecarName *y = (const SidecarName*)b;
+    uint32_t len = (x->len < y->len) ? x->len : y->len;
+    int r = len ? memcmp(x->name, y->name, len) : 0;
+    if (r != 0) return r;
+    if (x->len != y->len) return (x->len < y->len) ? -1 : 1;
+    return 0;
+}
+
+// 把排序键的 sort_rname 从名表下标换成名字的字节序名次（同名同名次），
+// 从核比较 RNAME 时只比名次，排序结果与按文本比较 RNAME 相同。
+// 名表格式不对或下标越界返回 -1
+static int sidecar_rank_rnames(SamIdxEntry *e, unsigned long n,
+                               const char *table, uint32_t n_rnames, uint32_t bytes)
+{
+    SidecarName *names = NULL;
+    int32_t *rank = NULL;
+    int ret = -1;
+    uint32_t k;
+    unsigned long i, off = 0;
+
+    if (n_rnames > 0) {
+        names = (SidecarName*)malloc(sizeof(SidecarName) * n_rnames);
+        rank  = (int32_t*)malloc(sizeof(int32_t) * n_rnames);
+        if (!names || !rank) goto out;
+    }
+    for (k = 0; k < n_rnames; ++k) {
+        uint32_t len;
+        if (bytes - off < sizeof(len)) goto out;
+        memcpy(&len, table + off, sizeof(len));
+        off += sizeof(len);
+        if (bytes - off < len) goto out;
+        names[k].name = table + off;
+        names[k].len  = len;
+        names[k].id   = (int32_t)k;
+        off += len;
+    }
+    if (off != bytes) goto out;
+
+    if (n_rnames > 0) qsort(names, n_rnames, sizeof(SidecarName), cmp_sidecar_name);
+    for (k = 0; k < n_rnames; ++k) {
+        if (k > 0 && cmp_sidecar_name(&names[k - 1], &names[k]) == 0)
+            rank[names[k].id] = rank[names[k - 1].id];
+        else
+            rank[names[k].id] = (int32_t)k;
+    }
+    for (i = 0; i < n; ++i) {
+        if (e[i].sort_rname < 0) continue;
+        if ((uint32_t)e[i].sort_rname >= n_rnames) goto out;
+        e[i].sort_rname = rank[e[i].sort_rname];
+    }
+    ret = 0;
+out:
+    free(names);
+    free(rank);
+    return ret;
+}
+
+// 读取 SAM 文件对应的 sidecar：xxx.sam -> xxx.sidx
+// 成功返回 0 并填好 sc；不存在或校验失败返回 -1（退回文本解析）。
+static int load_sidecar(const char *sam_path, const char *sam_buf, unsigned long sam_size,
+                        SidecarInfo *sc)
+{
+    char idx_path[MAX_PATH_LEN];
+    size_t n = strlen(sam_path);
+
+    sc->entries = NULL;
+    sc->count = 0;
+    sc->data_offset = 0;
+
+    if (has_suffix(sam_path, ".sam")) n -= 4;
+    if (n + strlen(SAM_IDX_SUFFIX) + 1 > sizeof(idx_path)) return -1;
+    memcpy(idx_path, sam_path, n);
+    strcpy(idx_path + n, SAM_IDX_SUFFIX);
+
+    FILE *fp = fopen(idx_path, "rb");
+    if (!fp) return -1;
+
+    SamIdxHeader h;
+    if (fread(&h, sizeof(h), 1, fp) != 1 ||
+        h.magic != SAM_IDX_MAGIC || h.version != SAM_IDX_VERSION ||
+        h.data_offset > sam_size) {
+        fprintf(stderr, "  Warning: invalid sidecar %s, falling back to text parsing\n", idx_path);
+        fclose(fp);
+        return -1;
+    }
+
+    SamIdxEntry *entries = NULL;
+    char *rnames = NULL;
+    if (h.n_records > 0) {
+        entries = (SamIdxEntry*)malloc(sizeof(SamIdxEntry) * (size_t)h.n_records);
+        if (!entries ||
+            fread(entries, sizeof(SamIdxEntry), (size_t)h.n_records, fp) != h.n_records) {
+            fprintf(stderr, "  Warning: truncated sidecar %s, falling back to text parsing\n", idx_path);
+            if (entries) free(entries);
+            fclose(fp);
+            return -1;
+        }
+    }
+    if (h.rnames_bytes > 0) {
+        rnames = (char*)malloc(h.rnames_bytes);
+        if (!rnames || fread(rnames, 1, h.rnames_bytes, fp) != h.rnames_bytes) {
+            fprintf(stderr, "  Warning: truncated sidecar %s, falling back to text parsing\n", idx_path);
+            if (rnames) free(rnames);
+            if (entries) free(entries);
+            fclose(fp);
+            return -1;
+        }
+    }
+    fclose(fp);
+
+    int ranked = sidecar_rank_rnames(entries, (unsigned long)h.n_records,
+                                     rnames, h.n_rnames, h.rnames_bytes);
+    if (rnames) free(rnames);
+
+    // 每条记录都要与 SAM 对得上（sidecar 过期或不匹配时退回文本解析）
+    if (ranked != 0 ||
+        !sidecar_matches_sam(entries, (unsigned long)h.n_records, (unsigned long)h.data_offset,
+                             sam_buf, sam_size)) {
+        fprintf(stderr, "  Warning: sidecar %s does not match SAM, falling back to text parsing\n", idx_path);
+        if (entries) free(entries);
+        return -1;
+    }
+
+    sc->entries = entries;
+    sc->count = (unsigned long)h.n_records;
+    sc->data_offset = (unsigned long)h.data_offset;
+    return 0;
+}
+
+// 一个待处理的输入文件；bytes 来自 region_auto.txt（没给时不用）
+typedef struct {
+    char          name[MAX_BASENAME];
+    unsigned long bytes;
+} InputFile;
+
+static int cmp_input_name(const void *a, const void *b)
+{
+    return strcmp(((const InputFile*)a)->name, ((const InputFile*)b)->name);
+}
+
+// 大文件在前；一样大时按文件名，保证调度顺序确定
+static int cmp_input_bytes_desc(const void *a, const void *b)
+{
+    const InputFile *x = (const InputFile*)a;
+    const InputFile *y = (const InputFile*)b;
+    if (x->bytes != y->bytes) return (x->bytes > y->bytes) ? -1 : 1;
+    return strcmp(x->name, y->name);
+}
+
+// 读 region_auto.txt（check_sam / auto_region --plan-only 写出的
+// chr start end bytes records mapped），得到 region 文件名 chr_start_end.sam -> 字节数，
+// 按文件名排序以便 bsearch。没有第 4 列的行跳过。返回条目数，打开失败返回 -1。
+static int load_region_sizes(const char *path, InputFile **out)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "Error: Cannot open region list %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    InputFile *arr = NULL;
+    int n = 0, cap = 0;
+    char line[1024];
+    while (fgets(line, sizeof(line), fp)) {
+        char chr[256];
+        long long start, end;
+        double bytes;
+        if (line[0] == '#') continue;
+        if (sscanf(line, "%255s %lld %lld %lf", chr, &start, &end, &bytes) != 4) continue;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 1024;
+            InputFile *na = (InputFile*)realloc(arr, (size_t)cap * sizeof(InputFile));
+            if (!na) break;
+            arr = na;
+        }
+        snprintf(arr[n].name, MAX_BASENAME, "%s_%lld_%lld.sam", chr, start, end);
+        arr[n].bytes = bytes > 0 ? (unsigned long)bytes : 0;
+        n++;
+    }
+    fclose(fp);
+    if (n > 0) qsort(arr, (size_t)n, sizeof(InputFile), cmp_input_name);
+    *out = arr;
+    return n;
+}
+
 // 生成输出文件名
 // 输入: input.sam, 模式: MODE_SORT_ONLY -> 输出: input.sorted.sam
 // 输入: input.sam, 模式: MODE_MARKDUP_ONLY -> 输出: input.markdup.sam
@@ -164,7 +449,10 @@ static void process_batch(int batch_count,
                           char *in_bufs[],
                           char *out_bufs[],
                           unsigned long sizes[],
+                          int presorted[],
+                          SidecarInfo sidecars[],
                           int mode,
+                          int sort_algo_files[],
                           double *sort_ms_acc,
                           double *write_ms_acc)
 {
@@ -180,15 +468,27 @@ static void process_batch(int batch_count,
         paras[i].size    = 0;
         paras[i].out_buf_capacity = 0;
         paras[i].out_size = &(out_sizes[i]);
+        paras[i].presorted = 0;
+        paras[i].idx = 0;
+        paras[i].idx_count = 0;
+        paras[i].idx_data_offset = 0;
+        paras[i].sort_algo = SORT_ALGO_NONE;
+        paras[i].sort_runs = 0;
+        paras[i].sort_distinct = 0;
+        paras[i].sort_span = -1;
     }
 
     for (i = 0; i < batch_count; ++i) {
         paras[i].in_buf  = in_bufs[i];
         paras[i].out_buf = out_bufs[i];
         paras[i].size    = sizes[i];
-        // 输出 buffer 容量是输入大小的 1.05 倍
-        paras[i].out_buf_capacity = (unsigned long)((double)sizes[i] * 1.05);
+        // 输出 buffer 容量是输入大小的 1.05 倍（再加 1 字节，见读文件处）
+        paras[i].out_buf_capacity = (unsigned long)((double)sizes[i] * 1.05) + 1;
         paras[i].mode    = mode;
+        paras[i].presorted = presorted[i];
+        paras[i].idx = sidecars[i].entries;
+        paras[i].idx_count = sidecars[i].count;
+        paras[i].idx_data_offset = sidecars[i].data_offset;
     }
 
     double t0 = now_ms();
@@ -215,6 +515,12 @@ static void process_batch(int batch_count,
         }
     }
     printf("  All input buffers freed\n");
+    for (i = 0; i < batch_count; ++i) {
+        if (sidecars[i].entries) {
+            free(sidecars[i].entries);
+            sidecars[i].entries = NULL;
+        }
+    }
 
     // 写回文件
     printf("  Writing results to output directory...\n");
@@ -227,6 +533,14 @@ static void process_batch(int batch_count,
         
         unsigned long out_size = *(paras[i].out_size); // CPE 写回的实际输出长度
         printf("    Output size: %lu bytes (%.2f MB)\n", out_size, out_size / (1024.0 * 1024.0));
+        if (paras[i].sort_algo != SORT_ALGO_NONE) {
+            printf("    Sort: %s (runs=%lu, distinct POS~%lu, span=%ld)\n",
+                   sort_algo_name(paras[i].sort_algo), paras[i].sort_runs,
+                   paras[i].sort_distinct, paras[i].sort_span);
+        }
+        if (paras[i].sort_algo >= 0 && paras[i].sort_algo < SORT_ALGO_NUM) {
+            sort_algo_files[paras[i].sort_algo]++;
+        }
         
         // 检查 out_size 是否异常
         if (out_size > sizes[i] * 2) {
@@ -282,10 +596,56 @@ static void process_batch(int batch_count,
            t1 - t0, write_success, write_failed);
 }
 
+// catch-all 文件（unmapped.sam）不经过从核：分块流式拷到输出目录，
+// 不受 MAX_BUF_SIZE 限制。成功返回 0。
+static int copy_catch_all(const char *in_path, const char *out_path, double *write_ms_acc)
+{
+    double t0 = now_ms();
+    FILE *fin = fopen(in_path, "rb");
+    if (!fin) {
+        fprintf(stderr, "fopen input failed: %s (%s)\n", in_path, strerror(errno));
+        return -1;
+    }
+    FILE *fout = fopen(out_path, "wb");
+    if (!fout) {
+        fprintf(stderr, "fopen output failed: %s (%s)\n", out_path, strerror(errno));
+        fclose(fin);
+        return -1;
+    }
+
+    const size_t chunk = 4UL * 1024UL * 1024UL;
+    char *buf = (char*)malloc(chunk);
+    int ret = buf ? 0 : -1;
+    unsigned long total = 0;
+    while (ret == 0) {
+        size_t n = fread(buf, 1, chunk, fin);
+        if (n == 0) break;
+        if (fwrite(buf, 1, n, fout) != n) ret = -1;
+        total += n;
+    }
+    if (ferror(fin)) ret = -1;
+    free(buf);
+    fclose(fin);
+    if (fclose(fout) != 0) ret = -1;
+
+    double t1 = now_ms();
+    *write_ms_acc += (t1 - t0);
+    if (ret != 0) {
+        fprintf(stderr, "copy failed: %s -> %s\n", in_path, out_path);
+    } else {
+        printf("  Copied %s (%.2f MB) unchanged in %.3f ms\n",
+               out_path, total / (1024.0 * 1024.0), t1 - t0);
+    }
+    return ret;
+}
+
 // 主函数：
 //   argv[1] = 模式选项（--all, --sort, --markdup）
 //   argv[2] = 输入目录
 //   argv[3] = 输出目录
+//   argv[4] = 可选，region_auto.txt（带 bytes 列）：按其中的字节数从大到小调度文件，
+//             每批 64 个文件大小接近，一批的耗时不再被个别大文件拖长；
+//             不给时按目录遍历顺序处理
 //
 // 工作流程：
 //   1. 解析命令行参数，确定处理模式
@@ -293,12 +653,13 @@ static void process_batch(int batch_count,
 //   3. 将文件读入内存缓冲区
 //   4. 每凑满 64 个文件（或遍历完成），调用从核批量处理
 //   5. 将处理结果写入输出目录
+//   5.5 unmapped.sam（catch-all）跳过从核，所有 region 处理完后原样拷到输出目录
 //   6. 输出统计信息（读取、处理、写入耗时）
 int main(int argc, char **argv)
 {
     if (argc < 4) {
         fprintf(stderr,
-                "Usage: %s <mode> <input_dir> <output_dir>\n"
+                "Usage: %s <mode> <input_dir> <output_dir> [region_auto.txt]\n"
                 "Modes:\n"
                 "  --all      : Sort + Mark duplicates (full pipeline)\n"
                 "  --sort     : Sort only (by RNAME + POS)\n"
@@ -329,6 +690,7 @@ int main(int argc, char **argv)
 
     const char *in_dir  = argv[2];
     const char *out_dir = argv[3];
+    const char *region_list = (argc > 4) ? argv[4] : NULL;
 
     const char *mode_name = (mode == MODE_ALL) ? "Sort+Markdup" :
                             (mode == MODE_SORT_ONLY) ? "Sort" : "Markdup";
@@ -370,23 +732,85 @@ int main(int argc, char **argv)
     char *in_bufs[BATCH_SIZE];
     char *out_bufs[BATCH_SIZE];
     unsigned long sizes[BATCH_SIZE];
-    for (int i = 0; i < BATCH_SIZE; i++) sizes[i] = 0;
+    int presorted[BATCH_SIZE];
+    SidecarInfo sidecars[BATCH_SIZE];
+    for (int i = 0; i < BATCH_SIZE; i++) {
+        sizes[i] = 0;
+        presorted[i] = 0;
+        sidecars[i].entries = NULL;
+        sidecars[i].count = 0;
+        sidecars[i].data_offset = 0;
+    }
+    int total_presorted = 0;
+    int total_sidecar = 0;
+    int sort_algo_files[SORT_ALGO_NUM] = {0};
 
     int batch_count = 0;
+    int has_catch_all = 0;
 
+    // 先收集全部输入文件，再决定处理顺序
+    InputFile *files = NULL;
+    int n_files = 0, cap_files = 0;
     struct dirent *ent;
     while ((ent = readdir(dir)) != NULL) {
         if (ent->d_name[0] == '.') continue;  // skip . and ..
+        if (has_suffix(ent->d_name, SAM_IDX_SUFFIX)) continue;  // sidecar 随 SAM 一起读
+        if (strcmp(ent->d_name, SAM_CATCH_ALL_NAME) == 0) {      // 不排序不去重，最后处理
+            has_catch_all = 1;
+            continue;
+        }
+        if (n_files == cap_files) {
+            cap_files = cap_files ? cap_files * 2 : 1024;
+            InputFile *nf = (InputFile*)realloc(files, (size_t)cap_files * sizeof(InputFile));
+            if (!nf) {
+                fprintf(stderr, "Error: Out of memory listing %s\n", in_dir);
+                return 1;
+            }
+            files = nf;
+        }
+        snprintf(files[n_files].name, MAX_BASENAME, "%s", ent->d_name);
+        files[n_files].bytes = 0;
+        n_files++;
+    }
+    closedir(dir);
+
+    // 按 region_auto.txt 中的大小调度（大文件先处理，同批文件大小接近）；
+    // 列表里没有的文件才 stat 一次
+    if (region_list) {
+        InputFile *sizes_tab = NULL;
+        int n_tab = load_region_sizes(region_list, &sizes_tab);
+        if (n_tab < 0) return 1;
+        int n_listed = 0;
+        for (int i = 0; i < n_files; ++i) {
+            InputFile *hit = n_tab > 0 ?
+                (InputFile*)bsearch(&files[i], sizes_tab, (size_t)n_tab, sizeof(InputFile), cmp_input_name) : NULL;
+            if (hit) {
+                files[i].bytes = hit->bytes;
+                n_listed++;
+            } else {
+                char path[MAX_PATH_LEN];
+                struct stat st;
+                snprintf(path, sizeof(path), "%s/%s", in_dir, files[i].name);
+                if (stat(path, &st) == 0) files[i].bytes = (unsigned long)st.st_size;
+            }
+        }
+        free(sizes_tab);
+        qsort(files, (size_t)n_files, sizeof(InputFile), cmp_input_bytes_desc);
+        printf("Scheduling %d files by size from %s (%d listed)\n\n", n_files, region_list, n_listed);
+    }
+
+    for (int fi = 0; fi < n_files; ++fi) {
+        const char *fname = files[fi].name;
 
         // 路径/文件名
         snprintf(batch_basenames[batch_count], MAX_BASENAME,
-                 "%s", ent->d_name);
+                 "%s", fname);
         snprintf(batch_inpaths[batch_count], MAX_PATH_LEN,
-                 "%s/%s", in_dir, ent->d_name);
+                 "%s/%s", in_dir, fname);
         
         // 生成输出文件名
         char output_filename[MAX_BASENAME];
-        generate_output_filename(ent->d_name, mode, output_filename, sizeof(output_filename));
+        generate_output_filename(fname, mode, output_filename, sizeof(output_filename));
         snprintf(batch_outpaths[batch_count], MAX_PATH_LEN,
                  "%s/%s", out_dir, output_filename);
 
@@ -408,7 +832,7 @@ int main(int argc, char **argv)
         }
         
         printf("Reading file [%d]: %s (%.2f MB)\n", 
-               total_files + 1, ent->d_name, fsize / (1024.0 * 1024.0));
+               total_files + 1, fname, fsize / (1024.0 * 1024.0));
 
         double t0 = now_ms();
 
@@ -425,7 +849,8 @@ int main(int argc, char **argv)
             // 输入和输出 buffer 都分配为 1.05 倍，因为：
             // 1. markdup 时 FLAG 字段可能变大（例如 "12" -> "1036"）
             // 2. MODE_ALL 模式下需要在 in_buf 和 out_buf 之间交换数据
-            unsigned long buf_size = (unsigned long)((double)fsize * 1.05);
+            // 另外多留 1 字节：排序时给没有结尾 '\n' 的最后一行补换行
+            unsigned long buf_size = (unsigned long)((double)fsize * 1.05) + 1;
             ibuf = (char*)malloc((size_t)buf_size);
             obuf = (char*)malloc((size_t)buf_size);
             if (!ibuf || !obuf) {
@@ -455,6 +880,17 @@ int main(int argc, char **argv)
         in_bufs[batch_count]  = ibuf;
         out_bufs[batch_count] = obuf;
         sizes[batch_count]    = fsize;
+        presorted[batch_count] = ibuf ? is_coordinate_sorted(ibuf, fsize) : 0;
+        if (presorted[batch_count]) {
+            printf("  Header is SO:coordinate, CPE will skip sorting if the records are in order\n");
+            total_presorted++;
+        }
+        if (ibuf && load_sidecar(batch_inpaths[batch_count], ibuf, fsize,
+                                 &sidecars[batch_count]) == 0) {
+            printf("  Using sidecar index (%lu records), CPE will skip text parsing\n",
+                   sidecars[batch_count].count);
+            total_sidecar++;
+        }
 
         batch_count++;
         total_files++;
@@ -465,8 +901,8 @@ int main(int argc, char **argv)
             printf("\n--- Processing Batch %d (%d files) ---\n", total_batches, batch_count);
             process_batch(batch_count,
                           batch_inpaths, batch_outpaths,
-                          in_bufs, out_bufs, sizes,
-                          mode,
+                          in_bufs, out_bufs, sizes, presorted, sidecars,
+                          mode, sort_algo_files,
                           &sort_ms, &write_ms);
             printf("Batch %d completed\n\n", total_batches);
 
@@ -476,6 +912,7 @@ int main(int argc, char **argv)
                 in_bufs[i] = NULL;
                 out_bufs[i] = NULL;
                 sizes[i] = 0;
+                presorted[i] = 0;
             }
             batch_count = 0;
         }
@@ -487,8 +924,8 @@ int main(int argc, char **argv)
         printf("\n--- Processing Final Batch %d (%d files) ---\n", total_batches, batch_count);
         process_batch(batch_count,
                       batch_inpaths, batch_outpaths,
-                      in_bufs, out_bufs, sizes,
-                      mode,
+                      in_bufs, out_bufs, sizes, presorted, sidecars,
+                      mode, sort_algo_files,
                       &sort_ms, &write_ms);
         printf("Final batch completed\n\n");
         int i;
@@ -497,10 +934,21 @@ int main(int argc, char **argv)
             in_bufs[i] = NULL;
             out_bufs[i] = NULL;
             sizes[i] = 0;
+            presorted[i] = 0;
         }
     }
 
-    closedir(dir);
+    free(files);
+
+    // unmapped / 不在任何 region 的记录：放在所有 region 之后，原样输出
+    if (has_catch_all) {
+        char ca_in[MAX_PATH_LEN];
+        char ca_out[MAX_PATH_LEN];
+        snprintf(ca_in, sizeof(ca_in), "%s/%s", in_dir, SAM_CATCH_ALL_NAME);
+        snprintf(ca_out, sizeof(ca_out), "%s/%s", out_dir, SAM_CATCH_ALL_NAME);
+        printf("\n--- Passing through %s ---\n", SAM_CATCH_ALL_NAME);
+        copy_catch_all(ca_in, ca_out, &write_ms);
+    }
 
     double total_end = now_ms();
     double total_ms  = total_end - total_start;
@@ -511,6 +959,14 @@ int main(int argc, char **argv)
     printf("Mode              : %s\n", mode_name);
     printf("Total batches     : %d\n", total_batches);
     printf("Files processed   : %d\n", total_files);
+    printf("Presorted files   : %d\n", total_presorted);
+    printf("Sidecar files     : %d\n", total_sidecar);
+    if (mode != MODE_MARKDUP_ONLY) {
+        printf("Sort engines      : sorted=%d merge=%d counting=%d radix=%d introsort=%d\n",
+               sort_algo_files[SORT_ALGO_SORTED], sort_algo_files[SORT_ALGO_MERGE],
+               sort_algo_files[SORT_ALGO_COUNTING], sort_algo_files[SORT_ALGO_RADIX],
+               sort_algo_files[SORT_ALGO_INTRO]);
+    }
     printf("----------------------------------------\n");
     printf("Read time         : %.3f ms (%.2f%%)\n", read_ms, (read_ms / total_ms) * 100);
     printf("Process(CPE) time : %.3f ms (%.2f%%)\n", sort_ms, (sort_ms / total_ms) * 100);
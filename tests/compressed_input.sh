@@ -0,0 +1,49 @@
+#!/bin/bash
+# sam_input.h 的压缩输入回归：
+#   - BGZF 数据块数为 510 / 511 / 512（511 时最后一批只剩 EOF 标记块）
+#   - 普通 gzip 末尾带全 0 填充（zcat 接受）
+# 每种输入用 split_from_region 切分，结果必须与未压缩输入的切分逐字节相同。
+set -e
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+T=$(mktemp -d)
+trap 'rm -rf "$T"' EXIT
+
+g++ -O2 "$ROOT/pre-tools/split_from_region.cpp" -o "$T/split_from_region" -lz -pthread 2> /dev/null
+
+python3 - "$T" <<'PY'
+import gzip, struct, sys, zlib
+t = sys.argv[1]
+lines = ["@HD\tVN:1.6\tSO:unsorted\n", "@SQ\tSN:chr1\tLN:248956422\n"]
+for i in range(2048):
+    lines.append("r%d\t0\tchr1\t%d\t60\t4M\t*\t0\t0\tACGT\tIIII\n" % (i, 1 + i * 37 % 90000))
+data = "".join(lines).encode()
+open(t + "/plain.sam", "wb").write(data)
+
+def bgzf_block(d):
+    c = zlib.compressobj(6, zlib.DEFLATED, -15)
+    cd = c.compress(d) + c.flush()
+    return (struct.pack("<BBBBIBBHBBHH", 31, 139, 8, 4, 0, 0, 255, 6, 66, 67, 2, 18 + len(cd) + 8 - 1)
+            + cd + struct.pack("<II", zlib.crc32(d) & 0xffffffff, len(d)))
+
+for n in (510, 511, 512):
+    cut = [len(data) * k // n for k in range(n + 1)]
+    chunks = [data[cut[k]:cut[k + 1]] for k in range(n)]
+    with open("%s/bgzf%d.sam.gz" % (t, n), "wb") as f:
+        for c in chunks:
+            f.write(bgzf_block(c))
+        f.write(bgzf_block(b""))
+
+open(t + "/padded.sam.gz", "wb").write(gzip.compress(data) + b"\0" * 1024)
+PY
+
+echo "chr1 1 100000" > "$T/region.txt"
+"$T/split_from_region" "$T/region.txt" "$T/plain.sam" "$T/out_plain" > /dev/null 2>&1
+for f in bgzf510 bgzf511 bgzf512 padded; do
+    if ! "$T/split_from_region" "$T/region.txt" "$T/$f.sam.gz" "$T/out_$f" > "$T/$f.log" 2>&1; then
+        echo "FAIL: $f.sam.gz"
+        cat "$T/$f.log"
+        exit 1
+    fi
+    diff -r "$T/out_plain" "$T/out_$f" > /dev/null || { echo "FAIL: $f.sam.gz output differs"; exit 1; }
+done
+echo "PASS"